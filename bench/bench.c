@@ -0,0 +1,400 @@
+#define _GNU_SOURCE
+
+// Runs dirHash over the synthetic trees made by gen_tree and reports, per
+// profile and page cache state, files/s, GB/s, syscalls per file and peak
+// RSS as JSON, one case per line. Given a baseline written by an earlier
+// run, it also flags every case whose files/s dropped by more than the
+// tolerance and exits with status 1.
+//
+// Usage: bench [--dirhash PATH] [--gen PATH] [--dir DIR] [--scale X]
+//              [--profiles LIST] [--runs N] [--args "ARGS"] [--out FILE]
+//              [--baseline FILE] [--tolerance FRACTION]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define MAX_ARGS 64
+#define MAX_RUNS 32
+
+typedef struct {
+    double wall;
+    double traversal;
+    long peak_rss_kb;
+} RunResult;
+
+typedef struct {
+    uint64_t files;
+    uint64_t bytes;
+} TreeSize;
+
+static TreeSize tree_size;
+static int evict_failed;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int count_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)path;
+    (void)ftw;
+    if (type == FTW_F && S_ISREG(st->st_mode)) {
+        tree_size.files++;
+        tree_size.bytes += st->st_size;
+    }
+    return 0;
+}
+
+// Drops the cached pages of every file. Clean pages go without root; the
+// dentry and inode caches only go if /proc/sys/vm/drop_caches is writable.
+static int evict_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)ftw;
+    if (type == FTW_F && S_ISREG(st->st_mode)) {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) != 0) {
+            evict_failed = 1;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    return 0;
+}
+
+static int drop_caches(const char *root) {
+    sync();
+    evict_failed = 0;
+    nftw(root, evict_entry, 64, FTW_PHYS);
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY | O_CLOEXEC);
+    int dropped = fd >= 0 && write(fd, "3\n", 2) == 2;
+    if (fd >= 0) {
+        close(fd);
+    }
+    return !evict_failed || dropped;
+}
+
+static void split_args(char *args, char **argv, int *argc) {
+    char *save;
+    for (char *tok = strtok_r(args, " ", &save); tok && *argc < MAX_ARGS - 2; tok = strtok_r(NULL, " ", &save)) {
+        argv[(*argc)++] = tok;
+    }
+}
+
+// Runs argv with its output captured, and takes the traversal time from
+// the line dirHash prints for it. Returns -1 if the run failed.
+static int run_once(char *const argv[], RunResult *result) {
+    int pipefd[2];
+    if (pipe(pipefd) < 0) {
+        perror("Failed to create pipe");
+        exit(EXIT_FAILURE);
+    }
+    double start = now();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Failed to fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        dup2(pipefd[1], STDOUT_FILENO);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    close(pipefd[1]);
+
+    FILE *out = fdopen(pipefd[0], "r");
+    char line[4096];
+    result->traversal = 0;
+    while (fgets(line, sizeof(line), out)) {
+        sscanf(line, "Directory traversal completed in %lf seconds.", &result->traversal);
+    }
+    fclose(out);
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0) {
+        perror("Failed to wait for dirHash");
+        exit(EXIT_FAILURE);
+    }
+    result->wall = now() - start;
+    result->peak_rss_kb = usage.ru_maxrss;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+// Counts the system calls of one run, over all of its threads, by tracing
+// it. io_uring requests are not system calls and do not count. Returns -1
+// where tracing is not permitted.
+static long count_syscalls(char *const argv[]) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Failed to fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0) {
+            _exit(126);
+        }
+        raise(SIGSTOP);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status)) {
+        return -1;
+    }
+    ptrace(PTRACE_SETOPTIONS, pid, NULL,
+           (void *)(long)(PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL));
+    ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+    // Every call stops the tracee twice, on entry and on exit.
+    long stops = 0;
+    int failed = 0;
+    for (;;) {
+        pid_t tid = waitpid(-1, &status, __WALL);
+        if (tid < 0) {
+            break;
+        }
+        if (tid == pid && WIFEXITED(status)) {
+            failed = WEXITSTATUS(status) != 0;
+        }
+        if (!WIFSTOPPED(status)) {
+            continue;
+        }
+        int sig = WSTOPSIG(status);
+        if (sig == (SIGTRAP | 0x80)) {
+            stops++;
+            sig = 0;
+        } else if (sig == SIGTRAP || sig == SIGSTOP) {
+            sig = 0;
+        }
+        ptrace(PTRACE_SYSCALL, tid, NULL, (void *)(long)sig);
+    }
+    return failed ? -1 : stops / 2;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Returns the files/s recorded for case name and cache state in the
+// baseline, or 0 if it has none.
+static double baseline_rate(const char *baseline, const char *name, const char *cache) {
+    FILE *f = fopen(baseline, "r");
+    if (!f) {
+        return 0;
+    }
+    char key[128];
+    snprintf(key, sizeof(key), "\"name\": \"%s\", \"cache\": \"%s\"", name, cache);
+    char line[4096];
+    double rate = 0;
+    while (fgets(line, sizeof(line), f)) {
+        const char *field = strstr(line, "\"files_per_s\": ");
+        if (strstr(line, key) && field) {
+            rate = strtod(field + strlen("\"files_per_s\": "), NULL);
+            break;
+        }
+    }
+    fclose(f);
+    return rate;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--dirhash PATH] [--gen PATH] [--dir DIR] [--scale X] [--profiles LIST]\n"
+                    "       [--runs N] [--args \"ARGS\"] [--out FILE] [--baseline FILE] [--tolerance FRACTION]\n",
+            prog);
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        {"dirhash", required_argument, NULL, 'x'},
+        {"gen", required_argument, NULL, 'g'},
+        {"dir", required_argument, NULL, 'd'},
+        {"scale", required_argument, NULL, 's'},
+        {"profiles", required_argument, NULL, 'p'},
+        {"runs", required_argument, NULL, 'r'},
+        {"args", required_argument, NULL, 'a'},
+        {"out", required_argument, NULL, 'o'},
+        {"baseline", required_argument, NULL, 'b'},
+        {"tolerance", required_argument, NULL, 't'},
+        {NULL, 0, NULL, 0}
+    };
+
+    const char *dirhash = "./dirHash";
+    const char *gen = "./bench/gen_tree";
+    const char *dir = "/tmp/dirhash-bench";
+    const char *scale = "0.01";
+    char *profiles = strdup("small,large,deep,flat,mixed");
+    int runs = 3;
+    char *extra_args = NULL;
+    const char *out_path = NULL;
+    const char *baseline = NULL;
+    double tolerance = 0.10;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "x:g:d:s:p:r:a:o:b:t:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'x': dirhash = optarg; break;
+            case 'g': gen = optarg; break;
+            case 'd': dir = optarg; break;
+            case 's': scale = optarg; break;
+            case 'p': free(profiles); profiles = strdup(optarg); break;
+            case 'r': runs = atoi(optarg); break;
+            case 'a': extra_args = strdup(optarg); break;
+            case 'o': out_path = optarg; break;
+            case 'b': baseline = optarg; break;
+            case 't': tolerance = strtod(optarg, NULL); break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc || runs < 1 || runs > MAX_RUNS || !profiles) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE *out = out_path ? fopen(out_path, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "Failed to create %s: %s\n", out_path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    fprintf(out, "{\"scale\": %s, \"runs\": %d, \"cases\": [\n", scale, runs);
+
+    int regressions = 0;
+    int first = 1;
+    char *save;
+    for (char *profile = strtok_r(profiles, ",", &save); profile; profile = strtok_r(NULL, ",", &save)) {
+        char root[4096], marker[4096 + 8];
+        snprintf(root, sizeof(root), "%s/%s", dir, profile);
+        snprintf(marker, sizeof(marker), "%s.done", root);
+
+        // Trees are reused as long as they were generated at this scale.
+        char recorded[64] = "";
+        FILE *m = fopen(marker, "r");
+        if (m) {
+            if (!fgets(recorded, sizeof(recorded), m)) {
+                recorded[0] = '\0';
+            }
+            fclose(m);
+        }
+        recorded[strcspn(recorded, "\n")] = '\0';
+        if (strtod(recorded, NULL) != strtod(scale, NULL) || recorded[0] == '\0') {
+            char *gen_argv[] = { (char *)gen, profile, (char *)dir, (char *)scale, NULL };
+            RunResult ignored;
+            fprintf(stderr, "Generating %s at scale %s\n", root, scale);
+            if (run_once(gen_argv, &ignored) < 0) {
+                fprintf(stderr, "Failed to generate %s\n", root);
+                return EXIT_FAILURE;
+            }
+        }
+
+        tree_size.files = 0;
+        tree_size.bytes = 0;
+        nftw(root, count_entry, 64, FTW_PHYS);
+
+        char *run_argv[MAX_ARGS];
+        int run_argc = 0;
+        char *args_copy = extra_args ? strdup(extra_args) : NULL;
+        run_argv[run_argc++] = (char *)dirhash;
+        if (args_copy) {
+            split_args(args_copy, run_argv, &run_argc);
+        }
+        run_argv[run_argc++] = root;
+        run_argv[run_argc] = NULL;
+
+        long syscalls = count_syscalls(run_argv);
+
+        static const char *const caches[] = { "warm", "cold" };
+        for (int c = 0; c < 2; ++c) {
+            double walls[MAX_RUNS], traversals[MAX_RUNS];
+            long peak_rss = 0;
+            int cold = c == 1;
+            int evicted = 1;
+            // One untimed run brings the tree into the page cache.
+            RunResult result;
+            if (!cold && run_once(run_argv, &result) < 0) {
+                fprintf(stderr, "dirHash failed on %s\n", root);
+                return EXIT_FAILURE;
+            }
+            for (int r = 0; r < runs; ++r) {
+                if (cold && !drop_caches(root)) {
+                    evicted = 0;
+                    break;
+                }
+                if (run_once(run_argv, &result) < 0) {
+                    fprintf(stderr, "dirHash failed on %s\n", root);
+                    return EXIT_FAILURE;
+                }
+                walls[r] = result.wall;
+                traversals[r] = result.traversal;
+                if (result.peak_rss_kb > peak_rss) {
+                    peak_rss = result.peak_rss_kb;
+                }
+            }
+            if (cold && !evicted) {
+                fprintf(stderr, "Could not evict %s from the page cache; skipping cold runs\n", root);
+                continue;
+            }
+            qsort(walls, runs, sizeof(double), compare_doubles);
+            qsort(traversals, runs, sizeof(double), compare_doubles);
+            double wall = walls[runs / 2];
+            double traversal = traversals[runs / 2];
+            double files_per_s = wall > 0 ? tree_size.files / wall : 0;
+            double gb_per_s = wall > 0 ? tree_size.bytes / wall / 1e9 : 0;
+
+            fprintf(out, "%s{\"name\": \"%s\", \"cache\": \"%s\", \"files\": %lu, \"bytes\": %lu, "
+                         "\"wall_s\": %.6f, \"traversal_s\": %.6f, \"hashing_s\": %.6f, "
+                         "\"files_per_s\": %.1f, \"gb_per_s\": %.4f, ",
+                    first ? "" : ",\n", profile, caches[c], (unsigned long)tree_size.files,
+                    (unsigned long)tree_size.bytes, wall, traversal, wall - traversal, files_per_s, gb_per_s);
+            if (syscalls >= 0 && tree_size.files > 0) {
+                fprintf(out, "\"syscalls_per_file\": %.3f, ", (double)syscalls / tree_size.files);
+            } else {
+                fprintf(out, "\"syscalls_per_file\": null, ");
+            }
+            fprintf(out, "\"peak_rss_kb\": %ld}", peak_rss);
+            first = 0;
+
+            double base = baseline ? baseline_rate(baseline, profile, caches[c]) : 0;
+            if (base > 0) {
+                double change = files_per_s / base - 1;
+                fprintf(stderr, "%-6s %s: %.1f files/s, %+.1f%% against baseline\n", profile, caches[c],
+                        files_per_s, change * 100);
+                if (change < -tolerance) {
+                    fprintf(stderr, "Regression: %s %s is below baseline by more than %.0f%%\n", profile,
+                            caches[c], tolerance * 100);
+                    regressions++;
+                }
+            } else {
+                fprintf(stderr, "%-6s %s: %.1f files/s, %.3f GB/s\n", profile, caches[c], files_per_s, gb_per_s);
+            }
+        }
+        free(args_copy);
+    }
+    fprintf(out, "\n]}\n");
+    if (out != stdout) {
+        fclose(out);
+    }
+    free(profiles);
+    free(extra_args);
+    return regressions ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,190 @@
+#define _GNU_SOURCE
+
+// Generates the synthetic trees used by the benchmark. Contents are
+// pseudo-random but fixed for a given profile and scale, so digests are
+// comparable between runs.
+//
+// Usage: gen_tree PROFILE DIR [SCALE]
+//
+// Creates DIR/PROFILE, replacing any earlier copy, and writes DIR/PROFILE.done
+// holding the scale once the tree is complete. SCALE multiplies the file
+// counts of the profile, which at 1 are:
+//   small  1,000,000 files of 1 KiB, 1000 per directory
+//   large  1000 files of 1 GiB
+//   deep   100,000 files of 4 KiB spread over a 50-level chain
+//   flat   1,000,000 files of 64 bytes in one directory
+//   mixed  100,000 files, 90% up to 16 KiB, 9% up to 1 MiB and 1% up to
+//          64 MiB, 1000 per directory
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define BLOCK_SIZE (1024 * 1024)
+#define FILES_PER_DIR 1000
+#define DEEP_LEVELS 50
+
+static uint64_t splitmix64(uint64_t *state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static void die(const char *what, const char *path) {
+    fprintf(stderr, "%s %s: %s\n", what, path, strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+static void make_dir(const char *path) {
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+        die("Failed to create directory", path);
+    }
+}
+
+static void write_file(const char *path, uint64_t size, uint64_t seed, uint64_t *buf) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        die("Failed to create file", path);
+    }
+    for (uint64_t offset = 0; offset < size; offset += BLOCK_SIZE) {
+        size_t len = size - offset < BLOCK_SIZE ? (size_t)(size - offset) : BLOCK_SIZE;
+        uint64_t state = seed ^ (offset * 0xD6E8FEB86659FD93ULL);
+        for (size_t i = 0; i < (len + 7) / 8; ++i) {
+            buf[i] = splitmix64(&state);
+        }
+        for (size_t done = 0; done < len;) {
+            ssize_t n = write(fd, (const char *)buf + done, len - done);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                die("Failed to write", path);
+            }
+            done += (size_t)n;
+        }
+    }
+    if (close(fd) < 0) {
+        die("Failed to write", path);
+    }
+}
+
+static int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)st;
+    (void)type;
+    (void)ftw;
+    if (remove(path) < 0) {
+        die("Failed to remove", path);
+    }
+    return 0;
+}
+
+static uint64_t mixed_size(uint64_t *state) {
+    uint64_t r = splitmix64(state);
+    uint64_t pick = r % 100;
+    uint64_t limit = pick < 90 ? 16ULL << 10 : pick < 99 ? 1ULL << 20 : 64ULL << 20;
+    return (r >> 8) % (limit + 1);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3 || argc > 4) {
+        fprintf(stderr, "Usage: %s small|large|deep|flat|mixed DIR [SCALE]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *profile = argv[1];
+    const char *dir = argv[2];
+    double scale = argc == 4 ? strtod(argv[3], NULL) : 1.0;
+
+    uint64_t base_count;
+    if (strcmp(profile, "small") == 0 || strcmp(profile, "flat") == 0) {
+        base_count = 1000000;
+    } else if (strcmp(profile, "large") == 0) {
+        base_count = 1000;
+    } else if (strcmp(profile, "deep") == 0 || strcmp(profile, "mixed") == 0) {
+        base_count = 100000;
+    } else {
+        fprintf(stderr, "Unknown profile: %s\n", profile);
+        return EXIT_FAILURE;
+    }
+    uint64_t count = (uint64_t)(base_count * scale + 0.5);
+    if (count == 0) {
+        count = 1;
+    }
+
+    make_dir(dir);
+    size_t root_len = strlen(dir) + strlen(profile) + 2;
+    char *root = malloc(root_len);
+    char *marker = malloc(root_len + sizeof(".done"));
+    char *path = malloc(root_len + DEEP_LEVELS * 4 + 64);
+    uint64_t *buf = malloc(BLOCK_SIZE);
+    if (!root || !marker || !path || !buf) {
+        perror("Failed to allocate buffers");
+        return EXIT_FAILURE;
+    }
+    snprintf(root, root_len, "%s/%s", dir, profile);
+    snprintf(marker, root_len + sizeof(".done"), "%s.done", root);
+    unlink(marker);
+    if (access(root, F_OK) == 0 && nftw(root, remove_entry, 64, FTW_DEPTH | FTW_PHYS) < 0) {
+        die("Failed to remove", root);
+    }
+    make_dir(root);
+
+    uint64_t seed = 0;
+    for (const char *p = profile; *p; ++p) {
+        seed = seed * 131 + (uint8_t)*p;
+    }
+    uint64_t sizes = seed;
+    uint64_t bytes = 0;
+    for (uint64_t i = 0; i < count; ++i) {
+        uint64_t size;
+        if (strcmp(profile, "small") == 0) {
+            size = 1024;
+        } else if (strcmp(profile, "large") == 0) {
+            size = 1ULL << 30;
+        } else if (strcmp(profile, "deep") == 0) {
+            size = 4096;
+        } else if (strcmp(profile, "flat") == 0) {
+            size = 64;
+        } else {
+            size = mixed_size(&sizes);
+        }
+
+        int len = snprintf(path, root_len + 1, "%s", root);
+        if (strcmp(profile, "small") == 0 || strcmp(profile, "mixed") == 0) {
+            len += sprintf(path + len, "/d%05lu", (unsigned long)(i / FILES_PER_DIR));
+            if (i % FILES_PER_DIR == 0) {
+                make_dir(path);
+            }
+        } else if (strcmp(profile, "deep") == 0) {
+            // File i lives at level i % DEEP_LEVELS of the chain.
+            for (uint64_t level = 0; level <= i % DEEP_LEVELS; ++level) {
+                len += sprintf(path + len, "/l%02lu", (unsigned long)level);
+                if (i < DEEP_LEVELS && level == i % DEEP_LEVELS) {
+                    make_dir(path);
+                }
+            }
+        }
+        sprintf(path + len, "/f%07lu", (unsigned long)i);
+        write_file(path, size, seed ^ (i * 0xA24BAED4963EE407ULL), buf);
+        bytes += size;
+    }
+
+    sync();
+    FILE *done = fopen(marker, "w");
+    if (!done || fprintf(done, "%g\n", scale) < 0 || fclose(done) != 0) {
+        die("Failed to write", marker);
+    }
+    printf("Generated %s: %lu files, %lu bytes\n", root, (unsigned long)count, (unsigned long)bytes);
+
+    free(root);
+    free(marker);
+    free(path);
+    free(buf);
+    return EXIT_SUCCESS;
+}
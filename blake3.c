@@ -0,0 +1,340 @@
+#include "blake3.h"
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#define CHUNK_START 1
+#define CHUNK_END 2
+#define PARENT 4
+#define ROOT 8
+#define SIMD_CHUNKS 8
+
+static const uint32_t IV[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+// Message word schedule for each of the seven rounds.
+static const uint8_t SCHEDULE[7][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+    {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+    {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+    {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+    {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+    {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+};
+
+static inline uint32_t load32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint32_t rotr32(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+#define G(a, b, c, d, x, y)           \
+    do {                              \
+        v[a] = v[a] + v[b] + (x);     \
+        v[d] = rotr32(v[d] ^ v[a], 16); \
+        v[c] = v[c] + v[d];           \
+        v[b] = rotr32(v[b] ^ v[c], 12); \
+        v[a] = v[a] + v[b] + (y);     \
+        v[d] = rotr32(v[d] ^ v[a], 8);  \
+        v[c] = v[c] + v[d];           \
+        v[b] = rotr32(v[b] ^ v[c], 7);  \
+    } while (0)
+
+// Runs the compression function and leaves the full 16-word output in out.
+static void compress(const uint32_t cv[8], const uint8_t block[64], uint8_t block_len, uint64_t counter,
+                     uint8_t flags, uint32_t out[16]) {
+    uint32_t m[16];
+    for (int i = 0; i < 16; ++i) {
+        m[i] = load32(block + 4 * i);
+    }
+    uint32_t v[16] = {
+        cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+        IV[0], IV[1], IV[2], IV[3], (uint32_t)counter, (uint32_t)(counter >> 32), block_len, flags,
+    };
+    for (int r = 0; r < 7; ++r) {
+        const uint8_t *s = SCHEDULE[r];
+        G(0, 4, 8, 12, m[s[0]], m[s[1]]);
+        G(1, 5, 9, 13, m[s[2]], m[s[3]]);
+        G(2, 6, 10, 14, m[s[4]], m[s[5]]);
+        G(3, 7, 11, 15, m[s[6]], m[s[7]]);
+        G(0, 5, 10, 15, m[s[8]], m[s[9]]);
+        G(1, 6, 11, 12, m[s[10]], m[s[11]]);
+        G(2, 7, 8, 13, m[s[12]], m[s[13]]);
+        G(3, 4, 9, 14, m[s[14]], m[s[15]]);
+    }
+    for (int i = 0; i < 8; ++i) {
+        out[i] = v[i] ^ v[i + 8];
+        out[i + 8] = v[i + 8] ^ cv[i];
+    }
+}
+
+static void compress_cv(uint32_t cv[8], const uint8_t block[64], uint8_t block_len, uint64_t counter,
+                        uint8_t flags) {
+    uint32_t out[16];
+    compress(cv, block, block_len, counter, flags, out);
+    memcpy(cv, out, 8 * sizeof(uint32_t));
+}
+
+// Hashes whole chunks input[0 .. count * BLAKE3_CHUNK_LEN) with counters
+// starting at counter, writing one chaining value per chunk.
+static void hash_chunks_generic(const uint8_t *input, size_t count, uint64_t counter, uint32_t (*cvs)[8]) {
+    for (size_t c = 0; c < count; ++c) {
+        memcpy(cvs[c], IV, sizeof(IV));
+        for (int b = 0; b < BLAKE3_CHUNK_LEN / 64; ++b) {
+            uint8_t flags = (b == 0 ? CHUNK_START : 0) | (b == BLAKE3_CHUNK_LEN / 64 - 1 ? CHUNK_END : 0);
+            compress_cv(cvs[c], input + c * BLAKE3_CHUNK_LEN + b * 64, 64, counter + c, flags);
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static inline __m256i rotr_avx2(__m256i x, int n) {
+    return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+}
+
+#define G8(a, b, c, d, x, y)                                                       \
+    do {                                                                           \
+        v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), (x));                \
+        v[d] = _mm256_shuffle_epi8(_mm256_xor_si256(v[d], v[a]), rot16);           \
+        v[c] = _mm256_add_epi32(v[c], v[d]);                                       \
+        v[b] = rotr_avx2(_mm256_xor_si256(v[b], v[c]), 12);                        \
+        v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), (y));                \
+        v[d] = _mm256_shuffle_epi8(_mm256_xor_si256(v[d], v[a]), rot8);            \
+        v[c] = _mm256_add_epi32(v[c], v[d]);                                       \
+        v[b] = rotr_avx2(_mm256_xor_si256(v[b], v[c]), 7);                         \
+    } while (0)
+
+// Eight chunks at once, one per 32-bit lane: the state and message words
+// are transposed so that the rounds are the scalar rounds on vectors.
+__attribute__((target("avx2")))
+static void hash_chunks_avx2(const uint8_t *input, size_t count, uint64_t counter, uint32_t (*cvs)[8]) {
+    const __m256i rot16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+                                           2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    const __m256i rot8 = _mm256_setr_epi8(1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12,
+                                          1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12);
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i offsets = _mm256_mullo_epi32(lanes, _mm256_set1_epi32(BLAKE3_CHUNK_LEN));
+
+    size_t c = 0;
+    for (; c + SIMD_CHUNKS <= count; c += SIMD_CHUNKS) {
+        const uint8_t *base = input + c * BLAKE3_CHUNK_LEN;
+        uint64_t ctr[SIMD_CHUNKS];
+        for (int l = 0; l < SIMD_CHUNKS; ++l) {
+            ctr[l] = counter + c + l;
+        }
+        __m256i ctr_lo = _mm256_setr_epi32((int)ctr[0], (int)ctr[1], (int)ctr[2], (int)ctr[3], (int)ctr[4],
+                                           (int)ctr[5], (int)ctr[6], (int)ctr[7]);
+        __m256i ctr_hi = _mm256_setr_epi32((int)(ctr[0] >> 32), (int)(ctr[1] >> 32), (int)(ctr[2] >> 32),
+                                           (int)(ctr[3] >> 32), (int)(ctr[4] >> 32), (int)(ctr[5] >> 32),
+                                           (int)(ctr[6] >> 32), (int)(ctr[7] >> 32));
+        __m256i h[8];
+        for (int i = 0; i < 8; ++i) {
+            h[i] = _mm256_set1_epi32((int)IV[i]);
+        }
+
+        for (int b = 0; b < BLAKE3_CHUNK_LEN / 64; ++b) {
+            __m256i m[16];
+            for (int w = 0; w < 16; ++w) {
+                m[w] = _mm256_i32gather_epi32((const int *)(base + b * 64 + 4 * w), offsets, 1);
+            }
+            uint8_t flags = (b == 0 ? CHUNK_START : 0) | (b == BLAKE3_CHUNK_LEN / 64 - 1 ? CHUNK_END : 0);
+            __m256i v[16] = {
+                h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7],
+                _mm256_set1_epi32((int)IV[0]), _mm256_set1_epi32((int)IV[1]),
+                _mm256_set1_epi32((int)IV[2]), _mm256_set1_epi32((int)IV[3]),
+                ctr_lo, ctr_hi, _mm256_set1_epi32(64), _mm256_set1_epi32(flags),
+            };
+            for (int r = 0; r < 7; ++r) {
+                const uint8_t *s = SCHEDULE[r];
+                G8(0, 4, 8, 12, m[s[0]], m[s[1]]);
+                G8(1, 5, 9, 13, m[s[2]], m[s[3]]);
+                G8(2, 6, 10, 14, m[s[4]], m[s[5]]);
+                G8(3, 7, 11, 15, m[s[6]], m[s[7]]);
+                G8(0, 5, 10, 15, m[s[8]], m[s[9]]);
+                G8(1, 6, 11, 12, m[s[10]], m[s[11]]);
+                G8(2, 7, 8, 13, m[s[12]], m[s[13]]);
+                G8(3, 4, 9, 14, m[s[14]], m[s[15]]);
+            }
+            for (int i = 0; i < 8; ++i) {
+                h[i] = _mm256_xor_si256(v[i], v[i + 8]);
+            }
+        }
+
+        uint32_t words[8][SIMD_CHUNKS];
+        for (int i = 0; i < 8; ++i) {
+            _mm256_storeu_si256((__m256i *)words[i], h[i]);
+        }
+        for (int l = 0; l < SIMD_CHUNKS; ++l) {
+            for (int i = 0; i < 8; ++i) {
+                cvs[c + l][i] = words[i][l];
+            }
+        }
+    }
+    hash_chunks_generic(input + c * BLAKE3_CHUNK_LEN, count - c, counter + c, cvs + c);
+}
+
+static int has_avx2(void) {
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE)) {
+        return 0;
+    }
+    unsigned xcr0_lo, xcr0_hi;
+    __asm__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0_lo & 6) != 6) {
+        return 0;
+    }
+    return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_AVX2);
+}
+#endif
+
+typedef void (*HashChunksFn)(const uint8_t *input, size_t count, uint64_t counter, uint32_t (*cvs)[8]);
+
+// Picks the eight-way AVX2 kernel once, on first use, if the CPU has it.
+static HashChunksFn resolve_hash_chunks(void) {
+    static HashChunksFn hash_chunks = NULL;
+    HashChunksFn fn = __atomic_load_n(&hash_chunks, __ATOMIC_RELAXED);
+    if (!fn) {
+        fn = hash_chunks_generic;
+#if defined(__x86_64__) || defined(__i386__)
+        if (has_avx2()) {
+            fn = hash_chunks_avx2;
+        }
+#endif
+        __atomic_store_n(&hash_chunks, fn, __ATOMIC_RELAXED);
+    }
+    return fn;
+}
+
+static void parent_cv(const uint32_t left[8], const uint32_t right[8], uint32_t out[8]) {
+    uint8_t block[64];
+    for (int i = 0; i < 8; ++i) {
+        for (int b = 0; b < 4; ++b) {
+            block[4 * i + b] = (uint8_t)(left[i] >> (8 * b));
+            block[32 + 4 * i + b] = (uint8_t)(right[i] >> (8 * b));
+        }
+    }
+    memcpy(out, IV, sizeof(IV));
+    compress_cv(out, block, 64, 0, PARENT);
+}
+
+// Pushes the chaining value of a completed chunk, first merging every
+// subtree it completes; total_chunks counts the chunks so far.
+static void push_chunk_cv(Blake3State *state, const uint32_t cv[8], uint64_t total_chunks) {
+    uint32_t merged[8];
+    memcpy(merged, cv, sizeof(merged));
+    while ((total_chunks & 1) == 0) {
+        parent_cv(state->cv_stack[--state->cv_stack_len], merged, merged);
+        total_chunks >>= 1;
+    }
+    memcpy(state->cv_stack[state->cv_stack_len++], merged, sizeof(merged));
+}
+
+static void reset_chunk(Blake3State *state, uint64_t counter) {
+    memcpy(state->cv, IV, sizeof(IV));
+    state->chunk_counter = counter;
+    state->block_len = 0;
+    state->blocks_compressed = 0;
+}
+
+static size_t chunk_len(const Blake3State *state) {
+    return (size_t)state->blocks_compressed * 64 + state->block_len;
+}
+
+void blake3_init(Blake3State *state) {
+    reset_chunk(state, 0);
+    state->cv_stack_len = 0;
+}
+
+void blake3_update(Blake3State *state, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    while (len > 0) {
+        if (chunk_len(state) == BLAKE3_CHUNK_LEN) {
+            uint32_t out[16];
+            compress(state->cv, state->block, state->block_len, state->chunk_counter,
+                     CHUNK_END | (state->blocks_compressed == 0 ? CHUNK_START : 0), out);
+            push_chunk_cv(state, out, state->chunk_counter + 1);
+            reset_chunk(state, state->chunk_counter + 1);
+        }
+
+        // Whole chunks that are certainly not the last go through the
+        // vectorized kernel.
+        if (chunk_len(state) == 0 && len > BLAKE3_CHUNK_LEN) {
+            uint32_t cvs[SIMD_CHUNKS * 4][8];
+            size_t count = (len - 1) / BLAKE3_CHUNK_LEN;
+            if (count > SIMD_CHUNKS * 4) {
+                count = SIMD_CHUNKS * 4;
+            }
+            resolve_hash_chunks()(p, count, state->chunk_counter, cvs);
+            for (size_t c = 0; c < count; ++c) {
+                push_chunk_cv(state, cvs[c], state->chunk_counter + c + 1);
+            }
+            reset_chunk(state, state->chunk_counter + count);
+            p += count * BLAKE3_CHUNK_LEN;
+            len -= count * BLAKE3_CHUNK_LEN;
+            continue;
+        }
+
+        if (state->block_len == 64) {
+            compress_cv(state->cv, state->block, 64, state->chunk_counter,
+                        state->blocks_compressed == 0 ? CHUNK_START : 0);
+            state->blocks_compressed++;
+            state->block_len = 0;
+        }
+        size_t take = 64 - state->block_len;
+        if (take > len) {
+            take = len;
+        }
+        size_t room = BLAKE3_CHUNK_LEN - chunk_len(state);
+        if (take > room) {
+            take = room;
+        }
+        memcpy(state->block + state->block_len, p, take);
+        state->block_len += (uint8_t)take;
+        p += take;
+        len -= take;
+    }
+}
+
+void blake3_final(Blake3State *state, uint8_t out[BLAKE3_DIGEST_SIZE]) {
+    // The last chunk's output feeds the parents up the stack; whichever
+    // node ends up on top is compressed again with the ROOT flag.
+    uint32_t cv[8];
+    uint8_t block[64];
+    uint8_t block_len = state->block_len;
+    uint64_t counter = state->chunk_counter;
+    uint8_t flags = CHUNK_END | (state->blocks_compressed == 0 ? CHUNK_START : 0);
+    memcpy(cv, state->cv, sizeof(cv));
+    memset(block, 0, sizeof(block));
+    memcpy(block, state->block, block_len);
+
+    for (size_t n = state->cv_stack_len; n > 0; --n) {
+        uint32_t words[16];
+        compress(cv, block, block_len, counter, flags, words);
+        const uint32_t *left = state->cv_stack[n - 1];
+        for (int i = 0; i < 8; ++i) {
+            for (int b = 0; b < 4; ++b) {
+                block[4 * i + b] = (uint8_t)(left[i] >> (8 * b));
+                block[32 + 4 * i + b] = (uint8_t)(words[i] >> (8 * b));
+            }
+        }
+        memcpy(cv, IV, sizeof(IV));
+        block_len = 64;
+        counter = 0;
+        flags = PARENT;
+    }
+
+    uint32_t words[16];
+    compress(cv, block, block_len, 0, flags | ROOT, words);
+    for (int i = 0; i < 8; ++i) {
+        for (int b = 0; b < 4; ++b) {
+            out[4 * i + b] = (uint8_t)(words[i] >> (8 * b));
+        }
+    }
+}
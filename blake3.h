@@ -0,0 +1,27 @@
+#ifndef BLAKE3_H
+#define BLAKE3_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLAKE3_DIGEST_SIZE 32
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_MAX_DEPTH 54
+
+// Unkeyed BLAKE3 hasher: the state of the chunk being filled plus the stack
+// of chaining values of completed subtrees.
+typedef struct {
+    uint32_t cv[8];
+    uint64_t chunk_counter;
+    uint8_t block[64];
+    uint8_t block_len;
+    uint8_t blocks_compressed;
+    uint8_t cv_stack_len;
+    uint32_t cv_stack[BLAKE3_MAX_DEPTH][8];
+} Blake3State;
+
+void blake3_init(Blake3State *state);
+void blake3_update(Blake3State *state, const void *data, size_t len);
+void blake3_final(Blake3State *state, uint8_t out[BLAKE3_DIGEST_SIZE]);
+
+#endif
@@ -1,95 +1,147 @@
 #include "bloom_filter.h"
-#include "constants.h" 
+#include "constants.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+#include <math.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// Odd multipliers that spread the key over the 32 bit positions of each
+// word.
+static const uint32_t salts[BLOOM_BLOCK_WORDS] __attribute__((aligned(64))) = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU, 0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U,
+    0x9e3779b1U, 0x85ebca77U, 0xc2b2ae3dU, 0x27d4eb2fU, 0x165667b1U, 0xd3a2646bU, 0xfd7046c5U, 0xb55a4f09U,
+};
+
+// Whether lookups use the AVX2 kernel, decided when a filter is created.
+static int use_avx2 = 0;
+
+// Sizes a filter for capacity keys at the given false positive rate. The
+// classic bits-per-key estimate is padded by a fifth to cover the loss from
+// confining each key to one block, then rounded up to a power of two.
+static size_t blocks_for(size_t capacity, double false_positive_rate) {
+    double bits_per_key = -log(false_positive_rate) / (M_LN2 * M_LN2) * 1.2;
+    double bits = (double)(capacity ? capacity : 1) * bits_per_key;
+    size_t block_bits = BLOOM_BLOCK_WORDS * 32;
+    size_t block_count = BLOOM_MIN_BLOCKS;
+    while ((double)block_count * block_bits < bits) {
+        block_count *= 2;
+    }
+    return block_count;
+}
 
-BloomFilter *bloom_filter_init(size_t size) {
+BloomFilter *bloom_filter_init(size_t capacity, double false_positive_rate) {
     BloomFilter *filter = (BloomFilter *)malloc(sizeof(BloomFilter));
     if (!filter) {
         perror("Failed to allocate Bloom filter");
         exit(EXIT_FAILURE);
     }
 
-    filter->bit_array = (uint8_t *)calloc(size, sizeof(uint8_t));
-    if (!filter->bit_array) {
-        perror("Failed to allocate Bloom filter bit array");
+    size_t block_count = blocks_for(capacity, false_positive_rate);
+
+    size_t bytes = block_count * BLOOM_BLOCK_WORDS * sizeof(uint32_t);
+    filter->blocks = (uint32_t *)aligned_alloc(64, bytes);
+    if (!filter->blocks) {
+        perror("Failed to allocate Bloom filter blocks");
         free(filter);
         exit(EXIT_FAILURE);
     }
+    memset(filter->blocks, 0, bytes);
 
-    filter->size = size;
-    filter->seed2 = HASH_SEED + 1;
+    filter->block_count = block_count;
+    filter->mask = block_count - 1;
+#if defined(__x86_64__) || defined(__i386__)
+    use_avx2 = __builtin_cpu_supports("avx2");
+#endif
     return filter;
 }
 
+// Returns filter emptied if it has the size bloom_filter_init() would give
+// for capacity, or a new filter in its place. The size must match exactly,
+// since it decides which keys collide.
+BloomFilter *bloom_filter_reuse(BloomFilter *filter, size_t capacity, double false_positive_rate) {
+    if (filter && filter->block_count == blocks_for(capacity, false_positive_rate)) {
+        memset(filter->blocks, 0, filter->block_count * BLOOM_BLOCK_WORDS * sizeof(uint32_t));
+        return filter;
+    }
+    bloom_filter_free(filter);
+    return bloom_filter_init(capacity, false_positive_rate);
+}
+
 void bloom_filter_free(BloomFilter *filter) {
     if (filter) {
-        free(filter->bit_array);
+        free(filter->blocks);
         free(filter);
     }
 }
 
-void bloom_filter_add(BloomFilter *filter, uint64_t hash) {
-    uint64_t hash1 = hash;
-    uint64_t hash2 = hash ^ filter->seed2;
-
-    size_t index1 = (size_t)(hash1 % filter->size);
-    size_t index2 = (size_t)(hash2 % filter->size);
-
-    uint8_t bit1 = (uint8_t)(1 << (index1 % 8));
-    uint8_t bit2 = (uint8_t)(1 << (index2 % 8));
-
-    size_t byte1 = index1 / 8;
-    size_t byte2 = index2 / 8;
-
-    uint8_t *addr1 = &filter->bit_array[byte1];
-    uint8_t *addr2 = &filter->bit_array[byte2];
-
-    __asm__ __volatile__ (
-        "lock; orb %b1, (%0)"
-        :
-        : "r" (addr1), "iq" (bit1)
-        : "memory"
-    );
-
-    __asm__ __volatile__ (
-        "lock; orb %b1, (%0)"
-        :
-        : "r" (addr2), "iq" (bit2)
-        : "memory"
-    );
+// The low bits of the digest pick the block and the high 32 bits pick the
+// bit set in each word.
+static inline uint32_t *block_for(BloomFilter *filter, uint64_t hash) {
+    return filter->blocks + (size_t)(hash & filter->mask) * BLOOM_BLOCK_WORDS;
 }
 
-int bloom_filter_check(BloomFilter *filter, uint64_t hash) {
-    uint64_t hash1 = hash;
-    uint64_t hash2 = hash ^ filter->seed2;
-
-    size_t index1 = (size_t)(hash1 % filter->size);
-    size_t index2 = (size_t)(hash2 % filter->size);
-
-    uint8_t bit1 = (uint8_t)(1 << (index1 % 8));
-    uint8_t bit2 = (uint8_t)(1 << (index2 % 8));
-
-    size_t byte1 = index1 / 8;
-    size_t byte2 = index2 / 8;
+static inline void block_mask(uint64_t hash, uint32_t mask[BLOOM_BLOCK_WORDS]) {
+    uint32_t key = (uint32_t)(hash >> 32);
+    for (int i = 0; i < BLOOM_BLOCK_WORDS; ++i) {
+        mask[i] = 1U << ((key * salts[i]) >> 27);
+    }
+}
 
-    uint8_t val1, val2;
+void bloom_filter_add(BloomFilter *filter, uint64_t hash) {
+    uint32_t *block = block_for(filter, hash);
+    uint32_t mask[BLOOM_BLOCK_WORDS];
+    block_mask(hash, mask);
+    // Workers add concurrently, and the words of a block are shared.
+    for (int i = 0; i < BLOOM_BLOCK_WORDS; ++i) {
+        if ((__atomic_load_n(&block[i], __ATOMIC_RELAXED) & mask[i]) != mask[i]) {
+            __atomic_fetch_or(&block[i], mask[i], __ATOMIC_RELAXED);
+        }
+    }
+}
 
-    __asm__ __volatile__ (
-        "movb (%1), %0"
-        : "=r" (val1)
-        : "r" (&filter->bit_array[byte1])
-        : "memory"
-    );
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static inline __m256i half_mask(uint32_t key, int half) {
+    __m256i salt = _mm256_load_si256((const __m256i *)(salts + half * 8));
+    __m256i shift = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_set1_epi32((int)key), salt), 27);
+    return _mm256_sllv_epi32(_mm256_set1_epi32(1), shift);
+}
 
-    __asm__ __volatile__ (
-        "movb (%1), %0"
-        : "=r" (val2)
-        : "r" (&filter->bit_array[byte2])
-        : "memory"
-    );
+__attribute__((target("avx2")))
+static int check_avx2(BloomFilter *filter, uint64_t hash) {
+    const uint32_t *block = block_for(filter, hash);
+    uint32_t key = (uint32_t)(hash >> 32);
+    __m256i lo = _mm256_load_si256((const __m256i *)block);
+    __m256i hi = _mm256_load_si256((const __m256i *)(block + 8));
+    return _mm256_testc_si256(lo, half_mask(key, 0)) && _mm256_testc_si256(hi, half_mask(key, 1));
+}
+#endif
 
-    return ((val1 & bit1) && (val2 & bit2)) ? 1 : 0;
+int bloom_filter_check(BloomFilter *filter, uint64_t hash) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (use_avx2) {
+        return check_avx2(filter, hash);
+    }
+#endif
+    const uint32_t *block = block_for(filter, hash);
+    uint32_t mask[BLOOM_BLOCK_WORDS];
+    block_mask(hash, mask);
+    uint32_t missing = 0;
+    for (int i = 0; i < BLOOM_BLOCK_WORDS; ++i) {
+        missing |= ~__atomic_load_n(&block[i], __ATOMIC_RELAXED) & mask[i];
+    }
+    return missing == 0;
 }
 
+// Returns whether hash was already present, adding it if not.
+int bloom_filter_check_and_add(BloomFilter *filter, uint64_t hash) {
+    if (bloom_filter_check(filter, hash)) {
+        return 1;
+    }
+    bloom_filter_add(filter, hash);
+    return 0;
+}
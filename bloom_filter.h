@@ -4,19 +4,23 @@
 #include <stdint.h>
 #include <stdlib.h>
 
-#define BLOOM_FILTER_SIZE (32ULL * 1024ULL * 1024ULL)
 #define HASH_SEED 5381
+#define BLOOM_BLOCK_WORDS 16
 
+// Split-block Bloom filter: every key maps to one 64-byte block, cache-line
+// aligned, and sets one bit in each of its sixteen 32-bit words, so a probe
+// costs a single cache miss. The block count is a power of two.
 typedef struct {
-    uint8_t *bit_array;
-    size_t size;
-    uint64_t seed2;
+    uint32_t *blocks;
+    size_t block_count;
+    uint64_t mask;
 } BloomFilter;
 
-BloomFilter *bloom_filter_init(size_t size);
+BloomFilter *bloom_filter_init(size_t capacity, double false_positive_rate);
+BloomFilter *bloom_filter_reuse(BloomFilter *filter, size_t capacity, double false_positive_rate);
 void bloom_filter_free(BloomFilter *filter);
 void bloom_filter_add(BloomFilter *filter, uint64_t hash);
 int bloom_filter_check(BloomFilter *filter, uint64_t hash);
+int bloom_filter_check_and_add(BloomFilter *filter, uint64_t hash);
 
 #endif
-
@@ -1,13 +1,36 @@
 #ifndef CONSTANTS_H
 #define CONSTANTS_H
 
-#define BLOOM_FILTER_SIZE (32ULL * 1024ULL * 1024ULL)
+#define BLOOM_FALSE_POSITIVE_RATE 0.0001
+#define BLOOM_MIN_BLOCKS 1024
 #define HASH_SEED 5381
 #define PRIME_MULTIPLIER 1000003
 #define MAX_PATH_LENGTH 4096
 #define INITIAL_FILE_LIST_CAPACITY 100000
 #define FILE_BUFFER_SIZE 131072
+#define STREAM_BUFFERS_PER_FILE 3
+#define STREAM_MEMORY_LIMIT (256ULL * 1024ULL * 1024ULL)
 #define QUEUE_DEPTH 64
+#define HUGE_PAGE_SIZE (2ULL * 1024ULL * 1024ULL)
+#define HASH_BATCH_SIZE 1024
+#define DIRFD_CACHE_SIZE 32
+#define FD_RESERVE 64
+#define HASH_CACHE_RACY_WINDOW 1000000000ULL
+#define TREE_CHUNK_SIZE (64ULL * 1024ULL * 1024ULL)
+#define DUPLICATE_PARTIAL_SIZE 4096
+#define DIRECT_IO_ALIGNMENT 4096
+#define PIPELINE_QUEUE_SIZE 1024
+#define MMAP_MIN_SIZE (1024ULL * 1024ULL)
+#define MMAP_SAMPLE_PAGES 16
+#define MMAP_RESIDENT_PERCENT 90
+#define PROGRESS_INTERVAL_MS 250
+#define WATCH_EVENT_BUFFER 65536
+#define WATCH_SETTLE_MS 50
+#define WATCH_MAX_DELAY_MS 1000
+#define WATCH_CLOCK_SLACK (10ULL * 1000000ULL)
+#define WATCH_CLIENT_TIMEOUT_MS 1000
+#define MANIFEST_BLOCK_FILES 128
+#define MANIFEST_WRITE_BUFFER (1024 * 1024)
 
 #endif
 
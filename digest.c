@@ -0,0 +1,207 @@
+#include "digest.h"
+#include "constants.h"
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+static void xxh64_init(DigestState *state) {
+    XXH64_reset(&state->xxh64, HASH_SEED);
+}
+
+static void xxh64_update(DigestState *state, const void *data, size_t len) {
+    XXH64_update(&state->xxh64, data, len);
+}
+
+static void xxh64_final(DigestState *state, uint8_t *out) {
+    XXH64_canonicalFromHash((XXH64_canonical_t *)out, XXH64_digest(&state->xxh64));
+}
+
+// libxxhash dispatches XXH3 to its SSE2, AVX2 or AVX-512 kernel itself.
+// A seeded reset reuses the secret of a state already on that seed, so
+// the state is cleared first.
+static void xxh3_init(DigestState *state) {
+    XXH3_INITSTATE(&state->xxh3);
+    XXH3_64bits_reset_withSeed(&state->xxh3, HASH_SEED);
+}
+
+static void xxh3_update(DigestState *state, const void *data, size_t len) {
+    XXH3_64bits_update(&state->xxh3, data, len);
+}
+
+static void xxh3_final(DigestState *state, uint8_t *out) {
+    XXH64_canonicalFromHash((XXH64_canonical_t *)out, XXH3_64bits_digest(&state->xxh3));
+}
+
+static void xxh128_init(DigestState *state) {
+    XXH3_INITSTATE(&state->xxh3);
+    XXH3_128bits_reset_withSeed(&state->xxh3, HASH_SEED);
+}
+
+static void xxh128_update(DigestState *state, const void *data, size_t len) {
+    XXH3_128bits_update(&state->xxh3, data, len);
+}
+
+static void xxh128_final(DigestState *state, uint8_t *out) {
+    XXH128_canonicalFromHash((XXH128_canonical_t *)out, XXH3_128bits_digest(&state->xxh3));
+}
+
+static void blake3_digest_init(DigestState *state) {
+    blake3_init(&state->blake3);
+}
+
+static void blake3_digest_update(DigestState *state, const void *data, size_t len) {
+    blake3_update(&state->blake3, data, len);
+}
+
+static void blake3_digest_final(DigestState *state, uint8_t *out) {
+    blake3_final(&state->blake3, out);
+}
+
+static void sha256_digest_init(DigestState *state) {
+    sha256_init(&state->sha256);
+}
+
+static void sha256_digest_update(DigestState *state, const void *data, size_t len) {
+    sha256_update(&state->sha256, data, len);
+}
+
+static void sha256_digest_final(DigestState *state, uint8_t *out) {
+    sha256_final(&state->sha256, out);
+}
+
+// CRC32C (Castagnoli), reflected, as computed by the SSE4.2 crc32
+// instruction.
+static uint32_t crc32c_table[256];
+
+static uint32_t crc32c_generic(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len--) {
+        crc = crc32c_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t c = crc;
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        c = _mm_crc32_u64(c, word);
+    }
+    crc = (uint32_t)c;
+    for (; len > 0; --len) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+typedef uint32_t (*Crc32cFn)(uint32_t crc, const uint8_t *p, size_t len);
+
+// Picks the SSE4.2 kernel once, on first use, if the CPU has it, and
+// otherwise fills the table for the portable one.
+static Crc32cFn resolve_crc32c(void) {
+    static Crc32cFn crc32c = NULL;
+    Crc32cFn fn = __atomic_load_n(&crc32c, __ATOMIC_ACQUIRE);
+    if (!fn) {
+        fn = crc32c_generic;
+#if defined(__x86_64__)
+        unsigned eax, ebx, ecx, edx;
+        if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2)) {
+            fn = crc32c_sse42;
+        }
+#endif
+        if (fn == crc32c_generic) {
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t c = i;
+                for (int b = 0; b < 8; ++b) {
+                    c = (c >> 1) ^ (0x82F63B78U & -(c & 1));
+                }
+                crc32c_table[i] = c;
+            }
+        }
+        __atomic_store_n(&crc32c, fn, __ATOMIC_RELEASE);
+    }
+    return fn;
+}
+
+static void crc32c_init(DigestState *state) {
+    state->crc32c = 0xFFFFFFFFU;
+}
+
+static void crc32c_update(DigestState *state, const void *data, size_t len) {
+    state->crc32c = resolve_crc32c()(state->crc32c, (const uint8_t *)data, len);
+}
+
+static void crc32c_final(DigestState *state, uint8_t *out) {
+    uint32_t crc = ~state->crc32c;
+    for (int b = 0; b < 4; ++b) {
+        out[b] = (uint8_t)(crc >> (24 - 8 * b));
+    }
+}
+
+// The id is recorded in hash caches and manifests, so existing ids must never change.
+static const DigestAlgorithm algorithms[] = {
+    {"xxh64", 1, 8, xxh64_init, xxh64_update, xxh64_final},
+    {"xxh3", 2, 8, xxh3_init, xxh3_update, xxh3_final},
+    {"xxh128", 3, 16, xxh128_init, xxh128_update, xxh128_final},
+    {"blake3", 4, BLAKE3_DIGEST_SIZE, blake3_digest_init, blake3_digest_update, blake3_digest_final},
+    {"sha256", 5, SHA256_DIGEST_SIZE, sha256_digest_init, sha256_digest_update, sha256_digest_final},
+    {"crc32c", 6, 4, crc32c_init, crc32c_update, crc32c_final},
+};
+
+const DigestAlgorithm *digest_default(void) {
+    return &algorithms[0];
+}
+
+// Returns the algorithm called name, or NULL if there is none.
+const DigestAlgorithm *digest_find(const char *name) {
+    for (size_t i = 0; i < sizeof(algorithms) / sizeof(algorithms[0]); ++i) {
+        if (strcmp(algorithms[i].name, name) == 0) {
+            return &algorithms[i];
+        }
+    }
+    return NULL;
+}
+
+// Returns the algorithm with the given id, or NULL if there is none.
+const DigestAlgorithm *digest_find_id(uint32_t id) {
+    for (size_t i = 0; i < sizeof(algorithms) / sizeof(algorithms[0]); ++i) {
+        if (algorithms[i].id == id) {
+            return &algorithms[i];
+        }
+    }
+    return NULL;
+}
+
+void digest_buffer(const DigestAlgorithm *alg, const void *data, size_t len, uint8_t *out) {
+    DigestState state;
+    alg->init(&state);
+    alg->update(&state, data, len);
+    alg->final(&state, out);
+}
+
+// The leading bytes of a digest as a big-endian integer, which for XXH64
+// is the hash itself. Used wherever a digest is needed as a 64-bit key; a
+// key of 0 marks a file that failed.
+uint64_t digest_key(const uint8_t *digest, size_t size) {
+    uint64_t key = 0;
+    for (size_t i = 0; i < size && i < 8; ++i) {
+        key = key << 8 | digest[i];
+    }
+    return key;
+}
+
+// Writes the digest as lowercase hex to hex, which must hold 2 * size + 1
+// characters.
+void digest_format(const uint8_t *digest, size_t size, char *hex) {
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < size; ++i) {
+        hex[2 * i] = digits[digest[i] >> 4];
+        hex[2 * i + 1] = digits[digest[i] & 0xF];
+    }
+    hex[2 * size] = '\0';
+}
@@ -0,0 +1,40 @@
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#define XXH_STATIC_LINKING_ONLY
+#include "xxhash.h"
+#include "blake3.h"
+#include "sha256.h"
+
+#define DIGEST_MAX_SIZE 32
+
+typedef union {
+    XXH64_state_t xxh64;
+    XXH3_state_t xxh3;
+    Blake3State blake3;
+    Sha256State sha256;
+    uint32_t crc32c;
+} DigestState;
+
+// A digest algorithm. Digests are byte strings of size bytes in the
+// algorithm's canonical (big-endian) order; each algorithm picks its SIMD
+// kernel at run time from what the CPU supports.
+typedef struct {
+    const char *name;
+    uint32_t id;
+    size_t size;
+    void (*init)(DigestState *state);
+    void (*update)(DigestState *state, const void *data, size_t len);
+    void (*final)(DigestState *state, uint8_t *out);
+} DigestAlgorithm;
+
+const DigestAlgorithm *digest_default(void);
+const DigestAlgorithm *digest_find(const char *name);
+const DigestAlgorithm *digest_find_id(uint32_t id);
+void digest_buffer(const DigestAlgorithm *alg, const void *data, size_t len, uint8_t *out);
+uint64_t digest_key(const uint8_t *digest, size_t size);
+void digest_format(const uint8_t *digest, size_t size, char *hex);
+
+#endif
@@ -3,6 +3,8 @@
 #include "directory_traversal.h"
 #include "file_list.h"
 #include "constants.h" // Include shared constants
+#include "dirfd_cache.h"
+#include "stats.h"
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h> // For close()
@@ -11,6 +13,12 @@
 #include <string.h>
 #include <sys/syscall.h> // For syscall and SYS_getdents64
 #include <linux/limits.h> // For PATH_MAX
+#include <sys/sysmacros.h>
+#include <sys/resource.h>
+#include <errno.h>
+#include <sched.h>
+#include <omp.h>
+#include <liburing.h>
 
 struct linux_dirent64 {
     ino64_t d_ino;            // 64-bit inode number
@@ -48,23 +56,361 @@ struct linux_dirent64 {
 #define DT_WHT 14
 #endif
 
+// An open directory whose subdirectories are still waiting to be read.
+// Each subdirectory is opened relative to fd, so no path is ever resolved
+// from the root. Handles are reference counted by the work items and child
+// handles below them and close their descriptor when the last one goes.
+// When the walk is at its descriptor budget a handle is published with an
+// fd of -1, and its children reopen it through the parent chain instead.
+typedef struct DirHandle {
+    struct DirHandle *parent;
+    char *name;
+    int fd;
+    size_t refs;
+} DirHandle;
+
+typedef struct {
+    DirHandle *parent;
+    char *name;
+    uint32_t id;
+    void *data;
+} WorkItem;
+
+// Per-worker deque of directories still to be read. The owner pushes and
+// pops at the bottom, which keeps its walk depth-first and its deque short;
+// idle workers steal from the top, which hands them the oldest and usually
+// largest subtrees.
+typedef struct {
+    omp_lock_t lock;
+    WorkItem *items;
+    size_t head;
+    size_t count;
+    size_t capacity;
+} WorkDeque;
+
+static void deque_init(WorkDeque *dq) {
+    omp_init_lock(&dq->lock);
+    dq->capacity = 64;
+    dq->head = 0;
+    dq->count = 0;
+    dq->items = (WorkItem *)malloc(dq->capacity * sizeof(WorkItem));
+    if (!dq->items) {
+        perror("Failed to allocate work deque");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void deque_destroy(WorkDeque *dq) {
+    omp_destroy_lock(&dq->lock);
+    free(dq->items);
+}
+
+static void deque_push(WorkDeque *dq, WorkItem item) {
+    omp_set_lock(&dq->lock);
+    if (dq->count == dq->capacity) {
+        WorkItem *items = (WorkItem *)malloc(dq->capacity * 2 * sizeof(WorkItem));
+        if (!items) {
+            perror("Failed to resize work deque");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < dq->count; ++i) {
+            items[i] = dq->items[(dq->head + i) % dq->capacity];
+        }
+        free(dq->items);
+        dq->items = items;
+        dq->head = 0;
+        dq->capacity *= 2;
+    }
+    dq->items[(dq->head + dq->count) % dq->capacity] = item;
+    dq->count++;
+    omp_unset_lock(&dq->lock);
+}
+
+static int deque_pop(WorkDeque *dq, WorkItem *item) {
+    int found = 0;
+    omp_set_lock(&dq->lock);
+    if (dq->count > 0) {
+        dq->count--;
+        *item = dq->items[(dq->head + dq->count) % dq->capacity];
+        found = 1;
+    }
+    omp_unset_lock(&dq->lock);
+    return found;
+}
+
+static int deque_steal(WorkDeque *dq, WorkItem *item) {
+    int found = 0;
+    omp_set_lock(&dq->lock);
+    if (dq->count > 0) {
+        *item = dq->items[dq->head];
+        dq->head = (dq->head + 1) % dq->capacity;
+        dq->count--;
+        found = 1;
+    }
+    omp_unset_lock(&dq->lock);
+    return found;
+}
+
+// State shared by all workers of one walk. Directory ids are handed out
+// from a single counter so that they are unique across shards. pending
+// counts directories pushed but not yet fully read; the walk is over when
+// it drops to zero, since only a directory being read can push new work.
+// open_fds counts descriptors held by handles, which stays below fd_budget.
+// With a visitor, files go to it instead of the shards.
+typedef struct {
+    uint32_t next_dir_id;
+    size_t pending;
+    size_t open_fds;
+    size_t fd_budget;
+    DirectoryVisitor visit;
+    void *visit_arg;
+} Walk;
+
+// Subdirectories found while a directory is read for a visitor, held back
+// until the visitor has returned the value they are visited with.
+typedef struct {
+    WorkItem *items;
+    size_t count;
+    size_t capacity;
+} Subdirs;
+
+static void handle_release(Walk *walk, DirHandle *handle) {
+    while (handle && __atomic_sub_fetch(&handle->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        DirHandle *parent = handle->parent;
+        if (handle->fd >= 0) {
+            close(handle->fd);
+            __atomic_fetch_sub(&walk->open_fds, 1, __ATOMIC_RELAXED);
+        }
+        free(handle->name);
+        free(handle);
+        handle = parent;
+    }
+}
+
+// Opens name relative to the directory behind handle (the current directory
+// if handle is NULL). Handles without a descriptor, which only exist once
+// the descriptor budget is spent, are reopened from their nearest ancestor
+// that has one, a component at a time down the chain, without recursing.
+static int open_in_handle(DirHandle *handle, const char *name) {
+    size_t depth = 0;
+    DirHandle *base = handle;
+    while (base && base->fd < 0) {
+        depth++;
+        base = base->parent;
+    }
+    int fd = base ? base->fd : AT_FDCWD;
+    if (depth == 0) {
+        return open_at_noatime(fd, name, O_RDONLY | O_DIRECTORY);
+    }
+
+    stats_add(STAT_DIR_REOPENS, 1);
+    DirHandle **chain = (DirHandle **)malloc(depth * sizeof(DirHandle *));
+    if (!chain) {
+        perror("Failed to allocate directory chain");
+        exit(EXIT_FAILURE);
+    }
+    size_t i = depth;
+    for (DirHandle *h = handle; h != base; h = h->parent) {
+        chain[--i] = h;
+    }
+    for (i = 0; i <= depth; ++i) {
+        int next = open_at_noatime(fd, i < depth ? chain[i]->name : name, O_RDONLY | O_DIRECTORY);
+        if (i > 0) {
+            close(fd);
+        }
+        fd = next;
+        if (fd < 0) {
+            break;
+        }
+    }
+    free(chain);
+    return fd;
+}
+
+// Per-worker io_uring used to stat directory entries. Up to QUEUE_DEPTH
+// statx calls are in flight at once, each relative to the open directory.
 typedef struct {
-    char path[MAX_PATH_LENGTH];
-    unsigned char type;
-} DirectoryEntry;
+    struct io_uring ring;
+    struct statx stx[QUEUE_DEPTH];
+    const char *names[QUEUE_DEPTH];
+    int free_slots[QUEUE_DEPTH];
+    size_t free_count;
+} StatRing;
 
-static int compare_entries(const void *a, const void *b) {
-    const DirectoryEntry *entry_a = (const DirectoryEntry *)a;
-    const DirectoryEntry *entry_b = (const DirectoryEntry *)b;
-    return strcmp(entry_a->path, entry_b->path);
+static void stat_ring_init(StatRing *sr) {
+    int ret = io_uring_queue_init(QUEUE_DEPTH, &sr->ring, 0);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to initialize io_uring: %s\n", strerror(-ret));
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < QUEUE_DEPTH; ++i) {
+        sr->free_slots[i] = (int)i;
+    }
+    sr->free_count = QUEUE_DEPTH;
+}
+
+static void stat_ring_destroy(StatRing *sr) {
+    io_uring_queue_exit(&sr->ring);
 }
 
-void traverse_directory(const char *path, FileList *fl) {
-    int fd = open(path, O_RDONLY | O_NOATIME | O_DIRECTORY);
+// Records a subdirectory in the worker's shard and queues it to be read, or
+// holds it in later if given. The item holds a reference on the parent's
+// handle until it is opened.
+static void push_directory(Walk *walk, FileList *shard, WorkDeque *dq, Subdirs *later, DirHandle *parent,
+                           uint32_t parent_id, const char *name) {
+    WorkItem item;
+    item.id = __atomic_fetch_add(&walk->next_dir_id, 1, __ATOMIC_RELAXED);
+    item.parent = parent;
+    item.data = NULL;
+    item.name = strdup(name);
+    if (!item.name) {
+        perror("Failed to duplicate directory name");
+        exit(EXIT_FAILURE);
+    }
+    if (parent) {
+        __atomic_fetch_add(&parent->refs, 1, __ATOMIC_RELAXED);
+    }
+    file_list_add_dir(shard, item.id, parent_id, name);
+    __atomic_fetch_add(&walk->pending, 1, __ATOMIC_RELAXED);
+    if (!later) {
+        deque_push(dq, item);
+        return;
+    }
+    if (later->count == later->capacity) {
+        later->capacity = later->capacity ? later->capacity * 2 : 16;
+        later->items = (WorkItem *)realloc(later->items, later->capacity * sizeof(WorkItem));
+        if (!later->items) {
+            perror("Failed to resize subdirectory list");
+            exit(EXIT_FAILURE);
+        }
+    }
+    later->items[later->count++] = item;
+}
+
+// Builds the full path of the directory behind handle from the names along
+// its parent chain.
+static char *handle_path(const DirHandle *handle) {
+    size_t len = 0;
+    for (const DirHandle *h = handle; h; h = h->parent) {
+        len += strlen(h->name) + 1;
+    }
+    char *path = (char *)malloc(len);
+    if (!path) {
+        perror("Failed to allocate directory path");
+        exit(EXIT_FAILURE);
+    }
+    size_t pos = len - 1;
+    path[pos] = '\0';
+    for (const DirHandle *h = handle; h; h = h->parent) {
+        size_t n = strlen(h->name);
+        pos -= n;
+        memcpy(path + pos, h->name, n);
+        if (h->parent) {
+            path[--pos] = '/';
+        }
+    }
+    return path;
+}
+
+// Hands a directory that has been read to the visitor, then queues its
+// subdirectories with the value the visitor returned.
+static void visit_directory(Walk *walk, const WorkItem *dir, const char *path, FileList *files, Subdirs *later,
+                            WorkDeque *dq, int fd) {
+    file_list_add_dir(files, 0, FILE_LIST_NO_PARENT, path);
+    void *data = walk->visit(walk->visit_arg, dir->data, dir->name, files, later->count, fd);
+    for (size_t i = 0; i < later->count; ++i) {
+        later->items[i].data = data;
+        deque_push(dq, later->items[i]);
+    }
+    free(later->items);
+}
+
+static uint64_t statx_ns(const struct statx_timestamp *ts) {
+    return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+// Waits for at least min_complete statx calls (all of them if min_complete
+// is QUEUE_DEPTH) and records their results. Files are added to files as
+// children of file_parent.
+static void reap_stats(StatRing *sr, Walk *walk, DirHandle *handle, uint32_t dir_id, FileList *shard,
+                       FileList *files, uint32_t file_parent, WorkDeque *dq, Subdirs *later, size_t min_complete) {
+    size_t wanted = min_complete < QUEUE_DEPTH ? min_complete : QUEUE_DEPTH - sr->free_count;
+
+    while (QUEUE_DEPTH - sr->free_count > 0 && wanted > 0) {
+        int ret = io_uring_submit_and_wait(&sr->ring, 1);
+        if (ret < 0 && ret != -EINTR) {
+            fprintf(stderr, "Failed to submit statx requests: %s\n", strerror(-ret));
+            exit(EXIT_FAILURE);
+        }
+
+        struct io_uring_cqe *cqe;
+        unsigned head;
+        unsigned reaped = 0;
+        io_uring_for_each_cqe(&sr->ring, head, cqe) {
+            int slot = (int)(uintptr_t)io_uring_cqe_get_data(cqe);
+            struct statx *stx = &sr->stx[slot];
+
+            if (cqe->res < 0) {
+                stats_add(STAT_STAT_FAILURES, 1);
+                fprintf(stderr, "Failed to statx %s: %s\n", sr->names[slot], strerror(-cqe->res));
+            } else if (S_ISDIR(stx->stx_mode)) {
+                push_directory(walk, shard, dq, later, handle, dir_id, sr->names[slot]);
+            } else if (S_ISREG(stx->stx_mode)) {
+                file_list_add(files, file_parent, sr->names[slot], stx->stx_size, stx->stx_ino,
+                              makedev(stx->stx_dev_major, stx->stx_dev_minor),
+                              statx_ns(&stx->stx_mtime), statx_ns(&stx->stx_ctime));
+            }
+            sr->free_slots[sr->free_count++] = slot;
+            reaped++;
+        }
+        io_uring_cq_advance(&sr->ring, reaped);
+        wanted = wanted > reaped ? wanted - reaped : 0;
+    }
+}
+
+// Reads one directory, adding its regular files to the worker's shard and
+// its subdirectories to the worker's deque. Subdirectories reported by
+// d_type are pushed directly; every other candidate is stat'ed through the
+// worker's ring, which both resolves DT_UNKNOWN and records the size and
+// inode of regular files. The directory is opened relative to its parent
+// and everything inside it is looked up relative to its descriptor.
+//
+// With a visitor, files are collected into a list of their own for the
+// directory, as children of its directory 0, and subdirectories are held
+// back until it has been visited.
+static void read_directory(const WorkItem *dir, Walk *walk, FileList *shard, WorkDeque *dq, StatRing *sr) {
+    Subdirs subdirs = { NULL, 0, 0 };
+    Subdirs *later = walk->visit ? &subdirs : NULL;
+    FileList *files = walk->visit ? file_list_init(16) : shard;
+    uint32_t file_parent = walk->visit ? 0 : dir->id;
+
+    int fd = open_in_handle(dir->parent, dir->name);
     if (fd < 0) {
-        perror("Failed to open directory");
+        fprintf(stderr, "Failed to open directory %s: %s\n", dir->name, strerror(errno));
+        if (later) {
+            visit_directory(walk, dir, dir->name, files, later, dq, -1);
+        }
+        handle_release(walk, dir->parent);
+        free(dir->name);
         return;
     }
+    stats_add(STAT_DIRS_VISITED, 1);
+
+    // The handle takes over the item's name and its reference on the parent.
+    DirHandle *handle = (DirHandle *)malloc(sizeof(DirHandle));
+    if (!handle) {
+        perror("Failed to allocate directory handle");
+        exit(EXIT_FAILURE);
+    }
+    handle->parent = dir->parent;
+    handle->name = dir->name;
+    handle->refs = 1;
+    handle->fd = -1;
+    if (__atomic_add_fetch(&walk->open_fds, 1, __ATOMIC_RELAXED) <= walk->fd_budget) {
+        handle->fd = fd;
+    } else {
+        __atomic_fetch_sub(&walk->open_fds, 1, __ATOMIC_RELAXED);
+    }
 
     char buf[32768]; // Buffer for directory entries
     for (;;) {
@@ -83,36 +429,133 @@ void traverse_directory(const char *path, FileList *fl) {
             if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) {
                 continue;
             }
+            stats_add(STAT_DIR_ENTRIES, 1);
 
-            char full_path[MAX_PATH_LENGTH];
-            snprintf(full_path, sizeof(full_path), "%s/%s", path, d->d_name);
+            if (d->d_type == DT_DIR) {
+                push_directory(walk, shard, dq, later, handle, dir->id, d->d_name);
+                continue;
+            }
+            if (d->d_type != DT_REG && d->d_type != DT_UNKNOWN) {
+                continue;
+            }
+            stats_add(STAT_STAT_CALLS, 1);
+            if (d->d_type == DT_UNKNOWN) {
+                stats_add(STAT_STAT_FALLBACKS, 1);
+            }
+
+            if (sr->free_count == 0) {
+                reap_stats(sr, walk, handle, dir->id, shard, files, file_parent, dq, later, 1);
+            }
+            int slot = sr->free_slots[--sr->free_count];
+            sr->names[slot] = d->d_name;
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&sr->ring);
+            io_uring_prep_statx(sqe, fd, d->d_name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT,
+                                STATX_TYPE | STATX_SIZE | STATX_INO | STATX_MTIME | STATX_CTIME,
+                                &sr->stx[slot]);
+            io_uring_sqe_set_data(sqe, (void *)(uintptr_t)slot);
+        }
+
+        // The names point into buf, so every statx must finish before the
+        // next getdents64 call overwrites it.
+        reap_stats(sr, walk, handle, dir->id, shard, files, file_parent, dq, later, QUEUE_DEPTH);
+    }
+
+    if (later) {
+        char *path = handle_path(handle);
+        visit_directory(walk, dir, path, files, later, dq, fd);
+        free(path);
+    }
+    if (handle->fd != fd) {
+        close(fd);
+    }
+    handle_release(walk, handle);
+}
+
+// Walks the tree rooted at path with num_threads workers. Directories are
+// kept on heap-allocated deques rather than the call stack, so the depth of
+// the tree does not bound the walk, and are opened relative to their
+// parent's descriptor, so the length of a path does not bound it either.
+// Each worker collects files into its own shard, and the shards are
+// appended to fl once the walk is complete.
+void traverse_directory(const char *path, FileList *fl, size_t num_threads) {
+    traverse_directory_visit(path, fl, num_threads, NULL, NULL);
+}
+
+// Walks the tree like traverse_directory(), but hands the files of every
+// directory to visit as soon as it has been read; fl then only receives
+// the directories.
+void traverse_directory_visit(const char *path, FileList *fl, size_t num_threads, DirectoryVisitor visit,
+                              void *arg) {
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+
+    WorkDeque *deques = (WorkDeque *)malloc(num_threads * sizeof(WorkDeque));
+    FileList **shards = (FileList **)malloc(num_threads * sizeof(FileList *));
+    if (!deques || !shards) {
+        perror("Failed to allocate traversal state");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < num_threads; ++i) {
+        deque_init(&deques[i]);
+        shards[i] = file_list_init(INITIAL_FILE_LIST_CAPACITY / num_threads + 1);
+    }
 
-            unsigned char dtype = d->d_type;
-            mode_t mode = 0;
+    // Leave room for the rings and files of every worker, and for the
+    // hashing stage, below the process descriptor limit.
+    struct rlimit rl;
+    size_t fd_limit = getrlimit(RLIMIT_NOFILE, &rl) == 0 ? (size_t)rl.rlim_cur : 1024;
+    size_t reserve = FD_RESERVE + 2 * num_threads;
+    Walk walk = { .next_dir_id = 0, .pending = 0, .open_fds = 0,
+                  .fd_budget = fd_limit > 2 * reserve ? fd_limit - reserve : fd_limit / 2,
+                  .visit = visit, .visit_arg = arg };
+    push_directory(&walk, shards[0], &deques[0], NULL, NULL, FILE_LIST_NO_PARENT, path);
+
+    #pragma omp parallel num_threads(num_threads)
+    {
+        size_t self = (size_t)omp_get_thread_num();
+        size_t workers = (size_t)omp_get_num_threads();
+        WorkDeque *dq = &deques[self];
+        StatRing sr;
+        stat_ring_init(&sr);
+        uint64_t idle_since = 0;
+
+        for (;;) {
+            WorkItem dir;
+            int found = deque_pop(dq, &dir);
+            for (size_t i = 1; !found && i < workers; ++i) {
+                found = deque_steal(&deques[(self + i) % workers], &dir);
+            }
 
-            if (dtype == DT_UNKNOWN) {
-                struct stat stbuf;
-                if (lstat(full_path, &stbuf) == -1) {
-                    perror("Failed to lstat");
-                    continue;
+            if (!found) {
+                if (!idle_since) {
+                    idle_since = stats_now();
                 }
-                mode = stbuf.st_mode;
-            } else {
-                switch (dtype) {
-                    case DT_LNK: mode = S_IFLNK; break;
-                    case DT_DIR: mode = S_IFDIR; break;
-                    case DT_REG: mode = S_IFREG; break;
-                    default: mode = 0; break;
+                if (__atomic_load_n(&walk.pending, __ATOMIC_ACQUIRE) == 0) {
+                    break;
                 }
+                sched_yield();
+                continue;
             }
-
-            if (S_ISDIR(mode)) {
-                traverse_directory(full_path, fl);
-            } else if (S_ISREG(mode)) {
-                file_list_add(fl, full_path);
+            if (idle_since) {
+                stats_add(STAT_TRAVERSAL_IDLE_NS, stats_now() - idle_since);
+                idle_since = 0;
             }
+
+            read_directory(&dir, &walk, shards[self], dq, &sr);
+            __atomic_fetch_sub(&walk.pending, 1, __ATOMIC_RELEASE);
         }
+        if (idle_since) {
+            stats_add(STAT_TRAVERSAL_IDLE_NS, stats_now() - idle_since);
+        }
+
+        stat_ring_destroy(&sr);
     }
 
-    close(fd);
+    for (size_t i = 0; i < num_threads; ++i) {
+        file_list_merge(fl, shards[i]);
+        deque_destroy(&deques[i]);
+    }
+    free(shards);
+    free(deques);
 }
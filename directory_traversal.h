@@ -5,8 +5,20 @@
 
 #define MAX_PATH_LENGTH 4096
 
+// Receives each directory once it has been read, on the thread that read
+// it, with the value returned for its parent (NULL for the root) and its
+// name. files holds the regular files found in it and belongs to the
+// visitor from then on; its only directory is this one, under its full
+// path. subdirs is the number of subdirectories found, which are queued
+// only after the call, with its return value. fd is the directory's
+// descriptor, or -1 if it could not be opened, and is valid for the call.
+typedef void *(*DirectoryVisitor)(void *arg, void *parent, const char *name, FileList *files, size_t subdirs,
+                                  int fd);
+
 void concatenate_path(const char *base, const char *name, char *dest, size_t dest_size);
-void traverse_directory(const char *path, FileList *fl);
+void traverse_directory(const char *path, FileList *fl, size_t num_threads);
+void traverse_directory_visit(const char *path, FileList *fl, size_t num_threads, DirectoryVisitor visit,
+                              void *arg);
 
 #endif
 
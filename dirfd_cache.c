@@ -0,0 +1,155 @@
+#define _GNU_SOURCE
+
+#include "dirfd_cache.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+// O_NOATIME is only allowed on files the caller owns, so fall back to a
+// plain open when it is refused.
+int open_at_noatime(int dirfd, const char *name, int flags) {
+    int fd = openat(dirfd, name, flags | O_NOATIME);
+    if (fd < 0 && errno == EPERM) {
+        fd = openat(dirfd, name, flags);
+    }
+    return fd;
+}
+
+void dirfd_cache_init(DirFdCache *cache, const FileList *fl, size_t capacity) {
+    cache->fl = fl;
+    cache->capacity = capacity ? capacity : 1;
+    cache->count = 0;
+    cache->clock = 0;
+    cache->entries = (DirFdEntry *)malloc(cache->capacity * sizeof(DirFdEntry));
+    cache->chain_capacity = 64;
+    cache->chain = (uint32_t *)malloc(cache->chain_capacity * sizeof(uint32_t));
+    if (!cache->entries || !cache->chain) {
+        perror("Failed to allocate directory descriptor cache");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void close_all(DirFdCache *cache) {
+    for (size_t i = 0; i < cache->count; ++i) {
+        close(cache->entries[i].fd);
+    }
+    cache->count = 0;
+}
+
+// Points the cache at fl. Descriptors cached for another list are closed,
+// since its directory indices mean nothing for the new one.
+void dirfd_cache_bind(DirFdCache *cache, const FileList *fl) {
+    if (cache->fl != fl) {
+        close_all(cache);
+        cache->fl = fl;
+    }
+}
+
+void dirfd_cache_destroy(DirFdCache *cache) {
+    close_all(cache);
+    free(cache->entries);
+    free(cache->chain);
+}
+
+static DirFdEntry *lookup(DirFdCache *cache, uint32_t dir) {
+    for (size_t i = 0; i < cache->count; ++i) {
+        if (cache->entries[i].dir == dir) {
+            return &cache->entries[i];
+        }
+    }
+    return NULL;
+}
+
+// Adds a pinned entry for fd, evicting the least recently used unpinned
+// entry if the cache is full. Returns NULL if every entry is pinned.
+static DirFdEntry *insert(DirFdCache *cache, uint32_t dir, int fd) {
+    DirFdEntry *entry = NULL;
+    if (cache->count < cache->capacity) {
+        entry = &cache->entries[cache->count++];
+    } else {
+        for (size_t i = 0; i < cache->count; ++i) {
+            DirFdEntry *candidate = &cache->entries[i];
+            if (candidate->pins == 0 && (!entry || candidate->last_use < entry->last_use)) {
+                entry = candidate;
+            }
+        }
+        if (!entry) {
+            return NULL;
+        }
+        close(entry->fd);
+    }
+    entry->dir = dir;
+    entry->fd = fd;
+    entry->pins = 1;
+    entry->last_use = ++cache->clock;
+    return entry;
+}
+
+// Returns an open descriptor for directory dir, or -1 on failure. The
+// descriptor must be handed back with dirfd_cache_put(). If it could not be
+// cached because every entry is pinned, *owned is set and put closes it.
+int dirfd_cache_get(DirFdCache *cache, uint32_t dir, int *owned) {
+    const FileList *fl = cache->fl;
+    DirFdEntry *entry = lookup(cache, dir);
+    if (entry) {
+        entry->pins++;
+        entry->last_use = ++cache->clock;
+        *owned = 0;
+        return entry->fd;
+    }
+
+    // Collect the uncached ancestors, then open them top-down, each one
+    // relative to the one above it.
+    size_t n = 0;
+    DirFdEntry *base = NULL;
+    for (uint32_t d = dir; d != FILE_LIST_NO_PARENT; d = fl->dirs[d].parent) {
+        base = lookup(cache, d);
+        if (base) {
+            base->pins++;
+            break;
+        }
+        if (n == cache->chain_capacity) {
+            cache->chain_capacity *= 2;
+            uint32_t *chain = (uint32_t *)realloc(cache->chain, cache->chain_capacity * sizeof(uint32_t));
+            if (!chain) {
+                perror("Failed to resize directory chain");
+                exit(EXIT_FAILURE);
+            }
+            cache->chain = chain;
+        }
+        cache->chain[n++] = d;
+    }
+
+    int parent_fd = base ? base->fd : AT_FDCWD;
+    int parent_owned = 0;
+    int fd = -1;
+    while (n > 0) {
+        uint32_t d = cache->chain[--n];
+        fd = open_at_noatime(parent_fd, fl->names + fl->dirs[d].name, O_RDONLY | O_DIRECTORY);
+        if (parent_fd != AT_FDCWD) {
+            dirfd_cache_put(cache, parent_fd, parent_owned);
+        }
+        if (fd < 0) {
+            return -1;
+        }
+        parent_fd = fd;
+        parent_owned = insert(cache, d, fd) == NULL;
+    }
+    *owned = parent_owned;
+    return fd;
+}
+
+void dirfd_cache_put(DirFdCache *cache, int fd, int owned) {
+    if (owned) {
+        close(fd);
+        return;
+    }
+    for (size_t i = 0; i < cache->count; ++i) {
+        if (cache->entries[i].fd == fd) {
+            cache->entries[i].pins--;
+            return;
+        }
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef DIRFD_CACHE_H
+#define DIRFD_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "file_list.h"
+
+typedef struct {
+    uint32_t dir;
+    int fd;
+    uint32_t pins;
+    uint64_t last_use;
+} DirFdEntry;
+
+// Small per-thread LRU of open directory descriptors, keyed by FileList
+// directory index. A missing directory is opened relative to its nearest
+// cached ancestor, so a path is never resolved from the root again once its
+// parent is cached. Pinned entries are never evicted.
+typedef struct {
+    const FileList *fl;
+    DirFdEntry *entries;
+    size_t capacity;
+    size_t count;
+    uint64_t clock;
+    uint32_t *chain;
+    size_t chain_capacity;
+} DirFdCache;
+
+int open_at_noatime(int dirfd, const char *name, int flags);
+void dirfd_cache_init(DirFdCache *cache, const FileList *fl, size_t capacity);
+void dirfd_cache_bind(DirFdCache *cache, const FileList *fl);
+void dirfd_cache_destroy(DirFdCache *cache);
+int dirfd_cache_get(DirFdCache *cache, uint32_t dir, int *owned);
+void dirfd_cache_put(DirFdCache *cache, int fd, int owned);
+
+#endif
@@ -0,0 +1,683 @@
+#define _GNU_SOURCE
+
+#include "dirhash.h"
+#include "bloom_filter.h"
+#include "file_list.h"
+#include "directory_traversal.h"
+#include "progress.h"
+#include "hashing.h"
+#include "merkle.h"
+#include "schedule.h"
+#include "duplicates.h"
+#include "pipeline.h"
+#include "manifest.h"
+#include "watch.h"
+#include "stats.h"
+#include "constants.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <omp.h>
+
+_Static_assert(DIRHASH_MAX_DIGEST_SIZE >= DIGEST_MAX_SIZE, "DIRHASH_MAX_DIGEST_SIZE is too small");
+
+// Worker n of every parallel region hashes with engines[n]. OpenMP keeps
+// its threads from one region to the next, so the workers are reused as
+// well as their engines. The Bloom filter and the digest buffer are kept
+// for the next call too. The engines hash with settings, which each call
+// starts again from the options.
+struct dirhash_ctx {
+    dirhash_options options;
+    char *cache_path;
+    char *manifest_path;
+    const DigestAlgorithm *alg;
+    size_t threads;
+    HashSettings settings;
+    HashEngine *engines;
+    BloomFilter *filter;
+    uint8_t *digests;
+    size_t digest_capacity;
+};
+
+static double seconds_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Folds a run of file digests into the legacy order-dependent hash,
+// skipping failed files and digests the filter has already seen. Each
+// digest takes part through its 64-bit key.
+static void combine_hashes(BloomFilter *filter, const uint8_t *digests, size_t digest_size, size_t count,
+                           uint64_t *final_hash) {
+    uint64_t started = stats_now();
+    size_t checks = 0, hits = 0;
+    for (size_t j = 0; j < count; ++j) {
+        uint64_t hash = digest_key(digests + j * digest_size, digest_size);
+        if (__builtin_expect(hash == 0, 0)) {
+            continue;
+        }
+        checks++;
+        if (!bloom_filter_check_and_add(filter, hash)) {
+            *final_hash = (*final_hash * PRIME_MULTIPLIER) ^ hash;
+        } else {
+            hits++;
+        }
+    }
+    stats_add(STAT_BLOOM_CHECKS, checks);
+    stats_add(STAT_BLOOM_HITS, hits);
+    stats_add(STAT_COMBINE_NS, stats_now() - started);
+}
+
+static const HashReadMode read_modes[] = {
+    [DIRHASH_IO_BUFFERED] = HASH_READ_BUFFERED,
+    [DIRHASH_IO_DIRECT] = HASH_READ_DIRECT,
+    [DIRHASH_IO_DONTNEED] = HASH_READ_DONTNEED,
+};
+
+// Puts back the settings of the context's options, which a call may have
+// changed for itself.
+static void apply_settings(dirhash_ctx *ctx) {
+    ctx->settings.digest = ctx->alg;
+    ctx->settings.split_threshold = ctx->options.split_threshold;
+    ctx->settings.read_mode = read_modes[ctx->options.io_mode];
+    ctx->settings.mmap = ctx->options.mmap;
+    ctx->settings.huge_pages = ctx->options.huge_pages;
+}
+
+dirhash_ctx *dirhash_ctx_new(const dirhash_options *options) {
+    static const dirhash_options defaults;
+    if (!options) {
+        options = &defaults;
+    }
+    const DigestAlgorithm *alg = options->digest ? digest_find(options->digest) : digest_default();
+    if (!alg) {
+        fprintf(stderr, "Unknown digest: %s\n", options->digest);
+        return NULL;
+    }
+    if ((unsigned)options->io_mode > DIRHASH_IO_DONTNEED) {
+        fprintf(stderr, "Unknown I/O mode: %d\n", (int)options->io_mode);
+        return NULL;
+    }
+    // The pipeline never holds the whole file list, which these need.
+    if (options->pipeline &&
+        (options->cache_path || options->physical_order || options->split_threshold || options->manifest_path)) {
+        fprintf(stderr, "Pipelined hashing cannot be combined with a cache, a manifest, physical order or split "
+                        "hashing\n");
+        return NULL;
+    }
+
+    dirhash_ctx *ctx = (dirhash_ctx *)calloc(1, sizeof(dirhash_ctx));
+    if (!ctx) {
+        perror("Failed to allocate context");
+        exit(EXIT_FAILURE);
+    }
+    ctx->options = *options;
+    ctx->alg = alg;
+    if (options->cache_path) {
+        ctx->cache_path = strdup(options->cache_path);
+        if (!ctx->cache_path) {
+            perror("Failed to allocate context");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (options->manifest_path) {
+        ctx->manifest_path = strdup(options->manifest_path);
+        if (!ctx->manifest_path) {
+            perror("Failed to allocate context");
+            exit(EXIT_FAILURE);
+        }
+    }
+    ctx->options.cache_path = ctx->cache_path;
+    ctx->options.manifest_path = ctx->manifest_path;
+    ctx->options.digest = NULL;
+
+    if (options->stats) {
+        stats_enable();
+    }
+
+    ctx->threads = options->threads;
+    if (ctx->threads == 0) {
+        long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+        ctx->threads = num_cores < 1 ? 4 : (size_t)num_cores;
+    }
+    if (options->memory_limit) {
+        hash_set_memory_limit(options->memory_limit);
+    }
+    apply_settings(ctx);
+
+    // Each worker sets up its own engine, so that the engine's buffers are
+    // first touched on the worker that reads into them.
+    ctx->engines = (HashEngine *)calloc(ctx->threads, sizeof(HashEngine));
+    int *ready = (int *)calloc(ctx->threads, sizeof(int));
+    if (!ctx->engines || !ready) {
+        perror("Failed to allocate hashing engines");
+        exit(EXIT_FAILURE);
+    }
+    int failed = 0;
+    #pragma omp parallel for num_threads(ctx->threads) schedule(static, 1) reduction(|:failed)
+    for (size_t i = 0; i < ctx->threads; ++i) {
+        ready[i] = hash_engine_init(&ctx->engines[i], &ctx->settings, ctx->threads) == 0;
+        failed |= !ready[i];
+    }
+    if (failed) {
+        for (size_t i = 0; i < ctx->threads; ++i) {
+            if (ready[i]) {
+                hash_engine_destroy(&ctx->engines[i]);
+            }
+        }
+        free(ready);
+        free(ctx->engines);
+        free(ctx->cache_path);
+        free(ctx->manifest_path);
+        free(ctx);
+        return NULL;
+    }
+    free(ready);
+    if (ctx->options.mmap) {
+        hash_mmap_acquire();
+    }
+    return ctx;
+}
+
+void dirhash_ctx_free(dirhash_ctx *ctx) {
+    if (!ctx) {
+        return;
+    }
+    for (size_t i = 0; i < ctx->threads; ++i) {
+        hash_engine_destroy(&ctx->engines[i]);
+    }
+    if (ctx->options.mmap) {
+        hash_mmap_release();
+    }
+    free(ctx->engines);
+    bloom_filter_free(ctx->filter);
+    free(ctx->digests);
+    free(ctx->cache_path);
+    free(ctx->manifest_path);
+    free(ctx);
+}
+
+size_t dirhash_ctx_threads(const dirhash_ctx *ctx) {
+    return ctx->threads;
+}
+
+// A digest for each of count files, kept for the next call.
+static uint8_t *file_digests(dirhash_ctx *ctx, size_t count) {
+    size_t bytes = (count ? count : 1) * ctx->settings.digest->size;
+    if (bytes > ctx->digest_capacity) {
+        free(ctx->digests);
+        ctx->digests = (uint8_t *)malloc(bytes);
+        if (!ctx->digests) {
+            perror("Failed to allocate file hashes");
+            exit(EXIT_FAILURE);
+        }
+        ctx->digest_capacity = bytes;
+    }
+    return ctx->digests;
+}
+
+// Lists and sorts the files under path, and records how long that took
+// since start.
+static FileList *list_files(dirhash_ctx *ctx, const char *path, const struct timespec *start,
+                            dirhash_result *result) {
+    FileList *fl = file_list_init(INITIAL_FILE_LIST_CAPACITY);
+    traverse_directory(path, fl, ctx->threads);
+    file_list_sort(fl);
+    result->traversal_time = seconds_since(start);
+    result->files = fl->size;
+    if (ctx->options.report) {
+        printf("Directory traversal completed in %.6f seconds.\n", result->traversal_time);
+    }
+    return fl;
+}
+
+// Nothing of a call outlives it: the engines close the directories cached
+// for its file list, which is freed, and forget its cache and digests.
+static void end_call(dirhash_ctx *ctx) {
+    for (size_t i = 0; i < ctx->threads; ++i) {
+        hash_engine_release(&ctx->engines[i]);
+    }
+    hash_end_run(&ctx->settings);
+}
+
+// Hashes every file of fl, storing each digest in manifest as well unless
+// it is NULL.
+static void hash_list(dirhash_ctx *ctx, FileList *fl, ManifestWriter *manifest, dirhash_file_cb callback,
+                      void *arg, dirhash_result *result) {
+    const DigestAlgorithm *alg = ctx->settings.digest;
+    size_t num_threads = ctx->threads;
+    int merkle = ctx->options.merkle;
+
+    // Reading in physical order changes only when each file is hashed; the
+    // digests are still combined in list order afterwards.
+    size_t *order = ctx->options.physical_order ? schedule_physical_order(fl, num_threads) : NULL;
+    BloomFilter *filter = NULL;
+    if (!merkle) {
+        filter = ctx->filter = bloom_filter_reuse(ctx->filter, fl->size, BLOOM_FALSE_POSITIVE_RATE);
+    }
+
+    // Merkle mode hashes each directory from its children's digests as
+    // soon as the last of them is known, which gives the same root at any
+    // thread count.
+    MerkleTree tree;
+    uint8_t *digests_by_file = NULL;
+    if (ctx->settings.cache || merkle || order || ctx->settings.split_threshold) {
+        digests_by_file = file_digests(ctx, fl->size);
+    }
+    if (merkle) {
+        merkle_init(&tree, fl, alg, digests_by_file);
+    }
+
+    // Files above the split threshold are hashed first, by all threads at
+    // once, so that a few huge files do not leave the others idle.
+    hash_split_files(&ctx->settings, fl, num_threads, ctx->engines, digests_by_file);
+
+    uint64_t final_hash = HASH_SEED;
+    uint64_t total_bytes = 0;
+    for (size_t i = 0; i < fl->size; ++i) {
+        total_bytes += fl->entries[i].size;
+    }
+    Progress progress;
+    if (ctx->options.report) {
+        progress_start(&progress, num_threads, fl->size, total_bytes);
+    }
+    size_t num_batches = (fl->size + HASH_BATCH_SIZE - 1) / HASH_BATCH_SIZE;
+
+    #pragma omp parallel num_threads(num_threads) reduction(^:final_hash)
+    {
+        HashEngine *engine = &ctx->engines[omp_get_thread_num()];
+        uint8_t digests[HASH_BATCH_SIZE * DIGEST_MAX_SIZE];
+        char *path = NULL;
+        size_t path_capacity = 0;
+
+        #pragma omp for schedule(dynamic)
+        for (size_t batch = 0; batch < num_batches; ++batch) {
+            size_t begin = batch * HASH_BATCH_SIZE;
+            size_t count = fl->size - begin < HASH_BATCH_SIZE ? fl->size - begin : HASH_BATCH_SIZE;
+            hash_engine_hash_files(engine, fl, order, begin, count, digests);
+
+            for (size_t j = 0; digests_by_file && j < count; ++j) {
+                size_t index = order ? order[begin + j] : begin + j;
+                memcpy(digests_by_file + index * alg->size, digests + j * alg->size, alg->size);
+                if (merkle) {
+                    merkle_file_done(&tree, index);
+                }
+            }
+            if (!merkle && !order) {
+                combine_hashes(filter, digests, alg->size, count, &final_hash);
+            }
+
+            uint64_t bytes = 0;
+            for (size_t j = 0; j < count; ++j) {
+                size_t index = order ? order[begin + j] : begin + j;
+                bytes += fl->entries[index].size;
+                if (manifest) {
+                    manifest_writer_set(manifest, index, digests + j * alg->size);
+                }
+                if (callback) {
+                    callback(arg, file_list_path_buf(fl, index, &path, &path_capacity), fl->entries[index].size,
+                             digests + j * alg->size, alg->size);
+                }
+            }
+            if (ctx->options.report) {
+                progress_add(&progress, (size_t)omp_get_thread_num(), count, bytes);
+            }
+        }
+
+        free(path);
+    }
+    if (ctx->options.report) {
+        progress_stop(&progress);
+    }
+
+    if (!merkle && order) {
+        #pragma omp parallel for num_threads(num_threads) schedule(dynamic) reduction(^:final_hash)
+        for (size_t batch = 0; batch < num_batches; ++batch) {
+            size_t begin = batch * HASH_BATCH_SIZE;
+            size_t count = fl->size - begin < HASH_BATCH_SIZE ? fl->size - begin : HASH_BATCH_SIZE;
+            combine_hashes(filter, digests_by_file + begin * alg->size, alg->size, count, &final_hash);
+        }
+    }
+    free(order);
+
+    // The Merkle root is given as the algorithm's full digest.
+    if (merkle) {
+        memcpy(result->root, merkle_root(&tree), alg->size);
+        result->root_size = alg->size;
+        merkle_free(&tree);
+    }
+    result->hash = final_hash;
+}
+
+// Maps the context's cache into its settings and returns the wall-clock
+// time, in nanoseconds, that hash_cache_save() wants for the hashes made
+// through it.
+static uint64_t open_cache(dirhash_ctx *ctx, HashCache *cache) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    hash_cache_open(cache, ctx->cache_path, ctx->alg, ctx->options.split_threshold);
+    ctx->settings.cache = cache;
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Unmaps cache and replaces it with the files of the count lists hashed
+// through it.
+static void save_cache(dirhash_ctx *ctx, HashCache *cache, const FileList *const *lists,
+                       const uint8_t *const *digests, size_t count, uint64_t started) {
+    hash_cache_close(cache);
+    hash_cache_save(ctx->cache_path, ctx->alg, ctx->options.split_threshold, lists, digests, count, started);
+}
+
+// Lists and hashes the tree at path, through the cache in the context's
+// settings if there is one, and writes a manifest of it to the context's
+// manifest path, or to memory, mapped into in_memory, when in_memory is not
+// NULL. Sets start to when the walk began and *files to the list hashed,
+// whose digests are left in ctx->digests when a cache is in use. Returns -1
+// if the manifest could not be written.
+static int hash_tree(dirhash_ctx *ctx, const char *path, Manifest *in_memory, dirhash_file_cb callback, void *arg,
+                     struct timespec *start, FileList **files, dirhash_result *result) {
+    clock_gettime(CLOCK_MONOTONIC, start);
+
+    int status = 0;
+    FileList *fl = list_files(ctx, path, start, result);
+    const char *manifest_path = in_memory ? NULL : ctx->manifest_path;
+    ManifestWriter manifest;
+    int manifest_open = (in_memory || manifest_path) &&
+                        manifest_writer_open(&manifest, manifest_path, ctx->settings.digest,
+                                             ctx->settings.split_threshold, fl) == 0;
+    if ((in_memory || manifest_path) && !manifest_open) {
+        status = -1;
+    }
+    hash_list(ctx, fl, manifest_open ? &manifest : NULL, callback, arg, result);
+    if (manifest_open) {
+        int written = in_memory ? manifest_writer_finish(&manifest, in_memory) : manifest_writer_close(&manifest);
+        if (written < 0) {
+            status = -1;
+        }
+    }
+    *files = fl;
+    return status;
+}
+
+// Hashes the tree at path with the context's options and fills in result.
+// callback, if not NULL, is given every file as it is hashed. Returns -1
+// if the manifest could not be written, and 0 otherwise.
+int dirhash_hash(dirhash_ctx *ctx, const char *path, dirhash_file_cb callback, void *arg,
+                 dirhash_result *result) {
+    memset(result, 0, sizeof(*result));
+    apply_settings(ctx);
+    struct timespec start;
+    int status = 0;
+
+    // Pipelined runs hash while the walk is still going and give the same
+    // root as Merkle runs.
+    if (ctx->options.pipeline) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        result->files = pipeline_hash(path, ctx->threads, ctx->engines, callback, arg, result->root,
+                                      &result->traversal_time);
+        result->root_size = ctx->alg->size;
+        result->total_time = seconds_since(&start);
+        if (ctx->options.report) {
+            printf("Directory traversal completed in %.6f seconds.\n", result->traversal_time);
+        }
+    } else {
+        HashCache cache;
+        uint64_t started = ctx->cache_path ? open_cache(ctx, &cache) : 0;
+        FileList *fl;
+        status = hash_tree(ctx, path, NULL, callback, arg, &start, &fl, result);
+        if (ctx->cache_path) {
+            const FileList *list = fl;
+            const uint8_t *digests = ctx->digests;
+            save_cache(ctx, &cache, &list, &digests, 1, started);
+        }
+        file_list_free(fl);
+        result->total_time = seconds_since(&start);
+    }
+    end_call(ctx);
+
+    if (result->root_size) {
+        digest_format(result->root, result->root_size, result->text);
+    } else {
+        snprintf(result->text, sizeof(result->text), "%lx", (unsigned long)result->hash);
+    }
+    return status;
+}
+
+// Writes each group of files with identical contents under path to out,
+// as find_duplicates() does. Returns -1 for a pipelined context, which
+// never holds the whole file list, and 0 otherwise.
+int dirhash_find_duplicates(dirhash_ctx *ctx, const char *path, FILE *out, dirhash_result *result) {
+    memset(result, 0, sizeof(*result));
+    if (ctx->options.pipeline) {
+        fprintf(stderr, "Pipelined hashing cannot find duplicates\n");
+        return -1;
+    }
+    apply_settings(ctx);
+
+    // Duplicates are told apart by flat digests of whole files, so nothing
+    // is tree hashed, and a cache written with a split threshold, which
+    // holds tree digests, is left alone.
+    ctx->settings.split_threshold = 0;
+    HashCache cache;
+    int cached = ctx->cache_path && ctx->options.split_threshold == 0;
+    if (cached) {
+        hash_cache_open(&cache, ctx->cache_path, ctx->alg, 0);
+        ctx->settings.cache = &cache;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    FileList *fl = list_files(ctx, path, &start, result);
+    result->duplicate_groups = find_duplicates(fl, ctx->threads, ctx->engines, out);
+    if (cached) {
+        hash_cache_close(&cache);
+    }
+    end_call(ctx);
+    file_list_free(fl);
+    result->total_time = seconds_since(&start);
+    return 0;
+}
+
+// Hashes the tree at path again and compares it with the manifest at
+// manifest_path, writing each file that differs to out as
+// manifest_verify() does. The manifest's digest and split threshold are
+// used, whatever the context's. Returns 1 if the tree differs from the
+// manifest, 0 if it matches, and -1 if the manifest cannot be read.
+int dirhash_verify(dirhash_ctx *ctx, const char *path, const char *manifest_path, int fail_fast, FILE *out,
+                   dirhash_result *result) {
+    memset(result, 0, sizeof(*result));
+    Manifest manifest;
+    if (manifest_open(&manifest, manifest_path) < 0) {
+        return -1;
+    }
+    apply_settings(ctx);
+    ctx->settings.digest = manifest.alg;
+    ctx->settings.split_threshold = manifest.split_threshold;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    FileList *fl = list_files(ctx, path, &start, result);
+    uint8_t *split_digests = NULL;
+    if (manifest.split_threshold) {
+        split_digests = (uint8_t *)malloc((fl->size ? fl->size : 1) * manifest.alg->size);
+        if (!split_digests) {
+            perror("Failed to allocate file hashes");
+            exit(EXIT_FAILURE);
+        }
+        hash_split_files(&ctx->settings, fl, ctx->threads, ctx->engines, split_digests);
+    }
+
+    ManifestDiff diff;
+    int status = manifest_verify(&manifest, fl, ctx->threads, ctx->engines, fail_fast, out, &diff);
+    if (status < 0) {
+        fprintf(stderr, "Corrupt manifest %s\n", manifest_path);
+    } else {
+        status = diff.changed || diff.missing || diff.extra;
+    }
+    end_call(ctx);
+    free(split_digests);
+    file_list_free(fl);
+    manifest_close(&manifest);
+
+    result->changed = diff.changed;
+    result->missing = diff.missing;
+    result->extra = diff.extra;
+    result->total_time = seconds_since(&start);
+    return status;
+}
+
+// Compares left with right, each either a tree or a manifest of one,
+// writing each file that differs to out as manifest_diff() does. Trees
+// are hashed into manifests in memory first, with the digest and split
+// threshold of a stored manifest on the other side if there is one, so
+// --cache is what keeps their unchanged files from being read, as long as
+// those are the context's own; between manifests, identical subtrees are
+// skipped whole. Returns 1 if the sides differ, 0 if they match, and -1 on
+// error.
+int dirhash_diff(dirhash_ctx *ctx, const char *left, const char *right, FILE *out, dirhash_result *result) {
+    memset(result, 0, sizeof(*result));
+    if (ctx->options.pipeline) {
+        fprintf(stderr, "Pipelined hashing cannot compare trees\n");
+        return -1;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    const char *paths[2] = { left, right };
+    Manifest sides[2];
+    int opened[2] = { 0, 0 };
+    int is_tree[2];
+    int status = 0;
+    const Manifest *stored = NULL;
+    for (int i = 0; i < 2 && status == 0; ++i) {
+        struct stat st;
+        if (stat(paths[i], &st) < 0) {
+            fprintf(stderr, "Failed to stat %s: %s\n", paths[i], strerror(errno));
+            status = -1;
+            break;
+        }
+        is_tree[i] = S_ISDIR(st.st_mode);
+        if (is_tree[i]) {
+            continue;
+        }
+        if (manifest_open(&sides[i], paths[i]) < 0) {
+            status = -1;
+            break;
+        }
+        opened[i] = 1;
+        if (stored && (stored->alg != sides[i].alg || stored->split_threshold != sides[i].split_threshold)) {
+            fprintf(stderr, "Manifests %s and %s were written with different digests or split thresholds\n", left,
+                    right);
+            status = -1;
+        }
+        stored = &sides[i];
+    }
+
+    // The cache holds digests of the context's own kind only, so it is left
+    // alone when a stored manifest asks for another. Otherwise both trees
+    // are hashed through one mapping of it and saved back together, so
+    // that neither side evicts the other's files.
+    const DigestAlgorithm *alg = stored ? stored->alg : ctx->alg;
+    uint64_t split_threshold = stored ? stored->split_threshold : ctx->options.split_threshold;
+    int cached = ctx->cache_path && alg == ctx->alg && split_threshold == ctx->options.split_threshold;
+    HashCache cache;
+    uint64_t started = cached ? open_cache(ctx, &cache) : 0;
+    const FileList *lists[2];
+    const uint8_t *list_digests[2];
+    size_t list_count = 0;
+    for (int i = 0; i < 2 && status == 0; ++i) {
+        if (!is_tree[i]) {
+            continue;
+        }
+        apply_settings(ctx);
+        ctx->settings.digest = alg;
+        ctx->settings.split_threshold = split_threshold;
+        ctx->settings.cache = cached ? &cache : NULL;
+        dirhash_result side;
+        memset(&side, 0, sizeof(side));
+        struct timespec side_start;
+        FileList *fl;
+        if (hash_tree(ctx, paths[i], &sides[i], NULL, NULL, &side_start, &fl, &side) < 0) {
+            status = -1;
+        } else {
+            opened[i] = 1;
+        }
+        // The digests are taken from the context, so that the other side
+        // does not hash into them.
+        if (cached) {
+            lists[list_count] = fl;
+            list_digests[list_count++] = ctx->digests;
+            ctx->digests = NULL;
+            ctx->digest_capacity = 0;
+        } else {
+            file_list_free(fl);
+        }
+        end_call(ctx);
+        result->traversal_time += side.traversal_time;
+        // The progress line is left open, as for dirhash_hash().
+        if (ctx->options.report) {
+            printf("\n");
+        }
+    }
+    if (cached) {
+        save_cache(ctx, &cache, lists, list_digests, list_count, started);
+        for (size_t i = 0; i < list_count; ++i) {
+            file_list_free((FileList *)lists[i]);
+            free((uint8_t *)list_digests[i]);
+        }
+    }
+
+    if (status == 0) {
+        ManifestDiff diff;
+        status = manifest_diff(&sides[0], &sides[1], out, &diff);
+        if (status < 0) {
+            fprintf(stderr, "Corrupt manifest comparing %s with %s\n", left, right);
+        } else {
+            status = diff.changed || diff.missing || diff.extra;
+        }
+        result->files = diff.matched + diff.changed + diff.skipped;
+        result->changed = diff.changed;
+        result->missing = diff.missing;
+        result->extra = diff.extra;
+        result->skipped = diff.skipped;
+    }
+    for (int i = 0; i < 2; ++i) {
+        if (opened[i]) {
+            manifest_close(&sides[i]);
+        }
+    }
+    result->total_time = seconds_since(&start);
+    return status;
+}
+
+// Hashes the tree at path into its Merkle root and keeps the root up to
+// date as the tree changes, answering queries on socket_path; see
+// watch_serve(). Only returns on failure, with -1.
+int dirhash_watch(dirhash_ctx *ctx, const char *path, const char *socket_path) {
+    if (ctx->options.pipeline || ctx->options.split_threshold || ctx->cache_path) {
+        fprintf(stderr, "Watching cannot be combined with pipelined, split or cached hashing\n");
+        return -1;
+    }
+    apply_settings(ctx);
+    return watch_serve(path, socket_path, ctx->threads, ctx->engines, ctx->options.report);
+}
+
+// Writes the statistics gathered so far as JSON, if the context that
+// gathered them was created with stats set.
+void dirhash_write_stats(FILE *out, const dirhash_result *result) {
+    if (stats_enabled()) {
+        stats_write_json(out, result->traversal_time, result->total_time);
+    }
+}
+
+// Formats seconds as HH:MM:SS.mmm.
+void dirhash_format_time(double seconds, char *buf, size_t buf_size) {
+    int hours, minutes, secs, milliseconds;
+    format_time(seconds, &hours, &minutes, &secs, &milliseconds);
+    snprintf(buf, buf_size, "%02d:%02d:%02d.%03d", hours, minutes, secs, milliseconds);
+}
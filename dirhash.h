@@ -0,0 +1,90 @@
+#ifndef DIRHASH_H
+#define DIRHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// libdirhash: the traversal, hashing and combining stages of dirHash as a
+// library. A context is created once and keeps its hashing engines, with
+// their rings, registered buffer pools and descriptor caches, alive from
+// one call to the next, so that repeated hashes skip the setup a run of
+// the dirHash binary pays each time. Each context hashes with its own
+// options, so several may be hashing at once from different threads; what
+// they share is the budget for read buffers, which a memory_limit sets for
+// every context, and the statistics. The engines share out the soft
+// descriptor limit as it stands when the context is created; a host that
+// wants them to cache more raises RLIMIT_NOFILE first, as dirHash does.
+
+#define DIRHASH_API __attribute__((visibility("default")))
+
+#define DIRHASH_MAX_DIGEST_SIZE 32
+
+typedef enum {
+    DIRHASH_IO_BUFFERED,
+    DIRHASH_IO_DIRECT,
+    DIRHASH_IO_DONTNEED
+} dirhash_io_mode;
+
+// Zeroed options hash with XXH64 into the legacy hash, one thread per
+// online CPU, through the page cache. With manifest_path set, every hash
+// that is not pipelined also writes a manifest of its files there.
+typedef struct {
+    size_t threads;
+    const char *digest;
+    int merkle;
+    int pipeline;
+    int physical_order;
+    uint64_t split_threshold;
+    const char *cache_path;
+    const char *manifest_path;
+    size_t memory_limit;
+    int huge_pages;
+    dirhash_io_mode io_mode;
+    int mmap;
+    int stats;
+    int report;
+} dirhash_options;
+
+// What one call found. root holds the Merkle root in Merkle and pipeline
+// runs, and root_size is 0 otherwise; text is the final hash as dirHash
+// prints it. Verifying and comparing count the files that differ, and
+// comparing also those it skipped inside identical directories.
+typedef struct {
+    uint64_t hash;
+    uint8_t root[DIRHASH_MAX_DIGEST_SIZE];
+    size_t root_size;
+    char text[2 * DIRHASH_MAX_DIGEST_SIZE + 1];
+    size_t files;
+    size_t duplicate_groups;
+    size_t changed;
+    size_t missing;
+    size_t extra;
+    size_t skipped;
+    double traversal_time;
+    double total_time;
+} dirhash_result;
+
+// Called once per file with its digest, from the hashing threads, several
+// at a time and in no particular order. An all-zero digest marks a
+// file that could not be read. path is only valid during the call.
+typedef void (*dirhash_file_cb)(void *arg, const char *path, uint64_t size, const uint8_t *digest,
+                                size_t digest_size);
+
+typedef struct dirhash_ctx dirhash_ctx;
+
+DIRHASH_API dirhash_ctx *dirhash_ctx_new(const dirhash_options *options);
+DIRHASH_API void dirhash_ctx_free(dirhash_ctx *ctx);
+DIRHASH_API size_t dirhash_ctx_threads(const dirhash_ctx *ctx);
+DIRHASH_API int dirhash_hash(dirhash_ctx *ctx, const char *path, dirhash_file_cb callback, void *arg,
+                             dirhash_result *result);
+DIRHASH_API int dirhash_find_duplicates(dirhash_ctx *ctx, const char *path, FILE *out, dirhash_result *result);
+DIRHASH_API int dirhash_verify(dirhash_ctx *ctx, const char *path, const char *manifest_path, int fail_fast,
+                               FILE *out, dirhash_result *result);
+DIRHASH_API int dirhash_diff(dirhash_ctx *ctx, const char *left, const char *right, FILE *out,
+                             dirhash_result *result);
+DIRHASH_API int dirhash_watch(dirhash_ctx *ctx, const char *path, const char *socket_path);
+DIRHASH_API void dirhash_write_stats(FILE *out, const dirhash_result *result);
+DIRHASH_API void dirhash_format_time(double seconds, char *buf, size_t buf_size);
+
+#endif
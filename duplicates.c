@@ -0,0 +1,324 @@
+#define _GNU_SOURCE
+
+#include "duplicates.h"
+#include "hashing.h"
+#include "constants.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <omp.h>
+
+#define NO_FILE UINT32_MAX
+
+// A candidate file and the digests gathered for it so far; range is where
+// its head digest sits among the partial digests.
+typedef struct {
+    uint32_t index;
+    uint32_t range;
+    uint64_t size;
+    uint64_t partial;
+} Candidate;
+
+// Exact concurrent table of full digests. A slot is claimed by CAS on its
+// state, filled, then published; files with the same size and digest are
+// chained through next[] from the slot's head.
+typedef struct {
+    uint8_t digest[DIGEST_MAX_SIZE];
+    uint64_t size;
+    uint32_t head;
+    uint32_t state;
+} DigestSlot;
+
+typedef struct {
+    DigestSlot *slots;
+    uint64_t mask;
+    size_t digest_size;
+    uint32_t *next;
+} DigestTable;
+
+enum { SLOT_EMPTY, SLOT_CLAIMED, SLOT_READY };
+
+static void *alloc_array(size_t count, size_t elem_size, const char *what) {
+    void *p = calloc(count ? count : 1, elem_size);
+    if (!p) {
+        perror(what);
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static void table_insert(DigestTable *table, const uint8_t *digest, uint64_t size, uint32_t index) {
+    uint64_t i = (digest_key(digest, table->digest_size) ^ (size * 0x9E3779B97F4A7C15ULL)) & table->mask;
+    for (;; i = (i + 1) & table->mask) {
+        DigestSlot *slot = &table->slots[i];
+        uint32_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+        if (state == SLOT_EMPTY) {
+            uint32_t expected = SLOT_EMPTY;
+            if (__atomic_compare_exchange_n(&slot->state, &expected, SLOT_CLAIMED, 0, __ATOMIC_ACQUIRE,
+                                            __ATOMIC_ACQUIRE)) {
+                memcpy(slot->digest, digest, table->digest_size);
+                slot->size = size;
+                slot->head = index;
+                table->next[index] = NO_FILE;
+                __atomic_store_n(&slot->state, SLOT_READY, __ATOMIC_RELEASE);
+                return;
+            }
+            state = expected;
+        }
+        while (state == SLOT_CLAIMED) {
+            state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+        }
+        if (slot->size == size && memcmp(slot->digest, digest, table->digest_size) == 0) {
+            uint32_t head = __atomic_load_n(&slot->head, __ATOMIC_RELAXED);
+            do {
+                table->next[index] = head;
+            } while (!__atomic_compare_exchange_n(&slot->head, &head, index, 1, __ATOMIC_RELEASE,
+                                                  __ATOMIC_RELAXED));
+            return;
+        }
+    }
+}
+
+// Sorts by size, with hard links to one inode next to each other.
+static int compare_by_size(const void *a, const void *b, void *arg) {
+    const FileList *fl = (const FileList *)arg;
+    const Candidate *ca = (const Candidate *)a;
+    const Candidate *cb = (const Candidate *)b;
+    const FileEntry *ea = &fl->entries[ca->index];
+    const FileEntry *eb = &fl->entries[cb->index];
+    if (ca->size != cb->size) {
+        return ca->size < cb->size ? -1 : 1;
+    }
+    if (ea->dev != eb->dev) {
+        return ea->dev < eb->dev ? -1 : 1;
+    }
+    if (ea->ino != eb->ino) {
+        return ea->ino < eb->ino ? -1 : 1;
+    }
+    return ca->index < cb->index ? -1 : ca->index > cb->index;
+}
+
+static int compare_by_partial(const void *a, const void *b) {
+    const Candidate *ca = (const Candidate *)a;
+    const Candidate *cb = (const Candidate *)b;
+    if (ca->size != cb->size) {
+        return ca->size < cb->size ? -1 : 1;
+    }
+    if (ca->partial != cb->partial) {
+        return ca->partial < cb->partial ? -1 : 1;
+    }
+    return ca->index < cb->index ? -1 : ca->index > cb->index;
+}
+
+// Larger groups first, since they are where the space is.
+static int compare_groups(const void *a, const void *b, void *arg) {
+    const DigestTable *table = (const DigestTable *)arg;
+    const DigestSlot *ga = *(const DigestSlot *const *)a;
+    const DigestSlot *gb = *(const DigestSlot *const *)b;
+    if (ga->size != gb->size) {
+        return ga->size > gb->size ? -1 : 1;
+    }
+    return memcmp(ga->digest, gb->digest, table->digest_size);
+}
+
+static int compare_indices(const void *a, const void *b) {
+    uint32_t ia = *(const uint32_t *)a;
+    uint32_t ib = *(const uint32_t *)b;
+    return ia < ib ? -1 : ia > ib;
+}
+
+// Keeps only candidates that share their key with a neighbour, in place,
+// and returns how many are left. cands must be sorted by that key.
+static size_t keep_colliding(Candidate *cands, size_t count, int by_partial) {
+    size_t kept = 0;
+    for (size_t i = 0; i < count;) {
+        size_t j = i + 1;
+        while (j < count && cands[j].size == cands[i].size &&
+               (!by_partial || cands[j].partial == cands[i].partial)) {
+            j++;
+        }
+        if (j - i > 1) {
+            memmove(&cands[kept], &cands[i], (j - i) * sizeof(Candidate));
+            kept += j - i;
+        }
+        i = j;
+    }
+    return kept;
+}
+
+// Hashes ranges on every thread, QUEUE_DEPTH ranges per batch, into
+// digests, one digest-sized record per range.
+static void hash_ranges(const FileList *fl, const HashRange *ranges, size_t count, size_t num_threads,
+                        HashEngine *engines, uint8_t *digests) {
+    size_t digest_size = engines->settings->digest->size;
+    size_t num_batches = (count + QUEUE_DEPTH - 1) / QUEUE_DEPTH;
+
+    #pragma omp parallel for num_threads(num_threads) schedule(dynamic)
+    for (size_t batch = 0; batch < num_batches; ++batch) {
+        size_t begin = batch * QUEUE_DEPTH;
+        size_t n = count - begin < QUEUE_DEPTH ? count - begin : QUEUE_DEPTH;
+        hash_engine_hash_ranges(&engines[omp_get_thread_num()], fl, ranges, begin, n,
+                                digests + begin * digest_size);
+    }
+}
+
+// Reports groups of files with identical contents, narrowing the
+// candidates in stages so that as few bytes as possible are read:
+//   1. files whose size no other file has are dropped, using the sizes
+//      from traversal; empty files and extra hard links are skipped;
+//   2. the first and last DUPLICATE_PARTIAL_SIZE bytes are hashed, which
+//      for small files is the whole file;
+//   3. files still colliding are hashed in full into an exact concurrent
+//      table keyed by (size, digest), comparing whole digests.
+// Each group is written to out as a "digest size" line followed by its
+// paths. All digests are of the selected algorithm. Returns the number of groups. Worker n hashes with engines[n].
+size_t find_duplicates(const FileList *fl, size_t num_threads, HashEngine *engines, FILE *out) {
+    Candidate *cands = (Candidate *)alloc_array(fl->size, sizeof(Candidate), "Failed to allocate candidates");
+    size_t count = 0;
+    for (size_t i = 0; i < fl->size; ++i) {
+        if (fl->entries[i].size > 0) {
+            cands[count].index = (uint32_t)i;
+            cands[count].size = fl->entries[i].size;
+            count++;
+        }
+    }
+    qsort_r(cands, count, sizeof(Candidate), compare_by_size, (void *)fl);
+
+    // Hard links are one file; keep the first path of each inode.
+    size_t unique = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const FileEntry *entry = &fl->entries[cands[i].index];
+        const FileEntry *prev = unique ? &fl->entries[cands[unique - 1].index] : NULL;
+        if (!prev || prev->dev != entry->dev || prev->ino != entry->ino) {
+            cands[unique++] = cands[i];
+        }
+    }
+    count = keep_colliding(cands, unique, 0);
+
+    // Stage 2: head and tail of every candidate, or the whole file if that
+    // is no larger.
+    HashRange *ranges = (HashRange *)alloc_array(count * 2, sizeof(HashRange), "Failed to allocate ranges");
+    size_t range_count = 0;
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t size = cands[i].size;
+        cands[i].range = (uint32_t)range_count;
+        ranges[range_count++] = (HashRange){ cands[i].index, 0, size <= 2 * DUPLICATE_PARTIAL_SIZE ? size
+                                                                                     : DUPLICATE_PARTIAL_SIZE };
+        if (size > 2 * DUPLICATE_PARTIAL_SIZE) {
+            ranges[range_count++] = (HashRange){ cands[i].index, size - DUPLICATE_PARTIAL_SIZE, size };
+        }
+    }
+    // Small files keep their digest here until they go into the table.
+    size_t digest_size = engines->settings->digest->size;
+    uint8_t *partials = (uint8_t *)alloc_array(range_count, digest_size, "Failed to allocate digests");
+    hash_ranges(fl, ranges, range_count, num_threads, engines, partials);
+    for (size_t i = 0; i < count; ++i) {
+        const uint8_t *head = partials + (size_t)cands[i].range * digest_size;
+        uint64_t partial = digest_key(head, digest_size);
+        if (cands[i].size > 2 * DUPLICATE_PARTIAL_SIZE) {
+            uint64_t pair[2] = { partial, digest_key(head + digest_size, digest_size) };
+            partial = pair[0] && pair[1] ? XXH64(pair, sizeof(pair), HASH_SEED) : 0;
+        }
+        cands[i].partial = partial;
+    }
+    free(ranges);
+
+    size_t hashed = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (cands[i].partial != 0) {
+            cands[hashed++] = cands[i];
+        }
+    }
+    count = hashed;
+    qsort(cands, count, sizeof(Candidate), compare_by_partial);
+    count = keep_colliding(cands, count, 1);
+
+    // Stage 3: small files already have their full digest; the rest are
+    // read completely, through the hash cache if one is set.
+    DigestTable table;
+    uint64_t capacity = 16;
+    while (capacity < count * 2) {
+        capacity *= 2;
+    }
+    table.slots = (DigestSlot *)alloc_array(capacity, sizeof(DigestSlot), "Failed to allocate duplicate table");
+    table.mask = capacity - 1;
+    table.digest_size = digest_size;
+    table.next = (uint32_t *)alloc_array(fl->size, sizeof(uint32_t), "Failed to allocate duplicate chains");
+
+    size_t *full = (size_t *)alloc_array(count, sizeof(size_t), "Failed to allocate candidates");
+    size_t full_count = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (cands[i].size <= 2 * DUPLICATE_PARTIAL_SIZE) {
+            table_insert(&table, partials + (size_t)cands[i].range * digest_size, cands[i].size, cands[i].index);
+        } else {
+            full[full_count++] = cands[i].index;
+        }
+    }
+
+    free(partials);
+
+    size_t num_batches = (full_count + QUEUE_DEPTH - 1) / QUEUE_DEPTH;
+    #pragma omp parallel num_threads(num_threads)
+    {
+        HashEngine *engine = &engines[omp_get_thread_num()];
+        uint8_t digests[QUEUE_DEPTH * DIGEST_MAX_SIZE];
+
+        #pragma omp for schedule(dynamic)
+        for (size_t batch = 0; batch < num_batches; ++batch) {
+            size_t begin = batch * QUEUE_DEPTH;
+            size_t n = full_count - begin < QUEUE_DEPTH ? full_count - begin : QUEUE_DEPTH;
+            hash_engine_hash_files(engine, fl, full, begin, n, digests);
+            for (size_t j = 0; j < n; ++j) {
+                const uint8_t *digest = digests + j * digest_size;
+                if (digest_key(digest, digest_size) != 0) {
+                    table_insert(&table, digest, fl->entries[full[begin + j]].size, (uint32_t)full[begin + j]);
+                }
+            }
+        }
+    }
+    free(full);
+    free(cands);
+
+    size_t group_count = 0;
+    DigestSlot **groups = (DigestSlot **)alloc_array(capacity, sizeof(DigestSlot *), "Failed to allocate groups");
+    for (uint64_t i = 0; i < capacity; ++i) {
+        DigestSlot *slot = &table.slots[i];
+        if (slot->state == SLOT_READY && table.next[slot->head] != NO_FILE) {
+            groups[group_count++] = slot;
+        }
+    }
+    qsort_r(groups, group_count, sizeof(DigestSlot *), compare_groups, &table);
+
+    size_t path_capacity = MAX_PATH_LENGTH;
+    char *path = (char *)alloc_array(path_capacity, 1, "Failed to allocate path");
+    uint32_t *members = (uint32_t *)alloc_array(count, sizeof(uint32_t), "Failed to allocate group");
+    char hex[2 * DIGEST_MAX_SIZE + 1];
+    for (size_t g = 0; g < group_count; ++g) {
+        size_t n = 0;
+        for (uint32_t f = groups[g]->head; f != NO_FILE; f = table.next[f]) {
+            members[n++] = f;
+        }
+        qsort(members, n, sizeof(uint32_t), compare_indices);
+
+        digest_format(groups[g]->digest, digest_size, hex);
+        fprintf(out, "%s %lu\n", hex, groups[g]->size);
+        for (size_t m = 0; m < n; ++m) {
+            size_t len = file_list_path(fl, members[m], path, path_capacity);
+            if (len >= path_capacity) {
+                path_capacity = len + 1;
+                free(path);
+                path = (char *)alloc_array(path_capacity, 1, "Failed to allocate path");
+                file_list_path(fl, members[m], path, path_capacity);
+            }
+            fprintf(out, "  %s\n", path);
+        }
+        fputc('\n', out);
+    }
+
+    free(path);
+    free(members);
+    free(groups);
+    free(table.slots);
+    free(table.next);
+    return group_count;
+}
@@ -0,0 +1,11 @@
+#ifndef DUPLICATES_H
+#define DUPLICATES_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include "file_list.h"
+#include "hashing.h"
+
+size_t find_duplicates(const FileList *fl, size_t num_threads, HashEngine *engines, FILE *out);
+
+#endif
@@ -1,61 +1,237 @@
+#define _GNU_SOURCE
+
 #include "file_list.h"
 #include "constants.h" 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
+static void *grow_array(void *array, size_t *capacity, size_t needed, size_t elem_size, const char *what) {
+    if (needed <= *capacity) {
+        return array;
+    }
+    size_t new_capacity = *capacity ? *capacity : 1;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+    void *new_array = realloc(array, new_capacity * elem_size);
+    if (!new_array) {
+        perror(what);
+        exit(EXIT_FAILURE);
+    }
+    *capacity = new_capacity;
+    return new_array;
+}
+
 FileList* file_list_init(size_t initial_capacity) {
-    FileList *fl = (FileList*)malloc(sizeof(FileList));
+    FileList *fl = (FileList*)calloc(1, sizeof(FileList));
     if (!fl) {
         perror("Failed to allocate FileList");
         exit(EXIT_FAILURE);
     }
-    fl->filepaths = (char**)malloc(initial_capacity * sizeof(char *));
-    if (!fl->filepaths) {
-        perror("Failed to allocate filepaths array");
-        free(fl);
-        exit(EXIT_FAILURE);
-    }
-    fl->capacity = initial_capacity;
-    fl->size = 0;
+    fl->entries = grow_array(NULL, &fl->capacity, initial_capacity, sizeof(FileEntry),
+                             "Failed to allocate file entries array");
+    fl->names = grow_array(NULL, &fl->names_capacity, initial_capacity * 16, 1,
+                           "Failed to allocate name arena");
     return fl;
 }
 
-static int compare_filepaths(const void *a, const void *b) {
-    const char *path_a = *(const char **)a;
-    const char *path_b = *(const char **)b;
-    return strcmp(path_a, path_b);
+// Copies name into the arena and returns its offset.
+static uint64_t arena_add(FileList *fl, const char *name) {
+    size_t len = strlen(name) + 1;
+    fl->names = grow_array(fl->names, &fl->names_capacity, fl->names_size + len, 1,
+                           "Failed to resize name arena");
+    uint64_t offset = fl->names_size;
+    memcpy(fl->names + offset, name, len);
+    fl->names_size += len;
+    return offset;
 }
 
-void file_list_sort(FileList *fl) {
-    qsort(fl->filepaths, fl->size, sizeof(char *), compare_filepaths);
+void file_list_add(FileList *fl, uint32_t parent, const char *name, uint64_t size, uint64_t ino, uint64_t dev,
+                   uint64_t mtime, uint64_t ctime) {
+    fl->entries = grow_array(fl->entries, &fl->capacity, fl->size + 1, sizeof(FileEntry),
+                             "Failed to resize file entries array");
+    FileEntry *entry = &fl->entries[fl->size++];
+    entry->parent = parent;
+    entry->name = arena_add(fl, name);
+    entry->size = size;
+    entry->ino = ino;
+    entry->dev = dev;
+    entry->mtime = mtime;
+    entry->ctime = ctime;
+}
+
+void file_list_add_dir(FileList *fl, uint32_t id, uint32_t parent, const char *name) {
+    fl->dirs = grow_array(fl->dirs, &fl->dir_capacity, fl->dir_count + 1, sizeof(DirEntry),
+                          "Failed to resize directory array");
+    DirEntry *dir = &fl->dirs[fl->dir_count++];
+    dir->id = id;
+    dir->parent = parent;
+    dir->name = arena_add(fl, name);
 }
 
-void file_list_add(FileList *fl, const char *filepath) {
-    if (fl->size == fl->capacity) {
-        fl->capacity *= 2;
-        char **new_array = (char**)realloc(fl->filepaths, fl->capacity * sizeof(char *));
-        if (!new_array) {
-            perror("Failed to resize filepaths array");
+// Moves every entry from src into dst and frees src. src's names are
+// appended to dst's arena, and its directories, which carry ids allocated
+// across all shards, are placed at the index matching their id.
+void file_list_merge(FileList *dst, FileList *src) {
+    uint64_t base = dst->names_size;
+    dst->names = grow_array(dst->names, &dst->names_capacity, dst->names_size + src->names_size, 1,
+                            "Failed to resize name arena");
+    memcpy(dst->names + base, src->names, src->names_size);
+    dst->names_size += src->names_size;
+
+    dst->entries = grow_array(dst->entries, &dst->capacity, dst->size + src->size, sizeof(FileEntry),
+                              "Failed to resize file entries array");
+    for (size_t i = 0; i < src->size; ++i) {
+        FileEntry *entry = &dst->entries[dst->size++];
+        *entry = src->entries[i];
+        entry->name += base;
+    }
+
+    for (size_t i = 0; i < src->dir_count; ++i) {
+        DirEntry dir = src->dirs[i];
+        if (dir.id >= dst->dir_count) {
+            dst->dirs = grow_array(dst->dirs, &dst->dir_capacity, (size_t)dir.id + 1, sizeof(DirEntry),
+                                   "Failed to resize directory array");
+            dst->dir_count = (size_t)dir.id + 1;
+        }
+        dir.name += base;
+        dst->dirs[dir.id] = dir;
+    }
+
+    free(src->entries);
+    free(src->dirs);
+    free(src->names);
+    free(src);
+}
+
+// Writes the path of directory dir into buf, truncating if needed, and
+// returns the full length of the path like snprintf does.
+size_t file_list_dir_path(const FileList *fl, uint32_t dir, char *buf, size_t buf_size) {
+    size_t len = 0;
+    for (uint32_t d = dir; d != FILE_LIST_NO_PARENT; d = fl->dirs[d].parent) {
+        len += strlen(fl->names + fl->dirs[d].name) + (d != dir);
+    }
+
+    // Fill from the end, walking up from dir to the root.
+    size_t end = len;
+    for (uint32_t d = dir; d != FILE_LIST_NO_PARENT; d = fl->dirs[d].parent) {
+        const char *name = fl->names + fl->dirs[d].name;
+        size_t name_len = strlen(name);
+        if (d != dir) {
+            end--;
+            if (end < buf_size) {
+                buf[end] = '/';
+            }
+        }
+        end -= name_len;
+        for (size_t i = 0; i < name_len; ++i) {
+            if (end + i < buf_size) {
+                buf[end + i] = name[i];
+            }
+        }
+    }
+    if (buf_size > 0) {
+        buf[len < buf_size ? len : buf_size - 1] = '\0';
+    }
+    return len;
+}
+
+size_t file_list_path(const FileList *fl, size_t index, char *buf, size_t buf_size) {
+    const FileEntry *entry = &fl->entries[index];
+    size_t len = file_list_dir_path(fl, entry->parent, buf, buf_size);
+    int written = snprintf(len < buf_size ? buf + len : NULL, len < buf_size ? buf_size - len : 0,
+                           "/%s", fl->names + entry->name);
+    return len + (size_t)written;
+}
+
+// Builds the path of file index in *buf, growing the buffer as needed, and
+// returns it.
+const char *file_list_path_buf(const FileList *fl, size_t index, char **buf, size_t *capacity) {
+    size_t len = file_list_path(fl, index, *buf, *capacity);
+    if (len >= *capacity) {
+        free(*buf);
+        *capacity = len + 1 > MAX_PATH_LENGTH ? len + 1 : MAX_PATH_LENGTH;
+        *buf = (char *)malloc(*capacity);
+        if (!*buf) {
+            perror("Failed to allocate path");
             exit(EXIT_FAILURE);
         }
-        fl->filepaths = new_array;
+        file_list_path(fl, index, *buf, *capacity);
+    }
+    return *buf;
+}
+
+// Files are sorted by full path without building one per file: the paths of
+// the (far fewer) directories are built once, and each comparison walks
+// "dir/name" as if the two parts were joined.
+typedef struct {
+    const FileList *fl;
+    char **dir_paths;
+} SortState;
+
+static int compare_joined(const char *dir_a, const char *name_a, const char *dir_b, const char *name_b) {
+    const char *parts_a[3] = {dir_a, "/", name_a};
+    const char *parts_b[3] = {dir_b, "/", name_b};
+    const char *pa = parts_a[0];
+    const char *pb = parts_b[0];
+    int ia = 0, ib = 0;
+    for (;;) {
+        while (*pa == '\0' && ia < 2) pa = parts_a[++ia];
+        while (*pb == '\0' && ib < 2) pb = parts_b[++ib];
+        unsigned char ca = (unsigned char)*pa;
+        unsigned char cb = (unsigned char)*pb;
+        if (ca != cb || ca == '\0') {
+            return (int)ca - (int)cb;
+        }
+        pa++;
+        pb++;
+    }
+}
+
+static int compare_entries(const void *a, const void *b, void *arg) {
+    const SortState *state = (const SortState *)arg;
+    const FileEntry *entry_a = (const FileEntry *)a;
+    const FileEntry *entry_b = (const FileEntry *)b;
+    const char *name_a = state->fl->names + entry_a->name;
+    const char *name_b = state->fl->names + entry_b->name;
+    if (entry_a->parent == entry_b->parent) {
+        return strcmp(name_a, name_b);
     }
-    char *copy = strdup(filepath);
-    if (!copy) {
-        perror("Failed to duplicate filepath");
+    return compare_joined(state->dir_paths[entry_a->parent], name_a, state->dir_paths[entry_b->parent], name_b);
+}
+
+void file_list_sort(FileList *fl) {
+    char **paths = (char **)malloc(fl->dir_count * sizeof(char *));
+    if (!paths && fl->dir_count > 0) {
+        perror("Failed to allocate sort state");
         exit(EXIT_FAILURE);
     }
-    fl->filepaths[fl->size++] = copy;
+
+    for (size_t d = 0; d < fl->dir_count; ++d) {
+        size_t len = file_list_dir_path(fl, (uint32_t)d, NULL, 0);
+        paths[d] = (char *)malloc(len + 1);
+        if (!paths[d]) {
+            perror("Failed to allocate directory path");
+            exit(EXIT_FAILURE);
+        }
+        file_list_dir_path(fl, (uint32_t)d, paths[d], len + 1);
+    }
+
+    SortState state = { fl, paths };
+    qsort_r(fl->entries, fl->size, sizeof(FileEntry), compare_entries, &state);
+
+    for (size_t d = 0; d < fl->dir_count; ++d) {
+        free(paths[d]);
+    }
+    free(paths);
 }
 
 void file_list_free(FileList *fl) {
     if (fl) {
-        for (size_t i = 0; i < fl->size; ++i) {
-            free(fl->filepaths[i]);
-        }
-        free(fl->filepaths);
+        free(fl->entries);
+        free(fl->dirs);
+        free(fl->names);
         free(fl);
     }
 }
-
@@ -2,16 +2,58 @@
 #define FILE_LIST_H
 
 #include <stddef.h>
+#include <stdint.h>
 
+#define FILE_LIST_NO_PARENT UINT32_MAX
+
+// Paths are stored as a tree: every file and directory records the index of
+// its parent directory and the offset of its own name in a shared arena of
+// NUL-terminated names. Full paths are rebuilt on demand. The root
+// directory has no parent and its name is the path the walk started from.
+typedef struct {
+    uint32_t id;
+    uint32_t parent;
+    uint64_t name;
+} DirEntry;
+
+// A regular file found during traversal, with the metadata the hashing
+// stage needs so that it never has to stat the file again. Timestamps are
+// in nanoseconds since the epoch.
 typedef struct {
-    char **filepaths;
+    uint32_t parent;
+    uint64_t name;
+    uint64_t size;
+    uint64_t ino;
+    uint64_t dev;
+    uint64_t mtime;
+    uint64_t ctime;
+} FileEntry;
+
+typedef struct {
+    FileEntry *entries;
     size_t capacity;
     size_t size;
+    DirEntry *dirs;
+    size_t dir_capacity;
+    size_t dir_count;
+    char *names;
+    size_t names_capacity;
+    size_t names_size;
 } FileList;
 
 FileList* file_list_init(size_t initial_capacity);
-void file_list_add(FileList *fl, const char *filepath);
+void file_list_add(FileList *fl, uint32_t parent, const char *name, uint64_t size, uint64_t ino, uint64_t dev,
+                   uint64_t mtime, uint64_t ctime);
+void file_list_add_dir(FileList *fl, uint32_t id, uint32_t parent, const char *name);
+void file_list_merge(FileList *dst, FileList *src);
+void file_list_sort(FileList *fl);
+size_t file_list_dir_path(const FileList *fl, uint32_t dir, char *buf, size_t buf_size);
+size_t file_list_path(const FileList *fl, size_t index, char *buf, size_t buf_size);
+const char *file_list_path_buf(const FileList *fl, size_t index, char **buf, size_t *capacity);
 void file_list_free(FileList *fl);
 
-#endif
+static inline const char *file_list_name(const FileList *fl, uint64_t name) {
+    return fl->names + name;
+}
 
+#endif
@@ -0,0 +1,205 @@
+#define _GNU_SOURCE
+
+#include "hash_cache.h"
+#include "constants.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static uint64_t key_slot(uint64_t dev, uint64_t ino, uint64_t mask) {
+    uint64_t h = ino ^ (dev * 0x9E3779B97F4A7C15ULL);
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return h & mask;
+}
+
+// Maps the cache at path. A missing or unreadable cache leaves it empty so
+// that the run simply hashes everything.
+void hash_cache_open(HashCache *cache, const char *path, const DigestAlgorithm *alg, uint64_t split_threshold) {
+    memset(cache, 0, sizeof(*cache));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "Failed to open hash cache %s: %s\n", path, strerror(errno));
+        }
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(HashCacheHeader)) {
+        fprintf(stderr, "Ignoring invalid hash cache %s\n", path);
+        close(fd);
+        return;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map hash cache %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    const HashCacheHeader *header = (const HashCacheHeader *)map;
+    if (memcmp(header->magic, HASH_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != HASH_CACHE_VERSION || header->seed != HASH_SEED ||
+        header->digest_id != alg->id || header->digest_size != alg->size ||
+        header->split_threshold != split_threshold ||
+        header->capacity == 0 || (header->capacity & (header->capacity - 1)) != 0 ||
+        header->capacity > ((size_t)st.st_size - sizeof(HashCacheHeader)) / sizeof(HashCacheEntry) ||
+        header->count > header->capacity / 2) {
+        fprintf(stderr, "Ignoring invalid hash cache %s\n", path);
+        munmap(map, st.st_size);
+        return;
+    }
+
+    madvise(map, st.st_size, MADV_RANDOM);
+    cache->map = map;
+    cache->map_size = st.st_size;
+    cache->entries = (const HashCacheEntry *)(header + 1);
+    cache->mask = header->capacity - 1;
+    cache->digest_size = alg->size;
+}
+
+void hash_cache_close(HashCache *cache) {
+    if (cache->map) {
+        munmap(cache->map, cache->map_size);
+    }
+    memset(cache, 0, sizeof(*cache));
+}
+
+// Copies the cached digest to digest and returns 1 if the file's metadata
+// still matches what was recorded when it was hashed. The probe gives up
+// after every slot, so a damaged cache with no empty one cannot hang it.
+int hash_cache_lookup(const HashCache *cache, const FileEntry *entry, uint8_t *digest) {
+    if (!cache->entries) {
+        return 0;
+    }
+    uint64_t i = key_slot(entry->dev, entry->ino, cache->mask);
+    for (uint64_t probes = 0; probes <= cache->mask; ++probes, i = (i + 1) & cache->mask) {
+        const HashCacheEntry *e = &cache->entries[i];
+        if (digest_key(e->digest, cache->digest_size) == 0) {
+            return 0;
+        }
+        if (e->dev == entry->dev && e->ino == entry->ino) {
+            if (e->size != entry->size || e->mtime != entry->mtime || e->ctime != entry->ctime) {
+                return 0;
+            }
+            memcpy(digest, e->digest, cache->digest_size);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// A file changed within the timestamp granularity of the run's start could
+// change again without its timestamps moving, so it is left out.
+static int cacheable(const FileEntry *entry, const uint8_t *digest, size_t digest_size, uint64_t started) {
+    return digest_key(digest, digest_size) != 0 && entry->mtime + HASH_CACHE_RACY_WINDOW < started &&
+           entry->ctime + HASH_CACHE_RACY_WINDOW < started;
+}
+
+// Writes a fresh cache holding every file of the list_count lists that
+// hashed successfully, the digests of lists[l] being digests[l], and
+// replaces the one at path atomically. started is the wall-clock time, in
+// nanoseconds, at which the first traversal began. Returns -1 on failure.
+int hash_cache_save(const char *path, const DigestAlgorithm *alg, uint64_t split_threshold,
+                    const FileList *const *lists, const uint8_t *const *digests, size_t list_count, uint64_t started) {
+    uint64_t count = 0;
+    for (size_t l = 0; l < list_count; ++l) {
+        for (size_t i = 0; i < lists[l]->size; ++i) {
+            count += cacheable(&lists[l]->entries[i], digests[l] + i * alg->size, alg->size, started);
+        }
+    }
+
+    // Keep the table at most half full so that probe sequences stay short.
+    uint64_t capacity = 16;
+    while (capacity < count * 2) {
+        capacity *= 2;
+    }
+    size_t map_size = sizeof(HashCacheHeader) + capacity * sizeof(HashCacheEntry);
+
+    size_t tmp_len = strlen(path) + sizeof(".tmp");
+    char *tmp_path = (char *)malloc(tmp_len);
+    if (!tmp_path) {
+        perror("Failed to allocate hash cache path");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(tmp_path, tmp_len, "%s.tmp", path);
+
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to create hash cache %s: %s\n", tmp_path, strerror(errno));
+        free(tmp_path);
+        return -1;
+    }
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, map_size) == 0) {
+        map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map hash cache %s: %s\n", tmp_path, strerror(errno));
+        close(fd);
+        unlink(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+
+    HashCacheHeader *header = (HashCacheHeader *)map;
+    HashCacheEntry *entries = (HashCacheEntry *)(header + 1);
+    uint64_t mask = capacity - 1;
+    uint64_t stored = 0;
+    for (size_t l = 0; l < list_count; ++l) {
+        const FileList *fl = lists[l];
+        for (size_t i = 0; i < fl->size; ++i) {
+            const FileEntry *entry = &fl->entries[i];
+            const uint8_t *digest = digests[l] + i * alg->size;
+            if (!cacheable(entry, digest, alg->size, started)) {
+                continue;
+            }
+            // Hard links share an inode, as do the files of a tree listed
+            // twice, so the first one found is kept.
+            uint64_t slot = key_slot(entry->dev, entry->ino, mask);
+            while (digest_key(entries[slot].digest, alg->size) != 0 &&
+                   (entries[slot].dev != entry->dev || entries[slot].ino != entry->ino)) {
+                slot = (slot + 1) & mask;
+            }
+            if (digest_key(entries[slot].digest, alg->size) != 0) {
+                continue;
+            }
+            entries[slot].dev = entry->dev;
+            entries[slot].ino = entry->ino;
+            entries[slot].size = entry->size;
+            entries[slot].mtime = entry->mtime;
+            entries[slot].ctime = entry->ctime;
+            memcpy(entries[slot].digest, digest, alg->size);
+            stored++;
+        }
+    }
+    memcpy(header->magic, HASH_CACHE_MAGIC, sizeof(header->magic));
+    header->version = HASH_CACHE_VERSION;
+    header->seed = HASH_SEED;
+    header->digest_id = alg->id;
+    header->digest_size = (uint32_t)alg->size;
+    header->split_threshold = split_threshold;
+    header->capacity = capacity;
+    header->count = stored;
+
+    int failed = msync(map, map_size, MS_SYNC) < 0;
+    munmap(map, map_size);
+    failed |= close(fd) < 0;
+    if (failed || rename(tmp_path, path) < 0) {
+        fprintf(stderr, "Failed to write hash cache %s: %s\n", path, strerror(errno));
+        unlink(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+    free(tmp_path);
+    return 0;
+}
@@ -0,0 +1,54 @@
+#ifndef HASH_CACHE_H
+#define HASH_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "file_list.h"
+#include "digest.h"
+
+#define HASH_CACHE_MAGIC "DHCACHE1"
+#define HASH_CACHE_VERSION 3
+
+// On-disk layout: a header followed by an open-addressed table of entries,
+// probed linearly from the slot picked by the (dev, ino) key. A slot whose
+// digest has a zero key is empty; failed files have that digest and are
+// never stored. Digests depend on the algorithm, the seed and the size
+// above which files are tree hashed, so a cache written with other
+// settings is ignored.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t seed;
+    uint32_t digest_id;
+    uint32_t digest_size;
+    uint64_t split_threshold;
+    uint64_t capacity;
+    uint64_t count;
+} HashCacheHeader;
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    uint64_t mtime;
+    uint64_t ctime;
+    uint8_t digest[DIGEST_MAX_SIZE];
+} HashCacheEntry;
+
+// A read-only mapping of the cache left by the previous run. An empty cache
+// has no mapping and every lookup misses.
+typedef struct {
+    void *map;
+    size_t map_size;
+    const HashCacheEntry *entries;
+    uint64_t mask;
+    size_t digest_size;
+} HashCache;
+
+void hash_cache_open(HashCache *cache, const char *path, const DigestAlgorithm *alg, uint64_t split_threshold);
+void hash_cache_close(HashCache *cache);
+int hash_cache_lookup(const HashCache *cache, const FileEntry *entry, uint8_t *digest);
+int hash_cache_save(const char *path, const DigestAlgorithm *alg, uint64_t split_threshold,
+                    const FileList *const *lists, const uint8_t *const *digests, size_t list_count, uint64_t started);
+
+#endif
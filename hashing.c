@@ -1,8 +1,8 @@
 #define _GNU_SOURCE
 
 #include "hashing.h"
-#include "constants.h" 
-#include "xxhash.h"
+#include "constants.h"
+#include "stats.h"
 #include <linux/io_uring.h>
 #include <liburing.h>
 #include <stdlib.h>
@@ -11,89 +11,884 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <omp.h>
 
-uint64_t hash_file_contents_aio(const char *filepath) {
-    struct io_uring ring;
-    struct io_uring_sqe *sqe;
-    struct io_uring_cqe *cqe;
-    struct iovec iov;
-    struct stat st;
-    uint64_t hash = 0;
-    int fd;
-
-    if (io_uring_queue_init(QUEUE_DEPTH, &ring, 0) < 0) {
-        perror("Failed to initialize io_uring");
-        return 0;
+// Read buffers are shared out of one process-wide budget so that the number
+// of workers does not multiply the memory held by in-flight reads. Each
+// engine reserves its share of the budget up front, and always gets at
+// least one buffer so that it can make progress.
+static size_t stream_memory_limit = STREAM_MEMORY_LIMIT;
+static size_t stream_memory_used = 0;
+static __thread sigjmp_buf map_jump;
+static __thread volatile sig_atomic_t map_guarded = 0;
+static pthread_mutex_t sigbus_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t sigbus_users = 0;
+static struct sigaction previous_sigbus;
+
+void hash_set_memory_limit(size_t bytes) {
+    __atomic_store_n(&stream_memory_limit, bytes, __ATOMIC_RELAXED);
+}
+
+// A file truncated while it is mapped raises SIGBUS on the next access past
+// its new end. Inside hash_mapped() the handler jumps back out of the
+// digest update; anywhere else the signal goes to the action the handler
+// replaced, the default one included.
+static void map_sigbus(int sig, siginfo_t *info, void *context) {
+    if (map_guarded) {
+        map_guarded = 0;
+        siglongjmp(map_jump, 1);
+    }
+    if (previous_sigbus.sa_flags & SA_SIGINFO) {
+        previous_sigbus.sa_sigaction(sig, info, context);
+    } else if (previous_sigbus.sa_handler == SIG_DFL) {
+        signal(sig, SIG_DFL);
+        raise(sig);
+    } else if (previous_sigbus.sa_handler != SIG_IGN) {
+        previous_sigbus.sa_handler(sig);
+    }
+}
+
+// Installs the SIGBUS handler that mapped hashing needs, saving the action
+// it replaces. Calls nest: the last hash_mmap_release() puts that action
+// back.
+void hash_mmap_acquire(void) {
+    pthread_mutex_lock(&sigbus_lock);
+    if (sigbus_users++ == 0) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = map_sigbus;
+        sa.sa_flags = SA_SIGINFO;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGBUS, &sa, &previous_sigbus);
+    }
+    pthread_mutex_unlock(&sigbus_lock);
+}
+
+void hash_mmap_release(void) {
+    pthread_mutex_lock(&sigbus_lock);
+    if (--sigbus_users == 0) {
+        sigaction(SIGBUS, &previous_sigbus, NULL);
+    }
+    pthread_mutex_unlock(&sigbus_lock);
+}
+
+static size_t reserve_buffers(size_t workers) {
+    size_t limit = __atomic_load_n(&stream_memory_limit, __ATOMIC_RELAXED);
+    size_t share = limit / (workers ? workers : 1) / FILE_BUFFER_SIZE;
+    size_t used = __atomic_load_n(&stream_memory_used, __ATOMIC_RELAXED);
+    size_t count;
+    do {
+        size_t available = used < limit ? (limit - used) / FILE_BUFFER_SIZE : 0;
+        count = share < available ? share : available;
+        if (count > QUEUE_DEPTH) {
+            count = QUEUE_DEPTH;
+        }
+        if (count == 0) {
+            count = 1;
+        }
+    } while (!__atomic_compare_exchange_n(&stream_memory_used, &used, used + count * FILE_BUFFER_SIZE,
+                                          1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return count;
+}
+
+static char *map_pool(int huge_pages, size_t *size) {
+    char *pool = MAP_FAILED;
+    if (huge_pages) {
+        size_t huge_size = (*size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        pool = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+        if (pool != MAP_FAILED) {
+            *size = huge_size;
+            return pool;
+        }
+    }
+
+    pool = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pool == MAP_FAILED) {
+        perror("Failed to allocate read buffer pool");
+        exit(EXIT_FAILURE);
+    }
+    if (huge_pages) {
+        madvise(pool, *size, MADV_HUGEPAGE);
+    }
+    return pool;
+}
+
+// Completions carry either a HashChunk (a read) or a HashSlot tagged in the
+// low bits with the request it belongs to.
+#define TAG_MASK ((uintptr_t)7)
+#define OPEN_TAG ((uintptr_t)1)
+#define LINK_OPEN_TAG ((uintptr_t)2)
+#define LINK_READ_TAG ((uintptr_t)3)
+#define LINK_CLOSE_TAG ((uintptr_t)4)
+#define LINK_ADVISE_TAG ((uintptr_t)5)
+
+// Each slot can have up to three requests queued between two submissions,
+// and a linked small-file chain needs up to four SQEs.
+#define RING_ENTRIES (QUEUE_DEPTH * 4)
+
+static int get_buffer(HashEngine *engine) {
+    if (engine->free_buffer_count == 0) {
+        return -1;
+    }
+    return engine->free_buffers[--engine->free_buffer_count];
+}
+
+static void put_buffer(HashEngine *engine, int buf_index) {
+    engine->free_buffers[engine->free_buffer_count++] = buf_index;
+}
+
+// Forgets the cache and the split digests of the run that just ended, which
+// belong to the caller and may be freed once this returns.
+void hash_end_run(HashSettings *settings) {
+    settings->cache = NULL;
+    settings->split_digests = NULL;
+}
+
+static uint8_t *digest_at(const HashEngine *engine, uint8_t *digests, size_t index) {
+    return digests + index * engine->settings->digest->size;
+}
+
+int hash_engine_init(HashEngine *engine, const HashSettings *settings, size_t workers) {
+    engine->settings = settings;
+    int ret = io_uring_queue_init(RING_ENTRIES, &engine->ring, 0);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to initialize io_uring: %s\n", strerror(-ret));
+        return -1;
+    }
+
+    // Split this worker's share of the descriptor limit between open files
+    // and cached directories.
+    struct rlimit rl;
+    size_t fd_limit = getrlimit(RLIMIT_NOFILE, &rl) == 0 ? (size_t)rl.rlim_cur : 1024;
+    size_t share = fd_limit > FD_RESERVE ? (fd_limit - FD_RESERVE) / (workers ? workers : 1) : 2;
+    size_t dir_capacity = share / 4 < DIRFD_CACHE_SIZE ? share / 4 : DIRFD_CACHE_SIZE;
+    if (dir_capacity == 0) {
+        dir_capacity = 1;
+    }
+    size_t max_files = share > dir_capacity + 1 ? share - dir_capacity : 1;
+    if (max_files > QUEUE_DEPTH) {
+        max_files = QUEUE_DEPTH;
     }
+    dirfd_cache_init(&engine->dirs, NULL, dir_capacity);
 
-    fd = open(filepath, O_RDONLY | O_NOATIME);
-    if (fd < 0) {
-        perror("Failed to open file");
-        io_uring_queue_exit(&ring);
+    engine->free_count = 0;
+    for (size_t i = 0; i < QUEUE_DEPTH; ++i) {
+        for (size_t j = 0; j < STREAM_BUFFERS_PER_FILE; ++j) {
+            engine->slots[i].chunks[j].slot = &engine->slots[i];
+        }
+        if (i < max_files) {
+            engine->free_slots[engine->free_count++] = &engine->slots[i];
+        }
+    }
+
+    engine->buffer_count = reserve_buffers(workers);
+    engine->pool_size = engine->buffer_count * FILE_BUFFER_SIZE;
+    engine->pool = map_pool(settings->huge_pages, &engine->pool_size);
+
+    struct iovec iovecs[QUEUE_DEPTH];
+    for (size_t i = 0; i < engine->buffer_count; ++i) {
+        iovecs[i].iov_base = engine->pool + i * FILE_BUFFER_SIZE;
+        iovecs[i].iov_len = FILE_BUFFER_SIZE;
+        engine->free_buffers[i] = (int)(engine->buffer_count - 1 - i);
+    }
+    engine->free_buffer_count = engine->buffer_count;
+
+    // Registration pins the pool once instead of on every read. It can fail
+    // under a low RLIMIT_MEMLOCK, in which case plain reads are used.
+    engine->fixed_buffers = io_uring_register_buffers(&engine->ring, iovecs, engine->buffer_count) == 0;
+
+    int fds[QUEUE_DEPTH];
+    for (size_t i = 0; i < QUEUE_DEPTH; ++i) {
+        fds[i] = -1;
+    }
+    engine->fixed_files = io_uring_register_files(&engine->ring, fds, QUEUE_DEPTH) == 0;
+    engine->linked_opens = engine->fixed_files;
+    engine->dirfd = -1;
+    return 0;
+}
+
+// Closes the directories cached for the last file list, which may then be
+// freed; a new list at the same address would otherwise find them.
+void hash_engine_release(HashEngine *engine) {
+    dirfd_cache_bind(&engine->dirs, NULL);
+}
+
+void hash_engine_destroy(HashEngine *engine) {
+    dirfd_cache_destroy(&engine->dirs);
+    io_uring_queue_exit(&engine->ring);
+    munmap(engine->pool, engine->pool_size);
+    __atomic_fetch_sub(&stream_memory_used, engine->buffer_count * FILE_BUFFER_SIZE, __ATOMIC_RELAXED);
+}
+
+static void prep_chunk_read(HashEngine *engine, HashChunk *chunk) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&engine->ring);
+    HashSlot *slot = chunk->slot;
+    char *dest = chunk->buf + chunk->filled;
+    unsigned len = chunk->len - chunk->filled;
+    uint64_t offset = chunk->offset + chunk->filled;
+
+    // Direct reads must cover whole blocks; one that runs past the end of
+    // the file stops there.
+    chunk->direct = slot->direct;
+    if (slot->direct) {
+        len = (len + DIRECT_IO_ALIGNMENT - 1) & ~(DIRECT_IO_ALIGNMENT - 1);
+    }
+
+    if (engine->fixed_buffers) {
+        io_uring_prep_read_fixed(sqe, slot->fd, dest, len, offset, chunk->buf_index);
+    } else {
+        io_uring_prep_read(sqe, slot->fd, dest, len, offset);
+    }
+    if (slot->fixed) {
+        io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+    }
+    io_uring_sqe_set_data(sqe, chunk);
+    chunk->submitted = stats_now();
+}
+
+// Switches a file opened with O_DIRECT back to buffered reads.
+static void end_direct(HashSlot *slot) {
+    int flags = fcntl(slot->fd, F_GETFL);
+    if (flags >= 0 && fcntl(slot->fd, F_SETFL, flags & ~O_DIRECT) == 0) {
+        slot->direct = 0;
+    }
+}
+
+// Queues reads for the next chunks of the file, up to STREAM_BUFFERS_PER_FILE
+// outstanding. Returns the number of reads queued.
+//
+// A file read directly has the block-aligned part of its last chunk read
+// directly and the unaligned tail read through the page cache. The tail
+// waits for every earlier read to complete, as dropping O_DIRECT applies to
+// all reads of the descriptor issued from then on.
+static size_t issue_reads(HashEngine *engine, HashSlot *slot) {
+    size_t queued = 0;
+    while (!slot->failed && slot->next_offset < slot->size &&
+           slot->next_seq - slot->hashed_seq < STREAM_BUFFERS_PER_FILE) {
+        uint64_t remaining = slot->size - slot->next_offset;
+        size_t len = remaining < FILE_BUFFER_SIZE ? (size_t)remaining : FILE_BUFFER_SIZE;
+        if (slot->direct && len % DIRECT_IO_ALIGNMENT != 0) {
+            if (len > DIRECT_IO_ALIGNMENT) {
+                len -= len % DIRECT_IO_ALIGNMENT;
+            } else if (slot->hashed_seq != slot->next_seq) {
+                break;
+            } else {
+                end_direct(slot);
+            }
+        }
+        int buf_index = slot->reserved_buffer;
+        slot->reserved_buffer = -1;
+        if (buf_index < 0) {
+            buf_index = get_buffer(engine);
+        }
+        if (buf_index < 0) {
+            break;
+        }
+        HashChunk *chunk = &slot->chunks[slot->next_seq % STREAM_BUFFERS_PER_FILE];
+        chunk->buf_index = buf_index;
+        chunk->buf = engine->pool + (size_t)buf_index * FILE_BUFFER_SIZE;
+        chunk->offset = slot->next_offset;
+        chunk->len = len;
+        chunk->filled = 0;
+        chunk->ready = 0;
+        prep_chunk_read(engine, chunk);
+        slot->next_offset += chunk->len;
+        slot->next_seq++;
+        queued++;
+    }
+    return queued;
+}
+
+static void finish_slot(HashEngine *engine, HashSlot *slot, uint8_t *digests) {
+    uint8_t *out = digest_at(engine, digests, slot->index);
+    if (slot->failed) {
+        memset(out, 0, engine->settings->digest->size);
+    } else {
+        engine->settings->digest->final(&slot->state, out);
+    }
+    // Readahead can repopulate ranges already dropped chunk by chunk, so the
+    // whole range is dropped again once the file is done.
+    if (engine->settings->read_mode != HASH_READ_BUFFERED && !slot->direct && slot->fd >= 0 && !slot->fixed) {
+        posix_fadvise(slot->fd, (off_t)slot->begin, (off_t)(slot->size - slot->begin), POSIX_FADV_DONTNEED);
+    }
+    if (slot->fixed) {
+        // The table would otherwise keep the file open after the call.
+        int none = -1;
+        io_uring_register_files_update(&engine->ring, (unsigned)slot->fd, &none, 1);
+        slot->fixed = 0;
+    } else if (slot->fd >= 0) {
+        close(slot->fd);
+    }
+    engine->free_slots[engine->free_count++] = slot;
+}
+
+// Feeds completed chunks to the hash state in file order and returns their
+// buffers to the pool. Returns 1 once the whole file has been consumed.
+static int advance_slot(HashEngine *engine, HashSlot *slot) {
+    while (slot->hashed_seq < slot->next_seq) {
+        HashChunk *chunk = &slot->chunks[slot->hashed_seq % STREAM_BUFFERS_PER_FILE];
+        if (!chunk->ready) {
+            break;
+        }
+        if (!slot->failed) {
+            uint64_t started = stats_now();
+            engine->settings->digest->update(&slot->state, chunk->buf, chunk->filled);
+            stats_record(STAT_HASH_LATENCY, started);
+            stats_add(STAT_BYTES_HASHED, chunk->filled);
+        }
+        if (engine->settings->read_mode != HASH_READ_BUFFERED && !chunk->direct && chunk->filled > 0) {
+            posix_fadvise(slot->fd, (off_t)chunk->offset, (off_t)chunk->filled, POSIX_FADV_DONTNEED);
+        }
+        put_buffer(engine, chunk->buf_index);
+        slot->hashed_seq++;
+    }
+    return slot->hashed_seq == slot->next_seq && (slot->failed || slot->next_offset >= slot->size);
+}
+
+static void report_file_error(const FileList *fl, size_t entry_index, const char *what, int err) {
+    size_t len = file_list_path(fl, entry_index, NULL, 0);
+    char *path = (char *)malloc(len + 1);
+    if (path) {
+        file_list_path(fl, entry_index, path, len + 1);
+    }
+    fprintf(stderr, "%s %s: %s\n", what, path ? path : fl->names + fl->entries[entry_index].name, strerror(err));
+    free(path);
+}
+
+// Hashes bytes [next_offset, size) of the file open as fd in place from a
+// mapping, if a sample of MMAP_SAMPLE_PAGES of its pages shows at least
+// MMAP_RESIDENT_PERCENT of it in the page cache. Returns 1 if it did.
+// Returns 0 if the range is too cold, or if the file turned out shorter
+// than recorded, which leaves the slot's state reset for the ring to read
+// the file as usual.
+static int hash_mapped(HashEngine *engine, HashSlot *slot, int fd) {
+    const DigestAlgorithm *alg = engine->settings->digest;
+    static size_t page_size = 0;
+    if (!page_size) {
+        page_size = (size_t)sysconf(_SC_PAGESIZE);
+    }
+    uint64_t map_offset = slot->next_offset & ~(uint64_t)(page_size - 1);
+    size_t len = (size_t)(slot->size - map_offset);
+    uint8_t *map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, (off_t)map_offset);
+    if (map == MAP_FAILED) {
         return 0;
     }
 
-    if (fstat(fd, &st) < 0) {
-        perror("Failed to stat file");
-        close(fd);
-        io_uring_queue_exit(&ring);
+    size_t pages = (len + page_size - 1) / page_size;
+    size_t samples = pages < MMAP_SAMPLE_PAGES ? pages : MMAP_SAMPLE_PAGES;
+    size_t resident = 0;
+    for (size_t i = 0; i < samples; ++i) {
+        unsigned char vec;
+        size_t page = (2 * i + 1) * pages / (2 * samples);
+        if (mincore(map + page * page_size, page_size, &vec) == 0 && (vec & 1)) {
+            resident++;
+        }
+    }
+
+    volatile int hashed = 0;
+    if (resident * 100 >= samples * MMAP_RESIDENT_PERCENT) {
+        madvise(map, len, MADV_SEQUENTIAL);
+        madvise(map, len, MADV_HUGEPAGE);
+        if (sigsetjmp(map_jump, 1) == 0) {
+            map_guarded = 1;
+            uint64_t started = stats_now();
+            alg->update(&slot->state, map + (slot->next_offset - map_offset), slot->size - slot->next_offset);
+            map_guarded = 0;
+            stats_record(STAT_HASH_LATENCY, started);
+            stats_add(STAT_BYTES_HASHED, slot->size - slot->next_offset);
+            hashed = 1;
+        } else {
+            stats_add(STAT_MAP_TRUNCATIONS, 1);
+            alg->init(&slot->state);
+        }
+    }
+    munmap(map, len);
+    return hashed;
+}
+
+static void submit_open(HashEngine *engine, HashSlot *slot) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&engine->ring);
+    int flags = O_RDONLY | (slot->noatime ? O_NOATIME : 0) | (slot->direct ? O_DIRECT : 0);
+    io_uring_prep_openat(sqe, slot->dirfd, slot->name, flags, 0);
+    io_uring_sqe_set_data(sqe, (void *)((uintptr_t)slot | OPEN_TAG));
+    slot->open_started = stats_now();
+}
+
+// Queues a linked chain that opens a small file straight into the slot's
+// fixed-file entry, reads all of it into the slot's reserved buffer and
+// closes it again, so the file costs no round trip of its own. Outside the
+// buffered mode the read is followed by a POSIX_FADV_DONTNEED of the file,
+// hard-linked so that the close runs whatever it returns. A failed link
+// cancels the rest of the chain; all completions are collected by
+// complete_linked(). Returns the number of requests queued.
+static size_t submit_linked(HashEngine *engine, HashSlot *slot) {
+    unsigned file_index = (unsigned)(slot - engine->slots);
+    HashChunk *chunk = &slot->chunks[0];
+    chunk->buf_index = slot->reserved_buffer;
+    chunk->buf = engine->pool + (size_t)chunk->buf_index * FILE_BUFFER_SIZE;
+    chunk->offset = 0;
+    chunk->len = slot->size;
+    chunk->filled = 0;
+    chunk->ready = 0;
+    slot->linked = 1;
+    slot->link_pending = engine->settings->read_mode == HASH_READ_BUFFERED ? 3 : 4;
+
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&engine->ring);
+    io_uring_prep_openat_direct(sqe, slot->dirfd, slot->name, O_RDONLY | (slot->noatime ? O_NOATIME : 0), 0,
+                                file_index);
+    io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+    io_uring_sqe_set_data(sqe, (void *)((uintptr_t)slot | LINK_OPEN_TAG));
+
+    sqe = io_uring_get_sqe(&engine->ring);
+    if (engine->fixed_buffers) {
+        io_uring_prep_read_fixed(sqe, file_index, chunk->buf, chunk->len, 0, chunk->buf_index);
+    } else {
+        io_uring_prep_read(sqe, file_index, chunk->buf, chunk->len, 0);
+    }
+    io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE | IOSQE_IO_LINK);
+    io_uring_sqe_set_data(sqe, (void *)((uintptr_t)slot | LINK_READ_TAG));
+
+    if (engine->settings->read_mode != HASH_READ_BUFFERED) {
+        sqe = io_uring_get_sqe(&engine->ring);
+        io_uring_prep_fadvise(sqe, file_index, 0, 0, POSIX_FADV_DONTNEED);
+        io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK);
+        io_uring_sqe_set_data(sqe, (void *)((uintptr_t)slot | LINK_ADVISE_TAG));
+    }
+
+    sqe = io_uring_get_sqe(&engine->ring);
+    io_uring_prep_close_direct(sqe, file_index);
+    io_uring_sqe_set_data(sqe, (void *)((uintptr_t)slot | LINK_CLOSE_TAG));
+    slot->open_started = stats_now();
+    chunk->submitted = slot->open_started;
+    return slot->link_pending;
+}
+
+static size_t complete_open(HashEngine *engine, HashSlot *slot, int res, uint8_t *digests);
+
+// Queues an asynchronous open of the file relative to its parent directory,
+// taken from the engine's directory cache, to hash bytes [offset, end) of
+// it. Whole files that fit in one buffer go through a linked chain
+// instead. A buffer is set aside for the first read so that the open can
+// never leave the slot waiting on the pool. With mmap enabled, large
+// ranges are opened on the spot and hashed in place if they are hot, and
+// otherwise carry on through the ring with that descriptor. Returns the
+// number of requests queued.
+static size_t start_range(HashEngine *engine, const FileList *fl, size_t entry_index, uint64_t offset, uint64_t end,
+                          size_t index, uint8_t *digests) {
+    const FileEntry *entry = &fl->entries[entry_index];
+    int dirfd_owned = 0;
+    int dirfd = engine->dirfd >= 0 ? engine->dirfd : dirfd_cache_get(&engine->dirs, entry->parent, &dirfd_owned);
+    if (dirfd < 0) {
+        report_file_error(fl, entry_index, "Failed to open directory of", errno);
+        memset(digest_at(engine, digests, index), 0, engine->settings->digest->size);
         return 0;
     }
 
-    if (st.st_size == 0) {
-        close(fd);
-        io_uring_queue_exit(&ring);
-        return XXH64("", 0, HASH_SEED);
+    HashSlot *slot = engine->free_slots[--engine->free_count];
+    slot->fl = fl;
+    slot->entry = entry_index;
+    slot->name = fl->names + entry->name;
+    slot->dirfd = dirfd;
+    slot->dirfd_owned = dirfd_owned;
+    slot->noatime = 1;
+    slot->direct = engine->settings->read_mode == HASH_READ_DIRECT;
+    slot->fd = -1;
+    slot->fixed = 0;
+    slot->failed = 0;
+    slot->index = index;
+    slot->size = end;
+    slot->begin = offset;
+    slot->next_offset = offset;
+    slot->next_seq = 0;
+    slot->hashed_seq = 0;
+    slot->reserved_buffer = get_buffer(engine);
+    slot->linked = 0;
+    engine->settings->digest->init(&slot->state);
+    if (engine->settings->mmap && engine->settings->read_mode == HASH_READ_BUFFERED &&
+        end - offset >= MMAP_MIN_SIZE) {
+        slot->open_started = stats_now();
+        int fd = open_at_noatime(dirfd, slot->name, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            if (!hash_mapped(engine, slot, fd)) {
+                return complete_open(engine, slot, fd, digests);
+            }
+            stats_record(STAT_OPEN_LATENCY, slot->open_started);
+            stats_add(STAT_FILES_OPENED, 1);
+            stats_add(STAT_MAPPED_FILES, 1);
+            dirfd_cache_put(&engine->dirs, dirfd, dirfd_owned);
+            put_buffer(engine, slot->reserved_buffer);
+            slot->fd = fd;
+            finish_slot(engine, slot, digests);
+            return 0;
+        }
+    }
+    if (engine->linked_opens && offset == 0 && end <= FILE_BUFFER_SIZE) {
+        return submit_linked(engine, slot);
     }
+    submit_open(engine, slot);
+    return 1;
+}
 
-    iov.iov_base = malloc(st.st_size);
-    if (!iov.iov_base) {
-        perror("Failed to allocate buffer");
-        close(fd);
-        io_uring_queue_exit(&ring);
+// Starts hashing a whole file. The size recorded during traversal is
+// trusted, so empty files are resolved without any I/O, as are files found
+// in the hash cache and files already hashed as a tree.
+static size_t start_file(HashEngine *engine, const FileList *fl, size_t entry_index, size_t index,
+                         uint8_t *digests) {
+    const FileEntry *entry = &fl->entries[entry_index];
+    const HashSettings *settings = engine->settings;
+    const DigestAlgorithm *alg = settings->digest;
+    uint8_t *out = digest_at(engine, digests, index);
+    if (entry->size == 0) {
+        digest_buffer(alg, "", 0, out);
+        return 0;
+    }
+    if (settings->split_digests && entry->size >= settings->split_threshold) {
+        memcpy(out, settings->split_digests + entry_index * alg->size, alg->size);
         return 0;
     }
-    iov.iov_len = st.st_size;
+    if (settings->cache && hash_cache_lookup(settings->cache, entry, out)) {
+        stats_add(STAT_CACHE_HITS, 1);
+        return 0;
+    }
+    return start_range(engine, fl, entry_index, 0, entry->size, index, digests);
+}
+
+// Handles the completion of an open and queues the file's first reads.
+// Returns the number of reads queued.
+static size_t complete_open(HashEngine *engine, HashSlot *slot, int res, uint8_t *digests) {
+    // O_NOATIME is refused on files owned by someone else.
+    if (res == -EPERM && slot->noatime) {
+        slot->noatime = 0;
+        submit_open(engine, slot);
+        return 1;
+    }
+    // The filesystem refuses O_DIRECT, so the file is read through the
+    // page cache and dropped from it instead.
+    if (res == -EINVAL && slot->direct) {
+        stats_add(STAT_DIRECT_FALLBACKS, 1);
+        slot->direct = 0;
+        submit_open(engine, slot);
+        return 1;
+    }
 
-    sqe = io_uring_get_sqe(&ring);
-    if (!sqe) {
-        perror("Failed to get submission queue entry");
-        free(iov.iov_base);
-        close(fd);
-        io_uring_queue_exit(&ring);
+    stats_record(STAT_OPEN_LATENCY, slot->open_started);
+    dirfd_cache_put(&engine->dirs, slot->dirfd, slot->dirfd_owned);
+    if (res < 0) {
+        stats_add(STAT_OPEN_FAILURES, 1);
+        report_file_error(slot->fl, slot->entry, "Failed to open file", -res);
+        put_buffer(engine, slot->reserved_buffer);
+        slot->failed = 1;
+        finish_slot(engine, slot, digests);
         return 0;
     }
+    slot->fd = res;
+    stats_add(STAT_FILES_OPENED, 1);
 
-    io_uring_prep_readv(sqe, fd, &iov, 1, 0);
-    io_uring_sqe_set_data(sqe, iov.iov_base);
+    // Files that take more than one read are moved into the slot's entry of
+    // the fixed-file table, which finish_slot() clears again, so the kernel
+    // does not look the descriptor up again for every chunk.
+    if (engine->fixed_files && engine->settings->read_mode == HASH_READ_BUFFERED &&
+        slot->size - slot->next_offset > FILE_BUFFER_SIZE) {
+        int file_index = (int)(slot - engine->slots);
+        if (io_uring_register_files_update(&engine->ring, file_index, &slot->fd, 1) == 1) {
+            close(slot->fd);
+            slot->fd = file_index;
+            slot->fixed = 1;
+        }
+    }
+    return issue_reads(engine, slot);
+}
 
-    if (io_uring_submit(&ring) < 0) {
-        perror("Failed to submit request");
-        free(iov.iov_base);
-        close(fd);
-        io_uring_queue_exit(&ring);
+// Collects one completion of a linked chain and, once every request of the
+// chain is in, hashes the file. Anything other than a full read, such as a
+// short read or a kernel without direct opens, retries the file on the
+// regular path, which handles those cases. Returns the number of requests
+// queued.
+static size_t complete_linked(HashEngine *engine, HashSlot *slot, uintptr_t tag, int res, uint8_t *digests) {
+    if (tag == LINK_OPEN_TAG) {
+        slot->link_open_res = res;
+        stats_record(STAT_OPEN_LATENCY, slot->open_started);
+    } else if (tag == LINK_READ_TAG) {
+        slot->link_read_res = res;
+        stats_record(STAT_READ_LATENCY, slot->chunks[0].submitted);
+    }
+    if (--slot->link_pending > 0) {
         return 0;
     }
 
-    if (io_uring_wait_cqe(&ring, &cqe) < 0) {
-        perror("Failed to wait for completion");
-        free(iov.iov_base);
-        close(fd);
-        io_uring_queue_exit(&ring);
+    slot->linked = 0;
+    if (slot->link_open_res == -EPERM && slot->noatime) {
+        slot->noatime = 0;
+        return submit_linked(engine, slot);
+    }
+    if (slot->link_open_res == -EINVAL || slot->link_open_res == -EBADF) {
+        engine->linked_opens = 0;
+    }
+    if (slot->link_open_res >= 0 && slot->link_read_res == (int)slot->size) {
+        dirfd_cache_put(&engine->dirs, slot->dirfd, slot->dirfd_owned);
+        stats_add(STAT_FILES_OPENED, 1);
+        stats_add(STAT_LINKED_OPENS, 1);
+        stats_add(STAT_READ_OPS, 1);
+        stats_add(STAT_BYTES_READ, slot->size);
+        uint64_t started = stats_now();
+        engine->settings->digest->update(&slot->state, slot->chunks[0].buf, slot->size);
+        stats_record(STAT_HASH_LATENCY, started);
+        stats_add(STAT_BYTES_HASHED, slot->size);
+        put_buffer(engine, slot->reserved_buffer);
+        finish_slot(engine, slot, digests);
         return 0;
     }
+    if (slot->link_open_res >= 0 && slot->link_read_res < 0 && slot->link_read_res != -ECANCELED &&
+        slot->link_read_res != -EINTR && slot->link_read_res != -EAGAIN) {
+        dirfd_cache_put(&engine->dirs, slot->dirfd, slot->dirfd_owned);
+        stats_add(STAT_READ_FAILURES, 1);
+        fprintf(stderr, "Async read failed: %s\n", strerror(-slot->link_read_res));
+        put_buffer(engine, slot->reserved_buffer);
+        slot->failed = 1;
+        finish_slot(engine, slot, digests);
+        return 0;
+    }
+    submit_open(engine, slot);
+    return 1;
+}
 
-    if (cqe->res < 0) {
-        fprintf(stderr, "Async read failed: %s\n", strerror(-cqe->res));
+// Handles one read completion. Short reads are resubmitted for the rest of
+// the chunk; a read at end of file means the file shrank since it was
+// stat'ed, so the file is hashed up to that point. A direct read the
+// filesystem rejects is retried through the page cache. Returns the number
+// of reads queued as a result.
+static size_t complete_chunk(HashEngine *engine, HashChunk *chunk, int res, uint8_t *digests) {
+    HashSlot *slot = chunk->slot;
+
+    stats_record(STAT_READ_LATENCY, chunk->submitted);
+    if (res == -EINTR || res == -EAGAIN) {
+        prep_chunk_read(engine, chunk);
+        return 1;
+    }
+    if (res == -EINVAL && chunk->direct) {
+        if (slot->direct) {
+            stats_add(STAT_DIRECT_FALLBACKS, 1);
+            end_direct(slot);
+        }
+        if (!slot->direct) {
+            prep_chunk_read(engine, chunk);
+            return 1;
+        }
+    }
+    stats_add(STAT_READ_OPS, 1);
+    if (res < 0) {
+        stats_add(STAT_READ_FAILURES, 1);
+        fprintf(stderr, "Async read failed: %s\n", strerror(-res));
+        slot->failed = 1;
+        chunk->ready = 1;
+    } else if (res == 0) {
+        if (chunk->offset + chunk->filled < slot->size) {
+            stats_add(STAT_SHORT_READS, 1);
+            slot->size = chunk->offset + chunk->filled;
+        }
+        chunk->ready = 1;
     } else {
-        hash = XXH64(iov.iov_base, st.st_size, HASH_SEED);
+        stats_add(STAT_BYTES_READ, res);
+        chunk->filled += res;
+        if (chunk->filled > chunk->len) {
+            chunk->filled = chunk->len;
+        }
+        if (chunk->filled < chunk->len) {
+            stats_add(STAT_SHORT_READS, 1);
+            // A direct read ending off a block boundary has reached the end
+            // of the file.
+            if (!chunk->direct || res % DIRECT_IO_ALIGNMENT == 0) {
+                prep_chunk_read(engine, chunk);
+                return 1;
+            }
+            slot->size = chunk->offset + chunk->filled;
+        }
+        chunk->ready = 1;
+    }
+
+    if (advance_slot(engine, slot)) {
+        finish_slot(engine, slot, digests);
+        return 0;
     }
+    return issue_reads(engine, slot);
+}
+
+// Runs count jobs through the engine, job i being order[begin + i] (or
+// begin + i) of fl, or ranges[i] if ranges is given, and stores the digest
+// of job i at digests + i * digest size.
+static void run_jobs(HashEngine *engine, const FileList *fl, const size_t *order, const HashRange *ranges,
+                     size_t begin, size_t count, uint8_t *digests) {
+    dirfd_cache_bind(&engine->dirs, fl);
+    size_t next = 0;
+    size_t in_flight = 0;
+
+    while (next < count || in_flight > 0) {
+        // A new file is only started while a read buffer can be had, so a
+        // starved engine drains its current files before opening more.
+        while (next < count && engine->free_count > 0 && engine->free_buffer_count > 0) {
+            if (ranges) {
+                const HashRange *range = &ranges[begin + next];
+                in_flight += start_range(engine, fl, range->entry, range->offset, range->end, next, digests);
+            } else {
+                size_t entry_index = order ? order[begin + next] : begin + next;
+                in_flight += start_file(engine, fl, entry_index, next, digests);
+            }
+            next++;
+        }
+        if (in_flight == 0) {
+            continue;
+        }
 
-    io_uring_cqe_seen(&ring, cqe);
-    free(iov.iov_base);
-    close(fd);
-    io_uring_queue_exit(&ring);
+        uint64_t wait_started = stats_now();
+        int ret = io_uring_submit_and_wait(&engine->ring, 1);
+        if (ret < 0 && ret != -EINTR) {
+            fprintf(stderr, "Failed to submit requests: %s\n", strerror(-ret));
+            exit(EXIT_FAILURE);
+        }
+        stats_add(STAT_IO_WAIT_NS, stats_now() - wait_started);
 
-    return hash;
+        struct io_uring_cqe *cqe;
+        unsigned head;
+        unsigned reaped = 0;
+        size_t queued = 0;
+        io_uring_for_each_cqe(&engine->ring, head, cqe) {
+            uintptr_t data = (uintptr_t)io_uring_cqe_get_data(cqe);
+            uintptr_t tag = data & TAG_MASK;
+            if (tag == OPEN_TAG) {
+                queued += complete_open(engine, (HashSlot *)(data & ~TAG_MASK), cqe->res, digests);
+            } else if (tag != 0) {
+                queued += complete_linked(engine, (HashSlot *)(data & ~TAG_MASK), tag, cqe->res, digests);
+            } else {
+                queued += complete_chunk(engine, (HashChunk *)data, cqe->res, digests);
+            }
+            reaped++;
+        }
+        io_uring_cq_advance(&engine->ring, reaped);
+        in_flight = in_flight - reaped + queued;
+    }
+}
+
+// Hashes count files starting at entry begin of fl into digests, one
+// digest-sized record per file, opening them through the engine's
+// ring and streaming each one through FILE_BUFFER_SIZE chunks, with up to
+// QUEUE_DEPTH requests in flight. Failed files get an all-zero digest. If
+// order is given, the files are order[begin..begin + count) instead.
+void hash_engine_hash_files(HashEngine *engine, const FileList *fl, const size_t *order, size_t begin, size_t count,
+                            uint8_t *digests) {
+    run_jobs(engine, fl, order, NULL, begin, count, digests);
 }
 
+// Hashes files [begin, begin + count) of fl, all of which live in the
+// directory open as dirfd, into digests. The descriptor is used as is
+// instead of going through the directory cache; with a dirfd of -1 the
+// files are opened through the cache as usual.
+void hash_engine_hash_dir(HashEngine *engine, const FileList *fl, int dirfd, size_t begin, size_t count,
+                          uint8_t *digests) {
+    engine->dirfd = dirfd;
+    run_jobs(engine, fl, NULL, NULL, begin, count, digests);
+    engine->dirfd = -1;
+    if (dirfd < 0) {
+        hash_engine_release(engine);
+    }
+}
+
+// Hashes ranges[begin..begin + count) into digests.
+void hash_engine_hash_ranges(HashEngine *engine, const FileList *fl, const HashRange *ranges, size_t begin,
+                             size_t count, uint8_t *digests) {
+    run_jobs(engine, fl, NULL, ranges, begin, count, digests);
+}
+
+// Hashes every file of at least the split threshold as a tree, so that all
+// workers share the reading of a few huge files. Each file is cut into
+// TREE_CHUNK_SIZE leaves hashed independently; its digest is the digest of
+// the leaf digests followed by the little-endian file size. The digests are
+// stored in digests by file index, and later passes over those files take
+// them from there instead of reading the files again. Worker n hashes with
+// engines[n].
+void hash_split_files(HashSettings *settings, const FileList *fl, size_t num_threads, HashEngine *engines,
+                      uint8_t *digests) {
+    uint64_t split_threshold = settings->split_threshold;
+    if (split_threshold == 0) {
+        return;
+    }
+
+    const HashCache *cache = settings->cache;
+    const DigestAlgorithm *alg = settings->digest;
+    size_t range_count = 0;
+    for (size_t i = 0; i < fl->size; ++i) {
+        const FileEntry *entry = &fl->entries[i];
+        if (entry->size >= split_threshold &&
+            !(cache && hash_cache_lookup(cache, entry, digests + i * alg->size))) {
+            range_count += (entry->size + TREE_CHUNK_SIZE - 1) / TREE_CHUNK_SIZE;
+        }
+    }
+
+    HashRange *ranges = (HashRange *)malloc((range_count ? range_count : 1) * sizeof(HashRange));
+    uint8_t *leaves = (uint8_t *)malloc((range_count ? range_count : 1) * alg->size);
+    if (!ranges || !leaves) {
+        perror("Failed to allocate file chunks");
+        exit(EXIT_FAILURE);
+    }
+    size_t r = 0;
+    for (size_t i = 0; i < fl->size; ++i) {
+        const FileEntry *entry = &fl->entries[i];
+        if (entry->size < split_threshold ||
+            (cache && hash_cache_lookup(cache, entry, digests + i * alg->size))) {
+            continue;
+        }
+        for (uint64_t offset = 0; offset < entry->size; offset += TREE_CHUNK_SIZE) {
+            ranges[r].entry = i;
+            ranges[r].offset = offset;
+            ranges[r].end = entry->size - offset < TREE_CHUNK_SIZE ? entry->size : offset + TREE_CHUNK_SIZE;
+            r++;
+        }
+    }
+
+    // Small batches keep every worker busy even when only one file is split.
+    size_t batch_size = range_count / (num_threads * 4);
+    batch_size = batch_size < 1 ? 1 : batch_size > QUEUE_DEPTH ? QUEUE_DEPTH : batch_size;
+    size_t num_batches = (range_count + batch_size - 1) / batch_size;
+
+    #pragma omp parallel for num_threads(num_threads) schedule(dynamic)
+    for (size_t batch = 0; batch < num_batches; ++batch) {
+        size_t begin = batch * batch_size;
+        size_t count = range_count - begin < batch_size ? range_count - begin : batch_size;
+        hash_engine_hash_ranges(&engines[omp_get_thread_num()], fl, ranges, begin, count,
+                                leaves + begin * alg->size);
+    }
+
+    for (size_t first = 0; first < range_count;) {
+        size_t entry = ranges[first].entry;
+        size_t last = first;
+        int failed = 0;
+        DigestState state;
+        alg->init(&state);
+        for (; last < range_count && ranges[last].entry == entry; ++last) {
+            const uint8_t *leaf = leaves + last * alg->size;
+            failed |= digest_key(leaf, alg->size) == 0;
+            alg->update(&state, leaf, alg->size);
+        }
+        uint64_t size = fl->entries[entry].size;
+        uint8_t le[8];
+        for (int b = 0; b < 8; ++b) {
+            le[b] = (uint8_t)(size >> (8 * b));
+        }
+        alg->update(&state, le, sizeof(le));
+        alg->final(&state, digests + entry * alg->size);
+        if (failed) {
+            memset(digests + entry * alg->size, 0, alg->size);
+        }
+        first = last;
+    }
+
+    free(ranges);
+    free(leaves);
+    settings->split_digests = digests;
+}
@@ -2,10 +2,133 @@
 #define HASHING_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <liburing.h>
+#include "constants.h"
+#include "digest.h"
+#include "file_list.h"
+#include "dirfd_cache.h"
+#include "hash_cache.h"
 
 #define QUEUE_DEPTH 64
 
-uint64_t hash_file_contents_aio(const char *filepath);
+// How file contents are read. Direct reads bypass the page cache, and
+// dontneed reads drop what they pulled into it once it is hashed. Outside
+// the buffered mode files are never moved into the fixed-file table, since
+// their descriptors are needed for fcntl() and fadvise. The pool is page
+// aligned, as are its FILE_BUFFER_SIZE buffers, so any of them can take a
+// direct read.
+typedef enum {
+    HASH_READ_BUFFERED,
+    HASH_READ_DIRECT,
+    HASH_READ_DONTNEED
+} HashReadMode;
 
-#endif
+// What engines hash with. The engines of a context all point at its
+// settings, which stay with the caller and may change between runs but not
+// during one. Files of at least split_threshold bytes are hashed as a tree
+// by hash_split_files(), which records their digests in split_digests; 0
+// turns tree hashing off. Files whose metadata matches an entry in cache
+// take its digest and are never opened. With mmap set, files of at least
+// MMAP_MIN_SIZE that are already in the page cache are hashed in place
+// from a mapping, for which hash_mmap_acquire() must have been called.
+typedef struct {
+    const DigestAlgorithm *digest;
+    HashReadMode read_mode;
+    int mmap;
+    int huge_pages;
+    uint64_t split_threshold;
+    const HashCache *cache;
+    const uint8_t *split_digests;
+} HashSettings;
+
+typedef struct HashSlot HashSlot;
+
+typedef struct {
+    HashSlot *slot;
+    char *buf;
+    int buf_index;
+    uint64_t offset;
+    size_t len;
+    size_t filled;
+    int ready;
+    int direct;
+    uint64_t submitted;
+} HashChunk;
+
+// One file being streamed through the engine. Chunk n of the file lives in
+// chunks[n % STREAM_BUFFERS_PER_FILE] and is fed to the hash state in order.
+struct HashSlot {
+    const FileList *fl;
+    size_t entry;
+    const char *name;
+    int dirfd;
+    int dirfd_owned;
+    int noatime;
+    int direct;
+    int linked;
+    int link_pending;
+    int link_open_res;
+    int link_read_res;
+    int fd;
+    int fixed;
+    int failed;
+    size_t index;
+    uint64_t size;
+    uint64_t begin;
+    uint64_t next_offset;
+    uint64_t next_seq;
+    uint64_t hashed_seq;
+    int reserved_buffer;
+    uint64_t open_started;
+    DigestState state;
+    HashChunk chunks[STREAM_BUFFERS_PER_FILE];
+};
 
+// Each engine owns a ring, a pool of read buffers registered with the ring,
+// a table of fixed-file slots, one per HashSlot, and a cache of directory
+// descriptors that files are opened relative to. Only as many slots are
+// used as fit in the worker's share of the descriptor limit. The engine
+// hashes with the settings it was created with.
+typedef struct {
+    const HashSettings *settings;
+    struct io_uring ring;
+    DirFdCache dirs;
+    HashSlot slots[QUEUE_DEPTH];
+    HashSlot *free_slots[QUEUE_DEPTH];
+    size_t free_count;
+    char *pool;
+    size_t pool_size;
+    size_t buffer_count;
+    int free_buffers[QUEUE_DEPTH];
+    size_t free_buffer_count;
+    int fixed_buffers;
+    int fixed_files;
+    int linked_opens;
+    int dirfd;
+} HashEngine;
+
+// Bytes [offset, end) of file entry of a FileList.
+typedef struct {
+    size_t entry;
+    uint64_t offset;
+    uint64_t end;
+} HashRange;
+
+void hash_set_memory_limit(size_t bytes);
+void hash_mmap_acquire(void);
+void hash_mmap_release(void);
+void hash_end_run(HashSettings *settings);
+int hash_engine_init(HashEngine *engine, const HashSettings *settings, size_t workers);
+void hash_engine_release(HashEngine *engine);
+void hash_engine_destroy(HashEngine *engine);
+void hash_engine_hash_files(HashEngine *engine, const FileList *fl, const size_t *order, size_t begin, size_t count,
+                            uint8_t *digests);
+void hash_engine_hash_dir(HashEngine *engine, const FileList *fl, int dirfd, size_t begin, size_t count,
+                          uint8_t *digests);
+void hash_engine_hash_ranges(HashEngine *engine, const FileList *fl, const HashRange *ranges, size_t begin,
+                             size_t count, uint8_t *digests);
+void hash_split_files(HashSettings *settings, const FileList *fl, size_t num_threads, HashEngine *engines,
+                      uint8_t *digests);
+
+#endif
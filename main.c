@@ -1,91 +1,241 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <stdint.h>
-#include <unistd.h>
-#include <time.h>
-#include <omp.h>
-#include "bloom_filter.h"
-#include "file_list.h"
-#include "directory_traversal.h"
-#include "progress.h"
-#include "hashing.h"
-#include "constants.h"
+#include <getopt.h>
+#include <sys/resource.h>
+#include "dirhash.h"
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--memory-limit MiB] [--huge-pages] [--cache FILE] [--merkle] [--pipeline]\n"
+                    "       [--physical-order] [--split-threshold MiB] [--find-duplicates]\n"
+                    "       [--digest xxh64|xxh3|xxh128|blake3|sha256|crc32c] [--stats=json]\n"
+                    "       [--stats-file FILE] [--io buffered|direct|dontneed] [--mmap] [--watch SOCKET]\n"
+                    "       [--manifest FILE] [--verify FILE [--fail-fast]] [--diff LEFT] <directory>\n"
+                    "--diff compares LEFT with <directory>; either may be a manifest instead.\n", prog);
+}
 
-int compare_filepaths(const void *a, const void *b) {
-    return strcmp(*(const char **)a, *(const char **)b);
+// Writes the run's statistics to path, or to stderr without one.
+static void write_stats(const char *path, const dirhash_result *result) {
+    FILE *out = path ? fopen(path, "w") : stderr;
+    if (!out) {
+        fprintf(stderr, "Failed to create %s: %s\n", path, strerror(errno));
+        return;
+    }
+    dirhash_write_stats(out, result);
+    if (out != stderr && fclose(out) != 0) {
+        fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+    }
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <directory>\n", argv[0]);
-        return EXIT_FAILURE;
+    static const struct option long_options[] = {
+        {"memory-limit", required_argument, NULL, 'm'},
+        {"huge-pages", no_argument, NULL, 'H'},
+        {"cache", required_argument, NULL, 'c'},
+        {"merkle", no_argument, NULL, 'M'},
+        {"physical-order", no_argument, NULL, 'P'},
+        {"split-threshold", required_argument, NULL, 'S'},
+        {"find-duplicates", no_argument, NULL, 'D'},
+        {"digest", required_argument, NULL, 'a'},
+        {"stats", required_argument, NULL, 's'},
+        {"stats-file", required_argument, NULL, 'o'},
+        {"io", required_argument, NULL, 'i'},
+        {"pipeline", no_argument, NULL, 'p'},
+        {"mmap", no_argument, NULL, 'x'},
+        {"watch", required_argument, NULL, 'w'},
+        {"manifest", required_argument, NULL, 'f'},
+        {"verify", required_argument, NULL, 'V'},
+        {"fail-fast", no_argument, NULL, 'F'},
+        {"diff", required_argument, NULL, 'd'},
+        {NULL, 0, NULL, 0}
+    };
+
+    dirhash_options options;
+    memset(&options, 0, sizeof(options));
+    options.report = 1;
+    int find_dups = 0;
+    const char *stats_path = NULL;
+    const char *watch_socket = NULL;
+    const char *verify_path = NULL;
+    const char *diff_path = NULL;
+    int fail_fast = 0;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "m:Hc:MPS:Da:s:o:i:pxw:f:V:Fd:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'm':
+                options.memory_limit = strtoull(optarg, NULL, 10) * 1024ULL * 1024ULL;
+                break;
+            case 'H':
+                options.huge_pages = 1;
+                break;
+            case 'c':
+                options.cache_path = optarg;
+                break;
+            case 'M':
+                options.merkle = 1;
+                break;
+            case 'p':
+                options.pipeline = 1;
+                break;
+            case 'x':
+                options.mmap = 1;
+                break;
+            case 'P':
+                options.physical_order = 1;
+                break;
+            case 'S':
+                options.split_threshold = strtoull(optarg, NULL, 10) * 1024ULL * 1024ULL;
+                break;
+            case 'D':
+                find_dups = 1;
+                break;
+            case 'w':
+                watch_socket = optarg;
+                break;
+            case 'f':
+                options.manifest_path = optarg;
+                break;
+            case 'V':
+                verify_path = optarg;
+                break;
+            case 'F':
+                fail_fast = 1;
+                break;
+            case 'd':
+                diff_path = optarg;
+                break;
+            case 'a':
+                options.digest = optarg;
+                break;
+            case 's':
+                if (strcmp(optarg, "json") != 0) {
+                    fprintf(stderr, "Unknown statistics format: %s\n", optarg);
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                options.stats = 1;
+                break;
+            case 'o':
+                stats_path = optarg;
+                break;
+            case 'i':
+                if (strcmp(optarg, "buffered") == 0) {
+                    options.io_mode = DIRHASH_IO_BUFFERED;
+                } else if (strcmp(optarg, "direct") == 0) {
+                    options.io_mode = DIRHASH_IO_DIRECT;
+                } else if (strcmp(optarg, "dontneed") == 0) {
+                    options.io_mode = DIRHASH_IO_DONTNEED;
+                } else {
+                    fprintf(stderr, "Unknown I/O mode: %s\n", optarg);
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
     }
 
-    const char *directory = argv[1];
-    long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
-    if (num_cores < 1) {
-        num_cores = 4;
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (options.pipeline && (options.cache_path || options.physical_order || options.split_threshold || find_dups ||
+                             options.manifest_path)) {
+        fprintf(stderr, "--pipeline cannot be combined with --cache, --physical-order, --split-threshold, "
+                        "--find-duplicates or --manifest\n");
+        return EXIT_FAILURE;
+    }
+    if (watch_socket && (options.pipeline || options.cache_path || options.physical_order || options.split_threshold ||
+                         find_dups || options.manifest_path)) {
+        fprintf(stderr, "--watch cannot be combined with --pipeline, --cache, --physical-order, --split-threshold, "
+                        "--find-duplicates or --manifest\n");
+        return EXIT_FAILURE;
+    }
+    // A manifest fixes the digest and split threshold of the files it
+    // holds, and the cache would take digests on trust.
+    if (verify_path && (options.pipeline || options.cache_path || options.split_threshold || options.digest ||
+                        find_dups || watch_socket || options.manifest_path)) {
+        fprintf(stderr, "--verify cannot be combined with --pipeline, --cache, --split-threshold, --digest, "
+                        "--find-duplicates, --watch or --manifest\n");
+        return EXIT_FAILURE;
+    }
+    if (diff_path && (options.pipeline || find_dups || watch_socket || verify_path || options.manifest_path)) {
+        fprintf(stderr, "--diff cannot be combined with --pipeline, --find-duplicates, --watch, --verify or "
+                        "--manifest\n");
+        return EXIT_FAILURE;
+    }
+    if (fail_fast && !verify_path) {
+        fprintf(stderr, "--fail-fast needs --verify\n");
+        return EXIT_FAILURE;
     }
-    size_t NUM_THREADS = (size_t)num_cores;
-    printf("Number of threads: %zu\n", NUM_THREADS);
-
-    BloomFilter *filter = bloom_filter_init(BLOOM_FILTER_SIZE);
-    FileList *fl = file_list_init(INITIAL_FILE_LIST_CAPACITY);
-
-    struct timespec start, end;
-    clock_gettime(CLOCK_MONOTONIC, &start);
-
-    traverse_directory(directory, fl);
 
-    qsort(fl->filepaths, fl->size, sizeof(char *), compare_filepaths);
+    // Directory and file descriptors are cached per worker, and the engines
+    // divide up the soft limit, so raise it to the hard limit first.
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
 
-    struct timespec traversal_end;
-    clock_gettime(CLOCK_MONOTONIC, &traversal_end);
-    double traversal_time = (traversal_end.tv_sec - start.tv_sec) +
-                             (double)(traversal_end.tv_nsec - start.tv_nsec) / 1e9;
-    printf("Directory traversal completed in %.6f seconds.\n", traversal_time);
+    const char *directory = argv[optind];
+    dirhash_ctx *ctx = dirhash_ctx_new(&options);
+    if (!ctx) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    printf("Number of threads: %zu\n", dirhash_ctx_threads(ctx));
 
-    uint64_t final_hash = HASH_SEED;
-    struct timespec loop_start;
-    clock_gettime(CLOCK_MONOTONIC, &loop_start);
-    double last_progress_update = 0.0;
+    if (watch_socket) {
+        dirhash_watch(ctx, directory, watch_socket);
+        dirhash_ctx_free(ctx);
+        return EXIT_FAILURE;
+    }
 
-    #pragma omp parallel for num_threads(NUM_THREADS) schedule(guided) reduction(^:final_hash)
-    for (size_t i = 0; i < fl->size; ++i) {
-        uint64_t hash = hash_file_contents_aio(fl->filepaths[i]);
-        if (__builtin_expect(hash == 0, 0)) {
-            continue;
+    dirhash_result result;
+    int status = EXIT_SUCCESS;
+    if (verify_path) {
+        int differs = dirhash_verify(ctx, directory, verify_path, fail_fast, stdout, &result);
+        if (differs >= 0) {
+            char total[32];
+            dirhash_format_time(result.total_time, total, sizeof(total));
+            printf("Verified %zu files against %s: %zu changed, %zu missing, %zu extra.\n", result.files,
+                   verify_path, result.changed, result.missing, result.extra);
+            printf("Total time taken: %s\n", total);
         }
-        if (!bloom_filter_check(filter, hash)) {
-            bloom_filter_add(filter, hash);
-            final_hash = (final_hash * PRIME_MULTIPLIER) ^ hash;
+        status = differs == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    } else if (diff_path) {
+        int differs = dirhash_diff(ctx, diff_path, directory, stdout, &result);
+        if (differs >= 0) {
+            char total[32];
+            dirhash_format_time(result.total_time, total, sizeof(total));
+            printf("Compared %s with %s: %zu changed, %zu removed, %zu added; %zu files skipped by directory "
+                   "digests.\n", diff_path, directory, result.changed, result.missing, result.extra, result.skipped);
+            printf("Total time taken: %s\n", total);
         }
-
-        if (omp_get_thread_num() == 0) {
-            struct timespec now;
-            clock_gettime(CLOCK_MONOTONIC, &now);
-            double elapsed_time = (now.tv_sec - loop_start.tv_sec) + (double)(now.tv_nsec - loop_start.tv_nsec) / 1e9;
-
-            if (elapsed_time - last_progress_update >= 0.1 || i == fl->size - 1) {
-                display_progress(i + 1, fl->size, elapsed_time, 0);
-                last_progress_update = elapsed_time;
-            }
+        status = differs == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    } else if (find_dups) {
+        dirhash_find_duplicates(ctx, directory, stdout, &result);
+        printf("Found %zu groups of duplicate files in %.6f seconds.\n", result.duplicate_groups, result.total_time);
+    } else {
+        if (dirhash_hash(ctx, directory, NULL, NULL, &result) < 0) {
+            status = EXIT_FAILURE;
+        }
+        char total[32];
+        dirhash_format_time(result.total_time, total, sizeof(total));
+        if (options.pipeline) {
+            printf("Hashed %zu files.\n", result.files);
         }
+        printf("\nFinal directory hash: %s\n", result.text);
+        printf("Total time taken: %s\n", total);
+    }
+    if (options.stats) {
+        write_stats(stats_path, &result);
     }
 
-    clock_gettime(CLOCK_MONOTONIC, &end);
-    double total_time = (end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
-
-    int hours, minutes, seconds, milliseconds;
-    format_time(total_time, &hours, &minutes, &seconds, &milliseconds);
-
-    printf("\nFinal directory hash: %lx\n", final_hash);
-    printf("Total time taken: %02d:%02d:%02d.%03d\n", hours, minutes, seconds, milliseconds);
-
-    file_list_free(fl);
-    bloom_filter_free(filter);
-
-    return EXIT_SUCCESS;
+    dirhash_ctx_free(ctx);
+    return status;
 }
-
@@ -0,0 +1,973 @@
+#define _GNU_SOURCE
+
+#include "manifest.h"
+#include "constants.h"
+#include "merkle.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <omp.h>
+
+#define CHILD_DIR (1ULL << 63)
+
+typedef struct {
+    uint32_t dir;
+    size_t next;
+    size_t len;
+} WalkFrame;
+
+// Writes through a buffer, keeping track of the file offset. The first
+// error sticks, and later writes are dropped.
+typedef struct {
+    int fd;
+    uint8_t *buf;
+    size_t len;
+    uint64_t offset;
+    int failed;
+} Output;
+
+// dir_map gives the manifest index of each directory of the list, and
+// parents that of each directory's parent.
+typedef struct {
+    Output out;
+    const FileList *fl;
+    ManifestWriter *writer;
+    uint64_t *blocks;
+    char *previous;
+    size_t previous_len;
+    size_t previous_capacity;
+    size_t *dir_map;
+    size_t *parents;
+    size_t names_size;
+    size_t names_capacity;
+} PathWriter;
+
+typedef struct {
+    ManifestCursor cursor;
+    int more;
+    FILE *out;
+    size_t *order;
+    size_t *expected;
+    ManifestDiff *diff;
+} Join;
+
+static void *alloc_array(size_t count, size_t elem_size, const char *what) {
+    void *p = calloc(count ? count : 1, elem_size);
+    if (!p) {
+        perror(what);
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static const char *child_name(const FileList *fl, uint64_t child) {
+    if (child & CHILD_DIR) {
+        return fl->names + fl->dirs[child & ~CHILD_DIR].name;
+    }
+    return fl->names + fl->entries[child].name;
+}
+
+static int compare_children(const void *a, const void *b, void *arg) {
+    const FileList *fl = (const FileList *)arg;
+    return strcmp(child_name(fl, *(const uint64_t *)a), child_name(fl, *(const uint64_t *)b));
+}
+
+// Orders paths as manifest_walk() visits them: byte by byte, with the
+// separator below every other byte, so that a directory's contents come
+// right where its name sorts among its siblings.
+int manifest_compare_paths(const char *a, const char *b) {
+    for (;; ++a, ++b) {
+        unsigned char ca = (unsigned char)*a, cb = (unsigned char)*b;
+        if (ca != cb) {
+            if (ca == '\0' || cb == '\0') {
+                return ca == '\0' ? -1 : 1;
+            }
+            if (ca == '/' || cb == '/') {
+                return ca == '/' ? -1 : 1;
+            }
+            return ca < cb ? -1 : 1;
+        }
+        if (ca == '\0') {
+            return 0;
+        }
+    }
+}
+
+// Visits every file and directory below the root of fl in manifest
+// order, with its path relative to the root.
+void manifest_walk(const FileList *fl, ManifestVisitor visit, void *arg) {
+    size_t dirs = fl->dir_count;
+    if (dirs == 0) {
+        return;
+    }
+    size_t *start = (size_t *)alloc_array(dirs + 1, sizeof(size_t), "Failed to allocate child index");
+    uint64_t *children = (uint64_t *)alloc_array(fl->size + dirs, sizeof(uint64_t), "Failed to allocate child list");
+    for (size_t i = 0; i < fl->size; ++i) {
+        start[fl->entries[i].parent + 1]++;
+    }
+    for (size_t d = 0; d < dirs; ++d) {
+        if (fl->dirs[d].parent != FILE_LIST_NO_PARENT) {
+            start[fl->dirs[d].parent + 1]++;
+        }
+    }
+    for (size_t d = 0; d < dirs; ++d) {
+        start[d + 1] += start[d];
+    }
+
+    size_t *fill = (size_t *)alloc_array(dirs, sizeof(size_t), "Failed to allocate child index");
+    memcpy(fill, start, dirs * sizeof(size_t));
+    for (size_t i = 0; i < fl->size; ++i) {
+        children[fill[fl->entries[i].parent]++] = i;
+    }
+    for (size_t d = 0; d < dirs; ++d) {
+        if (fl->dirs[d].parent != FILE_LIST_NO_PARENT) {
+            children[fill[fl->dirs[d].parent]++] = CHILD_DIR | d;
+        }
+    }
+    free(fill);
+
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (size_t d = 0; d < dirs; ++d) {
+        size_t n = start[d + 1] - start[d];
+        if (n > 1) {
+            qsort_r(children + start[d], n, sizeof(uint64_t), compare_children, (void *)fl);
+        }
+    }
+
+    // Each frame's path prefix stays in place while its subtree is walked;
+    // siblings overwrite only what comes after it.
+    WalkFrame *stack = (WalkFrame *)alloc_array(dirs, sizeof(WalkFrame), "Failed to allocate walk stack");
+    char *path = NULL;
+    size_t capacity = 0;
+    for (size_t root = 0; root < dirs; ++root) {
+        if (fl->dirs[root].parent != FILE_LIST_NO_PARENT) {
+            continue;
+        }
+        size_t depth = 0;
+        stack[depth++] = (WalkFrame){ (uint32_t)root, start[root], 0 };
+        while (depth > 0) {
+            WalkFrame *frame = &stack[depth - 1];
+            if (frame->next == start[frame->dir + 1]) {
+                depth--;
+                continue;
+            }
+            uint64_t child = children[frame->next++];
+            const char *name = child_name(fl, child);
+            size_t n = strlen(name);
+            size_t len = frame->len + n;
+            if (len + 2 > capacity) {
+                capacity = (len + 2) * 2;
+                path = (char *)realloc(path, capacity);
+                if (!path) {
+                    perror("Failed to allocate path");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            memcpy(path + frame->len, name, n);
+            if (child & CHILD_DIR) {
+                uint32_t dir = (uint32_t)(child & ~CHILD_DIR);
+                path[len] = '/';
+                path[len + 1] = '\0';
+                visit(arg, 1, dir, path, len + 1);
+                stack[depth++] = (WalkFrame){ dir, start[dir], len + 1 };
+            } else {
+                path[len] = '\0';
+                visit(arg, 0, (size_t)child, path, len);
+            }
+        }
+    }
+
+    free(path);
+    free(stack);
+    free(children);
+    free(start);
+}
+
+static void output_flush(Output *out) {
+    size_t done = 0;
+    while (done < out->len && !out->failed) {
+        ssize_t n = write(out->fd, out->buf + done, out->len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            out->failed = 1;
+        } else {
+            done += (size_t)n;
+        }
+    }
+    out->len = 0;
+}
+
+static void output_put(Output *out, const void *data, size_t len) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    out->offset += len;
+    while (len > 0) {
+        if (out->len == MANIFEST_WRITE_BUFFER) {
+            output_flush(out);
+        }
+        size_t chunk = MANIFEST_WRITE_BUFFER - out->len < len ? MANIFEST_WRITE_BUFFER - out->len : len;
+        memcpy(out->buf + out->len, bytes, chunk);
+        out->len += chunk;
+        bytes += chunk;
+        len -= chunk;
+    }
+}
+
+static void output_varint(Output *out, uint64_t value) {
+    uint8_t bytes[10];
+    size_t n = 0;
+    do {
+        uint8_t b = value & 0x7f;
+        value >>= 7;
+        bytes[n++] = b | (value ? 0x80 : 0);
+    } while (value);
+    output_put(out, bytes, n);
+}
+
+static void output_zeros(Output *out, size_t len) {
+    static const uint8_t zeros[64];
+    while (len > 0) {
+        size_t chunk = len < sizeof(zeros) ? len : sizeof(zeros);
+        output_put(out, zeros, chunk);
+        len -= chunk;
+    }
+}
+
+static void add_dir_name(PathWriter *paths, const char *name) {
+    size_t len = strlen(name) + 1;
+    if (paths->names_size + len > paths->names_capacity) {
+        paths->names_capacity = (paths->names_size + len) * 2;
+        paths->writer->dir_names = (char *)realloc(paths->writer->dir_names, paths->names_capacity);
+        if (!paths->writer->dir_names) {
+            perror("Failed to allocate directory names");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(paths->writer->dir_names + paths->names_size, name, len);
+    paths->names_size += len;
+}
+
+static void add_dir(PathWriter *paths, size_t id, const char *name) {
+    ManifestWriter *writer = paths->writer;
+    size_t d = writer->dir_count++;
+    uint32_t parent = paths->fl->dirs[id].parent;
+    paths->dir_map[id] = d;
+    paths->parents[d] = parent == FILE_LIST_NO_PARENT ? d : paths->dir_map[parent];
+    writer->dirs[d].name = paths->names_size;
+    writer->dirs[d].first_file = writer->count;
+    writer->dirs[d].end_file = writer->count;
+    writer->dirs[d].end_dir = d + 1;
+    add_dir_name(paths, name);
+}
+
+// Writes the path of file index as the next record and gives the file its
+// slot in the digests region; a directory gets the next entry of the
+// directory table.
+static void write_path(void *arg, int dir, size_t index, const char *path, size_t len) {
+    PathWriter *paths = (PathWriter *)arg;
+    ManifestWriter *writer = paths->writer;
+    if (dir) {
+        add_dir(paths, index, file_list_name(paths->fl, paths->fl->dirs[index].name));
+        return;
+    }
+
+    size_t shared = 0;
+    if (writer->count % MANIFEST_BLOCK_FILES == 0) {
+        paths->blocks[writer->count / MANIFEST_BLOCK_FILES] = paths->out.offset - sizeof(ManifestHeader);
+    } else {
+        while (shared < len && shared < paths->previous_len && path[shared] == paths->previous[shared]) {
+            shared++;
+        }
+    }
+    output_varint(&paths->out, shared);
+    output_varint(&paths->out, len - shared);
+    output_put(&paths->out, path + shared, len - shared);
+    writer->slots[index] = writer->count;
+    writer->files[writer->count] = index;
+    writer->dirs[paths->dir_map[paths->fl->entries[index].parent]].end_file = ++writer->count;
+
+    if (len + 1 > paths->previous_capacity) {
+        paths->previous_capacity = (len + 1) * 2;
+        paths->previous = (char *)realloc(paths->previous, paths->previous_capacity);
+        if (!paths->previous) {
+            perror("Failed to allocate path");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(paths->previous, path, len + 1);
+    paths->previous_len = len;
+}
+
+// Starts a manifest of fl at path: writes the paths of its files and its
+// directories to a temporary file next to path, and maps the digests
+// region, whose slots stay zero, as for a failed file, until
+// manifest_writer_set() fills them. The manifest replaces path when it is
+// closed. Without a path it lives in memory only, for
+// manifest_writer_finish(). Returns -1 on failure.
+int manifest_writer_open(ManifestWriter *writer, const char *path, const DigestAlgorithm *alg,
+                         uint64_t split_threshold, const FileList *fl) {
+    memset(writer, 0, sizeof(*writer));
+    writer->fd = -1;
+    writer->alg = alg;
+    writer->fl = fl;
+    writer->slots = (size_t *)alloc_array(fl->size, sizeof(size_t), "Failed to allocate manifest slots");
+    writer->files = (size_t *)alloc_array(fl->size, sizeof(size_t), "Failed to allocate manifest slots");
+    writer->dirs = (ManifestDir *)alloc_array(fl->dir_count, sizeof(ManifestDir), "Failed to allocate manifest");
+    if (path) {
+        size_t tmp_len = strlen(path) + sizeof(".tmp");
+        writer->path = strdup(path);
+        writer->tmp_path = (char *)malloc(tmp_len);
+        if (!writer->path || !writer->tmp_path) {
+            perror("Failed to allocate manifest path");
+            exit(EXIT_FAILURE);
+        }
+        snprintf(writer->tmp_path, tmp_len, "%s.tmp", path);
+        writer->fd = open(writer->tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    } else {
+        writer->fd = memfd_create("dirhash-manifest", MFD_CLOEXEC);
+    }
+    const char *name = path ? writer->tmp_path : "in memory";
+    if (writer->fd < 0) {
+        fprintf(stderr, "Failed to create manifest %s: %s\n", name, strerror(errno));
+        manifest_writer_abort(writer);
+        return -1;
+    }
+
+    size_t block_count = (fl->size + MANIFEST_BLOCK_FILES - 1) / MANIFEST_BLOCK_FILES;
+    PathWriter paths;
+    memset(&paths, 0, sizeof(paths));
+    paths.out.fd = writer->fd;
+    paths.out.buf = (uint8_t *)malloc(MANIFEST_WRITE_BUFFER);
+    if (!paths.out.buf) {
+        perror("Failed to allocate manifest buffer");
+        exit(EXIT_FAILURE);
+    }
+    paths.fl = fl;
+    paths.writer = writer;
+    paths.blocks = (uint64_t *)alloc_array(block_count, sizeof(uint64_t), "Failed to allocate manifest index");
+    paths.dir_map = (size_t *)alloc_array(fl->dir_count, sizeof(size_t), "Failed to allocate manifest");
+    paths.parents = (size_t *)alloc_array(fl->dir_count, sizeof(size_t), "Failed to allocate manifest");
+
+    ManifestHeader header;
+    memset(&header, 0, sizeof(header));
+    output_put(&paths.out, &header, sizeof(header));
+    if (fl->dir_count > 0) {
+        add_dir(&paths, 0, "");
+    }
+    manifest_walk(fl, write_path, &paths);
+
+    // Children follow their parents, so walking the table backwards
+    // extends every directory over its subtree.
+    for (size_t d = writer->dir_count; d-- > 1;) {
+        ManifestDir *parent = &writer->dirs[paths.parents[d]];
+        ManifestDir *dir = &writer->dirs[d];
+        parent->end_file = dir->end_file > parent->end_file ? dir->end_file : parent->end_file;
+        parent->end_dir = dir->end_dir > parent->end_dir ? dir->end_dir : parent->end_dir;
+    }
+
+    uint64_t index_offset = (paths.out.offset + 7) & ~7ULL;
+    output_zeros(&paths.out, index_offset - paths.out.offset);
+    output_put(&paths.out, paths.blocks, block_count * sizeof(uint64_t));
+    uint64_t dirs_offset = paths.out.offset;
+    output_put(&paths.out, writer->dirs, writer->dir_count * sizeof(ManifestDir));
+    uint64_t dir_names_offset = paths.out.offset;
+    output_put(&paths.out, writer->dir_names, paths.names_size);
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t digests_offset = (paths.out.offset + page - 1) / page * page;
+    output_flush(&paths.out);
+    int failed = paths.out.failed;
+    free(paths.out.buf);
+    free(paths.blocks);
+    free(paths.previous);
+    free(paths.dir_map);
+    free(paths.parents);
+
+    memcpy(header.magic, MANIFEST_MAGIC, sizeof(header.magic));
+    header.version = MANIFEST_VERSION;
+    header.seed = HASH_SEED;
+    header.digest_id = alg->id;
+    header.digest_size = (uint32_t)alg->size;
+    header.split_threshold = split_threshold;
+    header.count = fl->size;
+    header.block_files = MANIFEST_BLOCK_FILES;
+    header.index_offset = index_offset;
+    header.dir_count = writer->dir_count;
+    header.dirs_offset = dirs_offset;
+    header.dir_names_offset = dir_names_offset;
+    header.digests_offset = digests_offset;
+    header.file_size = digests_offset + (fl->size + writer->dir_count) * alg->size;
+    failed = failed || ftruncate(writer->fd, header.file_size) < 0 ||
+             pwrite(writer->fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header);
+    writer->map_size = header.file_size - digests_offset;
+    if (!failed && writer->map_size > 0) {
+        void *map = mmap(NULL, writer->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, writer->fd, digests_offset);
+        failed = map == MAP_FAILED;
+        writer->map = failed ? NULL : (uint8_t *)map;
+    }
+    if (failed) {
+        fprintf(stderr, "Failed to write manifest %s: %s\n", name, strerror(errno));
+        manifest_writer_abort(writer);
+        return -1;
+    }
+    return 0;
+}
+
+// Stores the digest of file index of the list the manifest was opened
+// for. Every file has a slot of its own, so workers need no lock.
+void manifest_writer_set(ManifestWriter *writer, size_t index, const uint8_t *digest) {
+    memcpy(writer->map + writer->slots[index] * writer->alg->size, digest, writer->alg->size);
+}
+
+// Hashes every directory from its children, as merkle.c does, from the
+// last to the first so that children come before their parents.
+static void hash_dirs(ManifestWriter *writer) {
+    const DigestAlgorithm *alg = writer->alg;
+    const FileList *fl = writer->fl;
+    const uint8_t *file_digests = writer->map;
+    uint8_t *dir_digests = writer->map + writer->count * alg->size;
+    for (size_t d = writer->dir_count; d-- > 0;) {
+        const ManifestDir *dir = &writer->dirs[d];
+        DigestState state;
+        alg->init(&state);
+        size_t file = dir->first_file, child = d + 1;
+        while (file < dir->end_file || child < dir->end_dir) {
+            if (child < dir->end_dir && writer->dirs[child].first_file <= file) {
+                merkle_hash_child(alg, &state, 1, writer->dir_names + writer->dirs[child].name,
+                                  dir_digests + child * alg->size);
+                file = writer->dirs[child].end_file;
+                child = writer->dirs[child].end_dir;
+            } else {
+                merkle_hash_child(alg, &state, 0, file_list_name(fl, fl->entries[writer->files[file]].name),
+                                  file_digests + file * alg->size);
+                file++;
+            }
+        }
+        alg->final(&state, dir_digests + d * alg->size);
+    }
+}
+
+static void writer_free(ManifestWriter *writer) {
+    free(writer->path);
+    free(writer->tmp_path);
+    free(writer->slots);
+    free(writer->files);
+    free(writer->dirs);
+    free(writer->dir_names);
+    memset(writer, 0, sizeof(*writer));
+    writer->fd = -1;
+}
+
+// Completes the directory digests, flushes the manifest and moves it over
+// the one at its path. Returns -1 on failure, leaving the old one in
+// place.
+int manifest_writer_close(ManifestWriter *writer) {
+    int failed = 0;
+    if (writer->map) {
+        hash_dirs(writer);
+        munmap(writer->map, writer->map_size);
+    }
+    failed |= fdatasync(writer->fd) < 0;
+    failed |= close(writer->fd) < 0;
+    if (failed || rename(writer->tmp_path, writer->path) < 0) {
+        fprintf(stderr, "Failed to write manifest %s: %s\n", writer->path, strerror(errno));
+        unlink(writer->tmp_path);
+        failed = 1;
+    }
+    writer_free(writer);
+    return failed ? -1 : 0;
+}
+
+void manifest_writer_abort(ManifestWriter *writer) {
+    if (writer->map) {
+        munmap(writer->map, writer->map_size);
+    }
+    if (writer->fd >= 0) {
+        close(writer->fd);
+        if (writer->tmp_path) {
+            unlink(writer->tmp_path);
+        }
+    }
+    writer_free(writer);
+}
+
+// Maps the manifest in fd and checks its header; name is for messages.
+static int map_manifest(Manifest *manifest, int fd, const char *name) {
+    memset(manifest, 0, sizeof(*manifest));
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(ManifestHeader)) {
+        fprintf(stderr, "Invalid manifest %s\n", name);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map manifest %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+
+    const ManifestHeader *header = (const ManifestHeader *)map;
+    uint64_t size = (uint64_t)st.st_size;
+    const DigestAlgorithm *alg = digest_find_id(header->digest_id);
+    uint64_t block_count = header->block_files ? (header->count + header->block_files - 1) / header->block_files : 0;
+    if (memcmp(header->magic, MANIFEST_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != MANIFEST_VERSION || header->seed != HASH_SEED || !alg ||
+        header->digest_size != alg->size || header->block_files == 0 || header->file_size != size ||
+        header->index_offset < sizeof(ManifestHeader) || header->index_offset % sizeof(uint64_t) != 0 ||
+        header->dirs_offset < header->index_offset || header->dir_names_offset < header->dirs_offset ||
+        header->digests_offset < header->dir_names_offset || header->digests_offset > size ||
+        block_count > (header->dirs_offset - header->index_offset) / sizeof(uint64_t) ||
+        header->dir_count != (header->dir_names_offset - header->dirs_offset) / sizeof(ManifestDir) ||
+        header->count > (size - header->digests_offset) / alg->size ||
+        header->dir_count != (size - header->digests_offset) / alg->size - header->count) {
+        fprintf(stderr, "Invalid manifest %s\n", name);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    const uint8_t *base = (const uint8_t *)map;
+    manifest->map = map;
+    manifest->map_size = st.st_size;
+    manifest->alg = alg;
+    manifest->split_threshold = header->split_threshold;
+    manifest->count = header->count;
+    manifest->block_files = header->block_files;
+    manifest->paths = base + sizeof(ManifestHeader);
+    manifest->paths_size = header->index_offset - sizeof(ManifestHeader);
+    manifest->blocks = (const uint64_t *)(base + header->index_offset);
+    manifest->dirs = (const ManifestDir *)(base + header->dirs_offset);
+    manifest->dir_count = header->dir_count;
+    manifest->dir_names = (const char *)(base + header->dir_names_offset);
+    manifest->dir_names_size = header->digests_offset - header->dir_names_offset;
+    manifest->digests = base + header->digests_offset;
+    manifest->dir_digests = manifest->digests + header->count * alg->size;
+    return 0;
+}
+
+// Maps the manifest at path and checks its header. Returns -1 if it cannot
+// be read or is not a manifest this build understands.
+int manifest_open(Manifest *manifest, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        memset(manifest, 0, sizeof(*manifest));
+        fprintf(stderr, "Failed to open manifest %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    int result = map_manifest(manifest, fd, path);
+    close(fd);
+    return result;
+}
+
+// Completes a manifest opened without a path and maps it for reading in
+// place of a file. Returns -1 on failure.
+int manifest_writer_finish(ManifestWriter *writer, Manifest *manifest) {
+    if (writer->map) {
+        hash_dirs(writer);
+        munmap(writer->map, writer->map_size);
+        writer->map = NULL;
+    }
+    int result = map_manifest(manifest, writer->fd, "in memory");
+    close(writer->fd);
+    writer_free(writer);
+    return result;
+}
+
+void manifest_close(Manifest *manifest) {
+    if (manifest->map) {
+        munmap(manifest->map, manifest->map_size);
+    }
+    memset(manifest, 0, sizeof(*manifest));
+}
+
+void manifest_cursor_init(ManifestCursor *cursor, const Manifest *manifest) {
+    memset(cursor, 0, sizeof(*cursor));
+    cursor->manifest = manifest;
+    manifest_cursor_seek(cursor, 0);
+}
+
+// Moves the cursor to the start of block; the next path decoded is the
+// block's first.
+void manifest_cursor_seek(ManifestCursor *cursor, size_t block) {
+    const Manifest *manifest = cursor->manifest;
+    cursor->index = SIZE_MAX;
+    cursor->next = block * manifest->block_files;
+    cursor->len = 0;
+    if (cursor->next < manifest->count) {
+        cursor->offset = manifest->blocks[block];
+        cursor->corrupt |= cursor->offset > manifest->paths_size;
+    }
+}
+
+static int read_varint(const uint8_t *data, size_t size, size_t *offset, uint64_t *value) {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64 && *offset < size; shift += 7) {
+        uint8_t b = data[(*offset)++];
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *value = v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Decodes the next path. Returns 0 at the end of the manifest, or when it
+// turns out to be corrupt, which also sets corrupt.
+int manifest_cursor_next(ManifestCursor *cursor) {
+    const Manifest *manifest = cursor->manifest;
+    if (cursor->corrupt || cursor->next >= manifest->count) {
+        return 0;
+    }
+    uint64_t shared, rest;
+    if (read_varint(manifest->paths, manifest->paths_size, &cursor->offset, &shared) < 0 ||
+        read_varint(manifest->paths, manifest->paths_size, &cursor->offset, &rest) < 0 || shared > cursor->len ||
+        rest > manifest->paths_size - cursor->offset) {
+        cursor->corrupt = 1;
+        return 0;
+    }
+    if (shared + rest + 1 > cursor->capacity) {
+        cursor->capacity = (shared + rest + 1) * 2;
+        cursor->path = (char *)realloc(cursor->path, cursor->capacity);
+        if (!cursor->path) {
+            perror("Failed to allocate path");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(cursor->path + shared, manifest->paths + cursor->offset, rest);
+    cursor->offset += rest;
+    cursor->len = shared + rest;
+    cursor->path[cursor->len] = '\0';
+    cursor->index = cursor->next++;
+    return 1;
+}
+
+void manifest_cursor_free(ManifestCursor *cursor) {
+    free(cursor->path);
+    cursor->path = NULL;
+    cursor->capacity = 0;
+}
+
+// Returns path number index, decoded with cursor from the start of its
+// block unless the cursor is already on the way there. Returns NULL if the
+// manifest is corrupt.
+const char *manifest_path(const Manifest *manifest, size_t index, ManifestCursor *cursor) {
+    if (cursor->index == index) {
+        return cursor->path;
+    }
+    size_t block = index / manifest->block_files;
+    if (cursor->next > index || cursor->next / manifest->block_files != block) {
+        manifest_cursor_seek(cursor, block);
+    }
+    while (cursor->next <= index) {
+        if (!manifest_cursor_next(cursor)) {
+            return NULL;
+        }
+    }
+    return cursor->path;
+}
+
+// Pairs each file of the tree with the manifest's path of the same name;
+// the paths passed over on either side are missing or extra.
+static void join_file(void *arg, int dir, size_t index, const char *path, size_t len) {
+    (void)len;
+    Join *join = (Join *)arg;
+    if (dir) {
+        return;
+    }
+    int c = 1;
+    while (join->more && (c = manifest_compare_paths(join->cursor.path, path)) < 0) {
+        fprintf(join->out, "missing %s\n", join->cursor.path);
+        join->diff->missing++;
+        join->more = manifest_cursor_next(&join->cursor);
+    }
+    if (join->more && c == 0) {
+        join->order[join->diff->matched] = index;
+        join->expected[join->diff->matched] = join->cursor.index;
+        join->diff->matched++;
+        join->more = manifest_cursor_next(&join->cursor);
+    } else {
+        fprintf(join->out, "extra %s\n", path);
+        join->diff->extra++;
+    }
+}
+
+// Compares the files of fl with the manifest, writing a line to out for
+// every file that is missing from the tree, extra in it, or changed.
+// Missing and extra files are found in one merge pass over both sides in
+// manifest order; the files on both are then hashed in parallel and each
+// digest checked as its batch completes. With fail_fast, hashing stops at
+// the first difference. Worker n hashes with engines[n], which must be
+// set up for the manifest's digest and split threshold. Returns -1 if the
+// manifest turns out to be corrupt.
+int manifest_verify(const Manifest *manifest, const FileList *fl, size_t num_threads, HashEngine *engines,
+                    int fail_fast, FILE *out, ManifestDiff *diff) {
+    memset(diff, 0, sizeof(*diff));
+    Join join;
+    memset(&join, 0, sizeof(join));
+    manifest_cursor_init(&join.cursor, manifest);
+    join.more = manifest_cursor_next(&join.cursor);
+    join.out = out;
+    join.order = (size_t *)alloc_array(fl->size, sizeof(size_t), "Failed to allocate file order");
+    join.expected = (size_t *)alloc_array(fl->size, sizeof(size_t), "Failed to allocate file order");
+    join.diff = diff;
+    manifest_walk(fl, join_file, &join);
+    while (join.more) {
+        fprintf(out, "missing %s\n", join.cursor.path);
+        diff->missing++;
+        join.more = manifest_cursor_next(&join.cursor);
+    }
+    int corrupt = join.cursor.corrupt;
+    manifest_cursor_free(&join.cursor);
+    if (corrupt) {
+        free(join.order);
+        free(join.expected);
+        return -1;
+    }
+
+    const DigestAlgorithm *alg = manifest->alg;
+    size_t matched = diff->matched;
+    size_t num_batches = (matched + HASH_BATCH_SIZE - 1) / HASH_BATCH_SIZE;
+    int stop = fail_fast && (diff->missing || diff->extra);
+    size_t changed = 0;
+
+    #pragma omp parallel num_threads(num_threads) reduction(+:changed)
+    {
+        HashEngine *engine = &engines[omp_get_thread_num()];
+        uint8_t digests[HASH_BATCH_SIZE * DIGEST_MAX_SIZE];
+        ManifestCursor cursor;
+        manifest_cursor_init(&cursor, manifest);
+
+        #pragma omp for schedule(dynamic)
+        for (size_t batch = 0; batch < num_batches; ++batch) {
+            if (__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+                continue;
+            }
+            size_t begin = batch * HASH_BATCH_SIZE;
+            size_t count = matched - begin < HASH_BATCH_SIZE ? matched - begin : HASH_BATCH_SIZE;
+            hash_engine_hash_files(engine, fl, join.order, begin, count, digests);
+
+            for (size_t j = 0; j < count; ++j) {
+                const uint8_t *digest = digests + j * alg->size;
+                size_t index = join.expected[begin + j];
+                if (memcmp(digest, manifest_digest(manifest, index), alg->size) == 0) {
+                    continue;
+                }
+                const char *path = manifest_path(manifest, index, &cursor);
+                fprintf(out, "%s %s\n", digest_key(digest, alg->size) == 0 ? "unreadable" : "changed",
+                        path ? path : "?");
+                changed++;
+                if (fail_fast) {
+                    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+                }
+            }
+        }
+
+        manifest_cursor_free(&cursor);
+    }
+
+    diff->changed = changed;
+    free(join.order);
+    free(join.expected);
+    return 0;
+}
+
+// Steps through the children of a manifest directory in name order: the
+// files it holds directly and the directories right below it. Fails on a
+// directory table whose ranges do not nest.
+typedef struct {
+    const Manifest *manifest;
+    ManifestCursor *cursor;
+    size_t file;
+    size_t end_file;
+    size_t child;
+    size_t end_dir;
+    int dir;
+    size_t index;
+    const char *name;
+    int corrupt;
+} Children;
+
+static int dir_valid(const Manifest *manifest, size_t dir, size_t parent) {
+    const ManifestDir *d = &manifest->dirs[dir];
+    const ManifestDir *p = &manifest->dirs[parent];
+    return d->name < manifest->dir_names_size &&
+           memchr(manifest->dir_names + d->name, '\0', manifest->dir_names_size - d->name) &&
+           d->first_file <= d->end_file && d->end_file <= manifest->count && d->end_dir > dir &&
+           d->end_dir <= manifest->dir_count &&
+           (dir == parent || (d->first_file >= p->first_file && d->end_file <= p->end_file && d->end_dir <= p->end_dir));
+}
+
+static void children_init(Children *it, const Manifest *manifest, ManifestCursor *cursor, size_t dir) {
+    it->manifest = manifest;
+    it->cursor = cursor;
+    it->file = manifest->dirs[dir].first_file;
+    it->end_file = manifest->dirs[dir].end_file;
+    it->child = dir + 1;
+    it->end_dir = manifest->dirs[dir].end_dir;
+    it->corrupt = 0;
+}
+
+// Moves to the next child. Returns 0 after the last one or on corruption.
+static int children_next(Children *it, size_t parent) {
+    const Manifest *manifest = it->manifest;
+    if (it->child < it->end_dir && manifest->dirs[it->child].first_file <= it->file) {
+        const ManifestDir *d = &manifest->dirs[it->child];
+        if (!dir_valid(manifest, it->child, parent) || d->first_file != it->file) {
+            it->corrupt = 1;
+            return 0;
+        }
+        it->dir = 1;
+        it->index = it->child;
+        it->name = manifest->dir_names + d->name;
+        it->file = d->end_file;
+        it->child = d->end_dir;
+        return 1;
+    }
+    if (it->file >= it->end_file) {
+        return 0;
+    }
+    const char *path = manifest_path(manifest, it->file, it->cursor);
+    if (!path) {
+        it->corrupt = 1;
+        return 0;
+    }
+    const char *slash = strrchr(path, '/');
+    it->dir = 0;
+    it->index = it->file++;
+    it->name = slash ? slash + 1 : path;
+    return 1;
+}
+
+// One side of a diff.
+typedef struct {
+    const Manifest *manifest;
+    ManifestCursor cursor;
+    ManifestCursor list;
+} DiffSide;
+
+typedef struct {
+    DiffSide sides[2];
+    FILE *out;
+    ManifestDiff *diff;
+    int corrupt;
+} Diff;
+
+// Reports the file, or every file below the directory, that the current
+// child of side is made of.
+static void diff_report(Diff *d, int side, const Children *it) {
+    const Manifest *manifest = d->sides[side].manifest;
+    size_t begin = it->index, end = it->index + 1;
+    if (it->dir) {
+        begin = manifest->dirs[it->index].first_file;
+        end = manifest->dirs[it->index].end_file;
+    }
+    for (size_t file = begin; file < end; ++file) {
+        const char *path = manifest_path(manifest, file, &d->sides[side].list);
+        if (!path) {
+            d->corrupt = 1;
+            return;
+        }
+        fprintf(d->out, "%s %s\n", side == 0 ? "removed" : "added", path);
+    }
+    if (side == 0) {
+        d->diff->missing += end - begin;
+    } else {
+        d->diff->extra += end - begin;
+    }
+}
+
+// Compares directory a of the first side with directory b of the second.
+// Equal digests mean equal subtrees, which are passed over whole;
+// otherwise the children are merged by name and only the directories
+// whose digests differ are entered.
+static void diff_dirs(Diff *d, size_t a, size_t b) {
+    const Manifest *ma = d->sides[0].manifest, *mb = d->sides[1].manifest;
+    size_t size = ma->alg->size;
+    if (memcmp(manifest_dir_digest(ma, a), manifest_dir_digest(mb, b), size) == 0) {
+        d->diff->skipped += ma->dirs[a].end_file - ma->dirs[a].first_file;
+        return;
+    }
+
+    Children ia, ib;
+    children_init(&ia, ma, &d->sides[0].cursor, a);
+    children_init(&ib, mb, &d->sides[1].cursor, b);
+    int more_a = children_next(&ia, a), more_b = children_next(&ib, b);
+    while (!d->corrupt && !ia.corrupt && !ib.corrupt && (more_a || more_b)) {
+        int c = !more_a ? 1 : !more_b ? -1 : strcmp(ia.name, ib.name);
+        if (c == 0 && ia.dir == ib.dir) {
+            if (ia.dir) {
+                diff_dirs(d, ia.index, ib.index);
+            } else if (memcmp(manifest_digest(ma, ia.index), manifest_digest(mb, ib.index), size) == 0) {
+                d->diff->matched++;
+            } else {
+                const char *path = manifest_path(mb, ib.index, &d->sides[1].list);
+                fprintf(d->out, "changed %s\n", path ? path : "?");
+                d->diff->changed++;
+            }
+        } else {
+            // A file and a directory of the same name replace each other.
+            if (c <= 0) {
+                diff_report(d, 0, &ia);
+            }
+            if (c >= 0) {
+                diff_report(d, 1, &ib);
+            }
+        }
+        if (c <= 0) {
+            more_a = children_next(&ia, a);
+        }
+        if (c >= 0) {
+            more_b = children_next(&ib, b);
+        }
+    }
+    d->corrupt |= ia.corrupt || ib.corrupt;
+}
+
+// Compares the tree recorded in a with the one in b, which must use the
+// same digest, writing a line to out for every file that is removed,
+// added or changed from a to b. Subtrees whose directory digests match are
+// skipped without decoding any of their paths, so the work follows the
+// size of the difference rather than that of the trees. Returns -1 if
+// either manifest turns out to be corrupt.
+int manifest_diff(const Manifest *a, const Manifest *b, FILE *out, ManifestDiff *diff) {
+    memset(diff, 0, sizeof(*diff));
+    Diff d;
+    memset(&d, 0, sizeof(d));
+    d.sides[0].manifest = a;
+    d.sides[1].manifest = b;
+    d.out = out;
+    d.diff = diff;
+    for (int side = 0; side < 2; ++side) {
+        manifest_cursor_init(&d.sides[side].cursor, d.sides[side].manifest);
+        manifest_cursor_init(&d.sides[side].list, d.sides[side].manifest);
+    }
+
+    if (a->dir_count > 0 && b->dir_count > 0) {
+        d.corrupt = !dir_valid(a, 0, 0) || !dir_valid(b, 0, 0);
+        if (!d.corrupt) {
+            diff_dirs(&d, 0, 0);
+        }
+    } else {
+        // A manifest without directories is of an empty tree.
+        for (int side = 0; side < 2 && !d.corrupt; ++side) {
+            const Manifest *m = d.sides[side].manifest;
+            if (m->dir_count > 0 && dir_valid(m, 0, 0)) {
+                Children it = { .dir = 1, .index = 0 };
+                diff_report(&d, side, &it);
+            } else if (m->count > 0) {
+                d.corrupt = 1;
+            }
+        }
+    }
+
+    int corrupt = d.corrupt;
+    for (int side = 0; side < 2; ++side) {
+        corrupt |= d.sides[side].cursor.corrupt || d.sides[side].list.corrupt;
+        manifest_cursor_free(&d.sides[side].cursor);
+        manifest_cursor_free(&d.sides[side].list);
+    }
+    return corrupt ? -1 : 0;
+}
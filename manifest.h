@@ -0,0 +1,152 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "file_list.h"
+#include "digest.h"
+#include "hashing.h"
+
+#define MANIFEST_MAGIC "DHMANIF1"
+#define MANIFEST_VERSION 2
+
+// On-disk layout: a header, the path of every file relative to the root,
+// an index of path blocks, the directory table and the directory names,
+// and from a page boundary the file digests followed by the directory
+// digests. Paths are in manifest order, which compares them component by
+// component: the order of a depth-first walk that visits the children of
+// each directory sorted by name. Two manifests, or a manifest and a tree,
+// are compared in one merge pass. Each path is stored as the length of
+// the prefix it shares with the one before and the rest of it, both
+// lengths as LEB128 varints. The prefix restarts every block_files paths,
+// at an offset the index records, so any block decodes on its own.
+// Directories are listed in the order the walk enters them, the root
+// first; their digests are those of merkle.c, so the root's is the
+// --merkle root.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t seed;
+    uint32_t digest_id;
+    uint32_t digest_size;
+    uint64_t split_threshold;
+    uint64_t count;
+    uint64_t block_files;
+    uint64_t index_offset;
+    uint64_t dir_count;
+    uint64_t dirs_offset;
+    uint64_t dir_names_offset;
+    uint64_t digests_offset;
+    uint64_t file_size;
+} ManifestHeader;
+
+// A directory holds files [first_file, end_file) and, after itself,
+// directories up to end_dir. A child directory comes before the files
+// from first_file on, which places it among its siblings by name without
+// decoding any of them. name is an offset into the directory names.
+typedef struct {
+    uint64_t name;
+    uint64_t first_file;
+    uint64_t end_file;
+    uint64_t end_dir;
+} ManifestDir;
+
+// A manifest being written for a file list. The paths and directories are
+// written when it is opened; the digests region is mapped, and each
+// hashing worker stores its files' digests straight into their slots
+// there. The directory digests follow once every file has its digest.
+typedef struct {
+    char *path;
+    char *tmp_path;
+    int fd;
+    uint8_t *map;
+    size_t map_size;
+    const DigestAlgorithm *alg;
+    const FileList *fl;
+    size_t *slots;
+    size_t *files;
+    size_t count;
+    ManifestDir *dirs;
+    size_t dir_count;
+    char *dir_names;
+} ManifestWriter;
+
+// A read-only mapping of a manifest.
+typedef struct {
+    void *map;
+    size_t map_size;
+    const DigestAlgorithm *alg;
+    uint64_t split_threshold;
+    size_t count;
+    size_t block_files;
+    const uint8_t *paths;
+    size_t paths_size;
+    const uint64_t *blocks;
+    const ManifestDir *dirs;
+    size_t dir_count;
+    const char *dir_names;
+    size_t dir_names_size;
+    const uint8_t *digests;
+    const uint8_t *dir_digests;
+} Manifest;
+
+// Decodes the paths of a manifest in order from the start of a block;
+// path holds path number index, and next is the one decoded after it.
+typedef struct {
+    const Manifest *manifest;
+    size_t index;
+    size_t next;
+    size_t offset;
+    char *path;
+    size_t len;
+    size_t capacity;
+    int corrupt;
+} ManifestCursor;
+
+// Missing files are on the first side only, extra ones on the second.
+// skipped counts the files of identical subtrees, which a diff passes over
+// without looking at them.
+typedef struct {
+    size_t matched;
+    size_t changed;
+    size_t missing;
+    size_t extra;
+    size_t skipped;
+} ManifestDiff;
+
+// Files come with their index in the file list, directories with their id
+// and a path ending in '/'.
+typedef void (*ManifestVisitor)(void *arg, int dir, size_t index, const char *path, size_t len);
+
+int manifest_compare_paths(const char *a, const char *b);
+void manifest_walk(const FileList *fl, ManifestVisitor visit, void *arg);
+
+int manifest_writer_open(ManifestWriter *writer, const char *path, const DigestAlgorithm *alg,
+                         uint64_t split_threshold, const FileList *fl);
+void manifest_writer_set(ManifestWriter *writer, size_t index, const uint8_t *digest);
+int manifest_writer_close(ManifestWriter *writer);
+int manifest_writer_finish(ManifestWriter *writer, Manifest *manifest);
+void manifest_writer_abort(ManifestWriter *writer);
+
+int manifest_open(Manifest *manifest, const char *path);
+void manifest_close(Manifest *manifest);
+void manifest_cursor_init(ManifestCursor *cursor, const Manifest *manifest);
+void manifest_cursor_seek(ManifestCursor *cursor, size_t block);
+int manifest_cursor_next(ManifestCursor *cursor);
+void manifest_cursor_free(ManifestCursor *cursor);
+const char *manifest_path(const Manifest *manifest, size_t index, ManifestCursor *cursor);
+
+static inline const uint8_t *manifest_digest(const Manifest *manifest, size_t index) {
+    return manifest->digests + index * manifest->alg->size;
+}
+
+static inline const uint8_t *manifest_dir_digest(const Manifest *manifest, size_t dir) {
+    return manifest->dir_digests + dir * manifest->alg->size;
+}
+
+int manifest_verify(const Manifest *manifest, const FileList *fl, size_t num_threads, HashEngine *engines,
+                    int fail_fast, FILE *out, ManifestDiff *diff);
+int manifest_diff(const Manifest *a, const Manifest *b, FILE *out, ManifestDiff *diff);
+
+#endif
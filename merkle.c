@@ -0,0 +1,145 @@
+#define _GNU_SOURCE
+
+#include "merkle.h"
+#include "constants.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *child_name(const FileList *fl, uint64_t child) {
+    if (child & MERKLE_CHILD_DIR) {
+        return fl->names + fl->dirs[child & ~MERKLE_CHILD_DIR].name;
+    }
+    return fl->names + fl->entries[child].name;
+}
+
+static int compare_children(const void *a, const void *b, void *arg) {
+    const FileList *fl = (const FileList *)arg;
+    return strcmp(child_name(fl, *(const uint64_t *)a), child_name(fl, *(const uint64_t *)b));
+}
+
+static void *alloc_array(size_t count, size_t elem_size, const char *what) {
+    void *p = calloc(count ? count : 1, elem_size);
+    if (!p) {
+        perror(what);
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+// Feeds one child record of a directory to state. Children must be fed in
+// strcmp() order of their names.
+void merkle_hash_child(const DigestAlgorithm *alg, DigestState *state, int dir, const char *name,
+                       const uint8_t *digest) {
+    uint8_t type = dir ? 'd' : 'f';
+    alg->update(state, &type, 1);
+    alg->update(state, name, strlen(name) + 1);
+    alg->update(state, digest, alg->size);
+}
+
+static void hash_directory(MerkleTree *tree, uint32_t dir) {
+    const DigestAlgorithm *alg = tree->alg;
+    DigestState state;
+    alg->init(&state);
+    for (size_t i = tree->child_start[dir]; i < tree->child_start[dir + 1]; ++i) {
+        uint64_t child = tree->children[i];
+        const uint8_t *digest = (child & MERKLE_CHILD_DIR)
+                                    ? tree->dir_digests + (child & ~MERKLE_CHILD_DIR) * alg->size
+                                    : tree->file_digests + child * alg->size;
+        merkle_hash_child(alg, &state, (child & MERKLE_CHILD_DIR) != 0, child_name(tree->fl, child), digest);
+    }
+    alg->final(&state, tree->dir_digests + (size_t)dir * alg->size);
+}
+
+// Called once the last child of dir has its digest. Hashes dir and walks up
+// through every ancestor that this completes in turn. The acquire/release
+// pair on pending makes the children's digests visible to whichever thread
+// finishes the directory.
+static void complete_directory(MerkleTree *tree, uint32_t dir) {
+    for (;;) {
+        hash_directory(tree, dir);
+        uint32_t parent = tree->fl->dirs[dir].parent;
+        if (parent == FILE_LIST_NO_PARENT ||
+            __atomic_sub_fetch(&tree->pending[parent], 1, __ATOMIC_ACQ_REL) != 0) {
+            return;
+        }
+        dir = parent;
+    }
+}
+
+// Groups the children of every directory and sorts them by name. Empty
+// directories are hashed straight away.
+void merkle_init(MerkleTree *tree, const FileList *fl, const DigestAlgorithm *alg, const uint8_t *file_digests) {
+    size_t dirs = fl->dir_count;
+    tree->fl = fl;
+    tree->alg = alg;
+    tree->file_digests = file_digests;
+    tree->dir_digests = (uint8_t *)alloc_array(dirs, alg->size, "Failed to allocate directory hashes");
+    digest_buffer(alg, NULL, 0, tree->empty);
+    tree->pending = (uint32_t *)alloc_array(dirs, sizeof(uint32_t), "Failed to allocate directory counters");
+    tree->child_start = (size_t *)alloc_array(dirs + 1, sizeof(size_t), "Failed to allocate child index");
+    tree->children = (uint64_t *)alloc_array(fl->size + dirs, sizeof(uint64_t), "Failed to allocate child list");
+
+    for (size_t i = 0; i < fl->size; ++i) {
+        tree->pending[fl->entries[i].parent]++;
+    }
+    for (size_t d = 0; d < dirs; ++d) {
+        if (fl->dirs[d].parent != FILE_LIST_NO_PARENT) {
+            tree->pending[fl->dirs[d].parent]++;
+        }
+    }
+    for (size_t d = 0; d < dirs; ++d) {
+        tree->child_start[d + 1] = tree->child_start[d] + tree->pending[d];
+    }
+
+    size_t *fill = (size_t *)alloc_array(dirs, sizeof(size_t), "Failed to allocate child index");
+    memcpy(fill, tree->child_start, dirs * sizeof(size_t));
+    for (size_t i = 0; i < fl->size; ++i) {
+        tree->children[fill[fl->entries[i].parent]++] = i;
+    }
+    for (size_t d = 0; d < dirs; ++d) {
+        if (fl->dirs[d].parent != FILE_LIST_NO_PARENT) {
+            tree->children[fill[fl->dirs[d].parent]++] = MERKLE_CHILD_DIR | d;
+        }
+    }
+    free(fill);
+
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (size_t d = 0; d < dirs; ++d) {
+        size_t n = tree->child_start[d + 1] - tree->child_start[d];
+        if (n > 1) {
+            qsort_r(tree->children + tree->child_start[d], n, sizeof(uint64_t), compare_children, (void *)fl);
+        }
+    }
+
+    for (size_t d = 0; d < dirs; ++d) {
+        if (tree->child_start[d + 1] == tree->child_start[d]) {
+            complete_directory(tree, (uint32_t)d);
+        }
+    }
+}
+
+// Records that the digest of file index is final. Safe to call from any thread,
+// once per file.
+void merkle_file_done(MerkleTree *tree, size_t index) {
+    uint32_t parent = tree->fl->entries[index].parent;
+    if (__atomic_sub_fetch(&tree->pending[parent], 1, __ATOMIC_ACQ_REL) == 0) {
+        complete_directory(tree, parent);
+    }
+}
+
+// The root is directory 0, the first one the traversal allocates.
+const uint8_t *merkle_root(const MerkleTree *tree) {
+    return tree->fl->dir_count ? tree->dir_digests : tree->empty;
+}
+
+const uint8_t *merkle_dir_digest(const MerkleTree *tree, uint32_t dir) {
+    return tree->dir_digests + (size_t)dir * tree->alg->size;
+}
+
+void merkle_free(MerkleTree *tree) {
+    free(tree->dir_digests);
+    free(tree->pending);
+    free(tree->child_start);
+    free(tree->children);
+}
@@ -0,0 +1,36 @@
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "file_list.h"
+#include "digest.h"
+
+#define MERKLE_CHILD_DIR (1ULL << 63)
+
+// Directory digests built bottom-up over a FileList. Each directory hashes
+// its children, sorted by name, as (type, name, digest) records, so the
+// root depends only on the tree and never on how the work was scheduled.
+// Children are stored per directory in children[child_start[d] ..
+// child_start[d + 1]), as file indices or MERKLE_CHILD_DIR | dir index.
+// Digests are alg->size bytes each, indexed by file or directory.
+typedef struct {
+    const FileList *fl;
+    const DigestAlgorithm *alg;
+    const uint8_t *file_digests;
+    uint8_t *dir_digests;
+    uint8_t empty[DIGEST_MAX_SIZE];
+    uint32_t *pending;
+    size_t *child_start;
+    uint64_t *children;
+} MerkleTree;
+
+void merkle_hash_child(const DigestAlgorithm *alg, DigestState *state, int dir, const char *name,
+                       const uint8_t *digest);
+void merkle_init(MerkleTree *tree, const FileList *fl, const DigestAlgorithm *alg, const uint8_t *file_digests);
+void merkle_file_done(MerkleTree *tree, size_t index);
+const uint8_t *merkle_root(const MerkleTree *tree);
+const uint8_t *merkle_dir_digest(const MerkleTree *tree, uint32_t dir);
+void merkle_free(MerkleTree *tree);
+
+#endif
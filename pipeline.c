@@ -0,0 +1,323 @@
+#define _GNU_SOURCE
+
+#include "pipeline.h"
+#include "constants.h"
+#include "directory_traversal.h"
+#include "hashing.h"
+#include "merkle.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <omp.h>
+
+// One child of a directory, filled in as its digest becomes known. The
+// names of files point into the directory's file list; those of
+// subdirectories are owned by the record.
+typedef struct {
+    const char *name;
+    int dir;
+    uint8_t digest[DIGEST_MAX_SIZE];
+} PipelineRecord;
+
+// A directory that has been read but not yet hashed. pending counts the
+// files and subdirectories still without a digest, and whoever brings it
+// to zero hashes the directory into a record of its parent. fd is a copy
+// of the walk's descriptor for the directory, closed once files_left of
+// its files have been hashed.
+typedef struct PipelineDir {
+    struct PipelineDir *parent;
+    char *name;
+    FileList *files;
+    int fd;
+    size_t files_left;
+    size_t pending;
+    size_t filled;
+    PipelineRecord *records;
+} PipelineDir;
+
+// Files [begin, begin + count) of a directory.
+typedef struct {
+    PipelineDir *dir;
+    size_t begin;
+    size_t count;
+} PipelineJob;
+
+// Bounded multi-producer, multi-consumer ring of jobs. Each cell carries a
+// sequence number saying whether it is waiting for a push or a pop at a
+// given position, so producers and consumers only contend on their own
+// index and never take a lock.
+typedef struct {
+    size_t seq;
+    PipelineJob job;
+} PipelineCell;
+
+typedef struct {
+    PipelineCell *cells;
+    size_t mask;
+    size_t head __attribute__((aligned(64)));
+    size_t tail __attribute__((aligned(64)));
+    int closed __attribute__((aligned(64)));
+} PipelineQueue;
+
+// dir_fds counts the descriptors held by directories, which stays below
+// dir_fd_budget so that the walk and the engines keep theirs.
+typedef struct {
+    PipelineQueue queue;
+    const DigestAlgorithm *alg;
+    dirhash_file_cb callback;
+    void *callback_arg;
+    uint8_t *root;
+    size_t files;
+    size_t dir_fds;
+    size_t dir_fd_budget;
+} Pipeline;
+
+static void queue_init(PipelineQueue *q, size_t capacity) {
+    q->cells = (PipelineCell *)malloc(capacity * sizeof(PipelineCell));
+    if (!q->cells) {
+        perror("Failed to allocate pipeline queue");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < capacity; ++i) {
+        q->cells[i].seq = i;
+    }
+    q->mask = capacity - 1;
+    q->head = 0;
+    q->tail = 0;
+    q->closed = 0;
+}
+
+static int queue_try_push(PipelineQueue *q, const PipelineJob *job) {
+    size_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    for (;;) {
+        PipelineCell *cell = &q->cells[pos & q->mask];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                cell->job = *job;
+                __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+                return 1;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static int queue_try_pop(PipelineQueue *q, PipelineJob *job) {
+    size_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    for (;;) {
+        PipelineCell *cell = &q->cells[pos & q->mask];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *job = cell->job;
+                __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+                return 1;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Blocks while the queue is full, which holds the walk back when hashing
+// falls behind.
+static void queue_push(PipelineQueue *q, const PipelineJob *job) {
+    while (!queue_try_push(q, job)) {
+        sched_yield();
+    }
+}
+
+// Blocks until a job is available. Returns 0 once the queue is closed and
+// drained.
+static int queue_pop(PipelineQueue *q, PipelineJob *job) {
+    for (;;) {
+        if (queue_try_pop(q, job)) {
+            return 1;
+        }
+        if (__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE)) {
+            return queue_try_pop(q, job);
+        }
+        sched_yield();
+    }
+}
+
+static int compare_records(const void *a, const void *b) {
+    return strcmp(((const PipelineRecord *)a)->name, ((const PipelineRecord *)b)->name);
+}
+
+// Called once every child of dir has its digest. Hashes dir into a record
+// of its parent, or into the root digest, and walks up through every
+// ancestor that this completes in turn. Records are filled in completion
+// order and only sorted here, which gives the same digests as --merkle
+// whatever order the walk and the workers ran in.
+static void complete_dir(Pipeline *p, PipelineDir *dir) {
+    const DigestAlgorithm *alg = p->alg;
+    for (;;) {
+        PipelineDir *parent = dir->parent;
+        uint8_t *out = p->root;
+        if (parent) {
+            PipelineRecord *record = &parent->records[__atomic_fetch_add(&parent->filled, 1, __ATOMIC_RELAXED)];
+            record->name = dir->name;
+            record->dir = 1;
+            out = record->digest;
+        }
+
+        qsort(dir->records, dir->filled, sizeof(PipelineRecord), compare_records);
+        DigestState state;
+        alg->init(&state);
+        for (size_t i = 0; i < dir->filled; ++i) {
+            const PipelineRecord *record = &dir->records[i];
+            merkle_hash_child(alg, &state, record->dir, record->name, record->digest);
+            if (record->dir) {
+                free((char *)record->name);
+            }
+        }
+        alg->final(&state, out);
+
+        if (!parent) {
+            free(dir->name);
+        }
+        free(dir->records);
+        file_list_free(dir->files);
+        free(dir);
+        if (!parent || __atomic_sub_fetch(&parent->pending, 1, __ATOMIC_ACQ_REL) != 0) {
+            return;
+        }
+        dir = parent;
+    }
+}
+
+// Takes over a directory from the walk and queues its files in jobs of up
+// to QUEUE_DEPTH, one engine's worth of requests. The directory's
+// descriptor is duplicated for the workers while the budget allows; without
+// one they open the directory by path instead.
+static void *visit_dir(void *arg, void *parent, const char *name, FileList *files, size_t subdirs, int fd) {
+    Pipeline *p = (Pipeline *)arg;
+    PipelineDir *dir = (PipelineDir *)malloc(sizeof(PipelineDir));
+    char *dir_name = strdup(name);
+    size_t children = files->size + subdirs;
+    PipelineRecord *records = (PipelineRecord *)malloc((children ? children : 1) * sizeof(PipelineRecord));
+    if (!dir || !dir_name || !records) {
+        perror("Failed to allocate pipeline directory");
+        exit(EXIT_FAILURE);
+    }
+    dir->parent = (PipelineDir *)parent;
+    dir->name = dir_name;
+    dir->files = files;
+    dir->fd = -1;
+    if (files->size && fd >= 0) {
+        if (__atomic_add_fetch(&p->dir_fds, 1, __ATOMIC_RELAXED) <= p->dir_fd_budget) {
+            dir->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        }
+        if (dir->fd < 0) {
+            __atomic_fetch_sub(&p->dir_fds, 1, __ATOMIC_RELAXED);
+        }
+    }
+    dir->files_left = files->size;
+    dir->pending = children;
+    dir->filled = 0;
+    dir->records = records;
+    __atomic_fetch_add(&p->files, files->size, __ATOMIC_RELAXED);
+
+    if (children == 0) {
+        complete_dir(p, dir);
+        return NULL;
+    }
+    // Once the last job is queued the directory may be completed and freed
+    // by a worker, unless it has subdirectories, which hold it until they
+    // are done themselves.
+    size_t count = files->size;
+    for (size_t begin = 0; begin < count; begin += QUEUE_DEPTH) {
+        PipelineJob job = { dir, begin, count - begin < QUEUE_DEPTH ? count - begin : QUEUE_DEPTH };
+        queue_push(&p->queue, &job);
+    }
+    return dir;
+}
+
+static void hash_jobs(Pipeline *p, HashEngine *engine) {
+    const DigestAlgorithm *alg = p->alg;
+    uint8_t digests[QUEUE_DEPTH * DIGEST_MAX_SIZE];
+    char *path = NULL;
+    size_t path_capacity = 0;
+    PipelineJob job;
+    while (queue_pop(&p->queue, &job)) {
+        PipelineDir *dir = job.dir;
+        hash_engine_hash_dir(engine, dir->files, dir->fd, job.begin, job.count, digests);
+        for (size_t j = 0; j < job.count; ++j) {
+            const FileEntry *entry = &dir->files->entries[job.begin + j];
+            PipelineRecord *record = &dir->records[__atomic_fetch_add(&dir->filled, 1, __ATOMIC_RELAXED)];
+            record->name = file_list_name(dir->files, entry->name);
+            record->dir = 0;
+            memcpy(record->digest, digests + j * alg->size, alg->size);
+            if (p->callback) {
+                p->callback(p->callback_arg, file_list_path_buf(dir->files, job.begin + j, &path, &path_capacity),
+                            entry->size, record->digest, alg->size);
+            }
+        }
+        if (__atomic_sub_fetch(&dir->files_left, job.count, __ATOMIC_ACQ_REL) == 0 && dir->fd >= 0) {
+            close(dir->fd);
+            __atomic_fetch_sub(&p->dir_fds, 1, __ATOMIC_RELAXED);
+        }
+        if (__atomic_sub_fetch(&dir->pending, job.count, __ATOMIC_ACQ_REL) == 0) {
+            complete_dir(p, dir);
+        }
+    }
+    free(path);
+}
+
+// Walks the tree at path and hashes its files at the same time, without
+// ever building the whole file list. The walk hands each directory's files
+// to a bounded queue as soon as the directory has been read, and
+// num_threads hashing workers drain it from the start. Directory digests
+// are put together bottom-up as their children complete, so root receives
+// the same digest as --merkle gives. Worker n hashes with engines[n] and
+// passes each file to callback, if there is one. Returns the number of
+// files hashed; walk_time is set to the time the walk took.
+size_t pipeline_hash(const char *path, size_t num_threads, HashEngine *engines, dirhash_file_cb callback,
+                     void *callback_arg, uint8_t *root, double *walk_time) {
+    Pipeline p;
+    queue_init(&p.queue, PIPELINE_QUEUE_SIZE);
+    p.alg = engines->settings->digest;
+    p.callback = callback;
+    p.callback_arg = callback_arg;
+    p.root = root;
+    p.files = 0;
+    p.dir_fds = 0;
+    struct rlimit rl;
+    size_t fd_limit = getrlimit(RLIMIT_NOFILE, &rl) == 0 ? (size_t)rl.rlim_cur : 1024;
+    p.dir_fd_budget = fd_limit / 8 < PIPELINE_QUEUE_SIZE ? fd_limit / 8 : PIPELINE_QUEUE_SIZE;
+
+    // The walk runs its own parallel region inside this one.
+    omp_set_max_active_levels(2);
+    #pragma omp parallel num_threads(num_threads + 1)
+    {
+        if (omp_get_thread_num() == 0) {
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            FileList *dirs = file_list_init(1);
+            traverse_directory_visit(path, dirs, num_threads, visit_dir, &p);
+            file_list_free(dirs);
+            __atomic_store_n(&p.queue.closed, 1, __ATOMIC_RELEASE);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            *walk_time = (end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+        } else {
+            hash_jobs(&p, &engines[omp_get_thread_num() - 1]);
+        }
+    }
+
+    free(p.queue.cells);
+    return p.files;
+}
@@ -0,0 +1,12 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "dirhash.h"
+#include "hashing.h"
+
+size_t pipeline_hash(const char *path, size_t num_threads, HashEngine *engines, dirhash_file_cb callback,
+                     void *callback_arg, uint8_t *root, double *walk_time);
+
+#endif
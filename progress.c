@@ -1,8 +1,12 @@
 #include "progress.h"
 #include "constants.h" 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
 
+#define PROGRESS_BAR_WIDTH 50
+
 void format_time(double total_seconds, int *hours, int *minutes, int *seconds, int *milliseconds) {
     *hours = (int)(total_seconds / 3600);
     *minutes = (int)((total_seconds - (*hours * 3600)) / 60);
@@ -10,22 +14,109 @@ void format_time(double total_seconds, int *hours, int *minutes, int *seconds, i
     *milliseconds = (int)((total_seconds - (int)total_seconds) * 1000);
 }
 
-void display_progress(size_t completed, size_t total, double elapsed_time, double start_time) {
-    int bar_width = 50;
-    double progress = (double)completed / total;
-    int filled = (int)(progress * bar_width);
-    int remaining = bar_width - filled;
+static double seconds_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
 
-    double current_rate = completed / (elapsed_time - start_time);
-    double eta = (current_rate > 0) ? (double)(total - completed) / current_rate : 0;
+// Draws the progress line from the workers' counters with a single write.
+// The ETA assumes the remaining bytes go at the average rate so far, which
+// unlike a file count is not thrown off by a mix of file sizes. A line
+// shorter than the one before is padded to cover it.
+static void render(Progress *progress) {
+    uint64_t files = 0, bytes = 0;
+    for (size_t i = 0; i < progress->workers; ++i) {
+        files += __atomic_load_n(&progress->counters[i].files, __ATOMIC_RELAXED);
+        bytes += __atomic_load_n(&progress->counters[i].bytes, __ATOMIC_RELAXED);
+    }
+    double elapsed = seconds_since(&progress->start);
+    double fraction = progress->total_bytes ? (double)bytes / progress->total_bytes
+                      : progress->total_files ? (double)files / progress->total_files : 1.0;
+    double byte_rate = elapsed > 0 ? bytes / elapsed : 0;
+    double file_rate = elapsed > 0 ? files / elapsed : 0;
+    double eta = 0;
+    if (progress->total_bytes && byte_rate > 0) {
+        eta = (progress->total_bytes - bytes) / byte_rate;
+    } else if (!progress->total_bytes && file_rate > 0) {
+        eta = (progress->total_files - files) / file_rate;
+    }
+    int hours, minutes, seconds, milliseconds;
+    format_time(eta, &hours, &minutes, &seconds, &milliseconds);
 
-    int eta_hours, eta_minutes, eta_seconds, eta_milliseconds;
-    format_time(eta, &eta_hours, &eta_minutes, &eta_seconds, &eta_milliseconds);
+    char line[256];
+    int filled = (int)(fraction * PROGRESS_BAR_WIDTH);
+    line[0] = '\r';
+    line[1] = '[';
+    memset(line + 2, '=', filled);
+    memset(line + 2 + filled, ' ', PROGRESS_BAR_WIDTH - filled);
+    size_t len = 2 + PROGRESS_BAR_WIDTH;
+    len += snprintf(line + len, sizeof(line) - len, "] %lu/%lu files %.1f MB/s %.0f files/s ETA: %02d:%02d:%02d.%03d",
+                    (unsigned long)files, (unsigned long)progress->total_files, byte_rate / 1e6, file_rate,
+                    hours, minutes, seconds, milliseconds);
+    if (len > sizeof(line) - 1) {
+        len = sizeof(line) - 1;
+    }
+    size_t drawn = len;
+    while (len < progress->last_len && len < sizeof(line) - 1) {
+        line[len++] = ' ';
+    }
+    progress->last_len = drawn;
+    fwrite(line, 1, len, stdout);
+    fflush(stdout);
+}
 
-    printf("\r[");
-    for (int i = 0; i < filled; i++) printf("=");
-    for (int i = 0; i < remaining; i++) printf(" ");
-    printf("] %zu/%zu ETA: %02d:%02d:%02d.%03d", completed, total, eta_hours, eta_minutes, eta_seconds, eta_milliseconds);
+static void *report(void *arg) {
+    Progress *progress = (Progress *)arg;
+    pthread_mutex_lock(&progress->lock);
+    while (!progress->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += PROGRESS_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&progress->wake, &progress->lock, &deadline);
+        if (!progress->stop) {
+            render(progress);
+        }
+    }
+    pthread_mutex_unlock(&progress->lock);
+    return NULL;
+}
+
+// Starts reporting the progress of workers hashing total_files files of
+// total_bytes bytes in all. Worker i reports through progress_add(i).
+void progress_start(Progress *progress, size_t workers, uint64_t total_files, uint64_t total_bytes) {
+    progress->workers = workers;
+    progress->total_files = total_files;
+    progress->total_bytes = total_bytes;
+    progress->stop = 0;
+    progress->last_len = 0;
+    progress->counters = (ProgressCounter *)aligned_alloc(64, (workers ? workers : 1) * sizeof(ProgressCounter));
+    if (!progress->counters) {
+        perror("Failed to allocate progress counters");
+        exit(EXIT_FAILURE);
+    }
+    memset(progress->counters, 0, (workers ? workers : 1) * sizeof(ProgressCounter));
+    clock_gettime(CLOCK_MONOTONIC, &progress->start);
+    pthread_mutex_init(&progress->lock, NULL);
+    pthread_cond_init(&progress->wake, NULL);
     fflush(stdout);
+    if (pthread_create(&progress->thread, NULL, report, progress) != 0) {
+        perror("Failed to start progress reporter");
+        exit(EXIT_FAILURE);
+    }
 }
 
+// Stops the reporter once the workers are done and draws the final line.
+void progress_stop(Progress *progress) {
+    pthread_mutex_lock(&progress->lock);
+    progress->stop = 1;
+    pthread_cond_signal(&progress->wake);
+    pthread_mutex_unlock(&progress->lock);
+    pthread_join(progress->thread, NULL);
+    render(progress);
+    pthread_cond_destroy(&progress->wake);
+    pthread_mutex_destroy(&progress->lock);
+    free(progress->counters);
+}
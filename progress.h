@@ -2,9 +2,41 @@
 #define PROGRESS_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+// Files and bytes hashed by one worker. Only that worker writes it, so
+// updates are plain relaxed stores, and each counter has a cache line of
+// its own so that workers never share one.
+typedef struct {
+    uint64_t files;
+    uint64_t bytes;
+} __attribute__((aligned(64))) ProgressCounter;
+
+// Progress of the hashing stage, drawn by a reporter thread of its own
+// every PROGRESS_INTERVAL_MS. The workers only ever touch their counter.
+typedef struct {
+    ProgressCounter *counters;
+    size_t workers;
+    uint64_t total_files;
+    uint64_t total_bytes;
+    struct timespec start;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int stop;
+    size_t last_len;
+} Progress;
 
 void format_time(double total_seconds, int *hours, int *minutes, int *seconds, int *milliseconds);
-void display_progress(size_t completed, size_t total, double elapsed_time, double start_time);
+void progress_start(Progress *progress, size_t workers, uint64_t total_files, uint64_t total_bytes);
+void progress_stop(Progress *progress);
 
-#endif
+static inline void progress_add(Progress *progress, size_t worker, uint64_t files, uint64_t bytes) {
+    ProgressCounter *counter = &progress->counters[worker];
+    __atomic_store_n(&counter->files, counter->files + files, __ATOMIC_RELAXED);
+    __atomic_store_n(&counter->bytes, counter->bytes + bytes, __ATOMIC_RELAXED);
+}
 
+#endif
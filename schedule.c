@@ -0,0 +1,109 @@
+#define _GNU_SOURCE
+
+#include "schedule.h"
+#include "dirfd_cache.h"
+#include "constants.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <omp.h>
+
+// Files are ordered by device, then by the physical offset of their first
+// extent. Files whose extents cannot be mapped (no FIEMAP support, inline
+// data, holes) sort after them by inode number, which most filesystems
+// allocate roughly in on-disk order.
+typedef struct {
+    uint64_t dev;
+    uint64_t mapped;
+    uint64_t key;
+    size_t index;
+} PhysicalKey;
+
+static int compare_keys(const void *a, const void *b) {
+    const PhysicalKey *ka = (const PhysicalKey *)a;
+    const PhysicalKey *kb = (const PhysicalKey *)b;
+    if (ka->dev != kb->dev) {
+        return ka->dev < kb->dev ? -1 : 1;
+    }
+    if (ka->mapped != kb->mapped) {
+        return ka->mapped ? -1 : 1;
+    }
+    if (ka->key != kb->key) {
+        return ka->key < kb->key ? -1 : 1;
+    }
+    return ka->index < kb->index ? -1 : ka->index > kb->index;
+}
+
+// Returns the physical byte offset of the first extent of the file, or -1.
+static int64_t first_extent(int dirfd, const char *name) {
+    int fd = open_at_noatime(dirfd, name, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    union {
+        struct fiemap map;
+        char buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+    } req;
+    memset(&req, 0, sizeof(req));
+    req.map.fm_start = 0;
+    req.map.fm_length = FIEMAP_MAX_OFFSET;
+    req.map.fm_extent_count = 1;
+    int64_t physical = -1;
+    if (ioctl(fd, FS_IOC_FIEMAP, &req.map) == 0 && req.map.fm_mapped_extents > 0 &&
+        !(req.map.fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE))) {
+        physical = (int64_t)req.map.fm_extents[0].fe_physical;
+    }
+    close(fd);
+    return physical;
+}
+
+// Returns a permutation of the indices of fl in which files are read in
+// physical order, so that rotational disks sweep instead of seeking. Only
+// the read order changes; digests are still combined in list order.
+size_t *schedule_physical_order(const FileList *fl, size_t num_threads) {
+    PhysicalKey *keys = (PhysicalKey *)malloc((fl->size ? fl->size : 1) * sizeof(PhysicalKey));
+    size_t *order = (size_t *)malloc((fl->size ? fl->size : 1) * sizeof(size_t));
+    if (!keys || !order) {
+        perror("Failed to allocate read schedule");
+        exit(EXIT_FAILURE);
+    }
+
+    #pragma omp parallel num_threads(num_threads)
+    {
+        DirFdCache dirs;
+        dirfd_cache_init(&dirs, fl, DIRFD_CACHE_SIZE);
+
+        #pragma omp for schedule(dynamic, 256)
+        for (size_t i = 0; i < fl->size; ++i) {
+            const FileEntry *entry = &fl->entries[i];
+            int64_t physical = -1;
+            if (entry->size > 0) {
+                int owned;
+                int dirfd = dirfd_cache_get(&dirs, entry->parent, &owned);
+                if (dirfd >= 0) {
+                    physical = first_extent(dirfd, fl->names + entry->name);
+                    dirfd_cache_put(&dirs, dirfd, owned);
+                }
+            }
+            keys[i].dev = entry->dev;
+            keys[i].mapped = physical >= 0;
+            keys[i].key = physical >= 0 ? (uint64_t)physical : entry->ino;
+            keys[i].index = i;
+        }
+
+        dirfd_cache_destroy(&dirs);
+    }
+
+    qsort(keys, fl->size, sizeof(PhysicalKey), compare_keys);
+    for (size_t i = 0; i < fl->size; ++i) {
+        order[i] = keys[i].index;
+    }
+    free(keys);
+    return order;
+}
@@ -0,0 +1,9 @@
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#include <stddef.h>
+#include "file_list.h"
+
+size_t *schedule_physical_order(const FileList *fl, size_t num_threads);
+
+#endif
@@ -0,0 +1,182 @@
+#include "sha256.h"
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void compress_generic(uint32_t h[8], const uint8_t *data, size_t blocks) {
+    for (; blocks > 0; --blocks, data += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = (uint32_t)data[4 * i] << 24 | (uint32_t)data[4 * i + 1] << 16 |
+                   (uint32_t)data[4 * i + 2] << 8 | data[4 * i + 3];
+        }
+        for (int i = 16; i < 64; ++i) {
+            uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t t1 = k + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+            uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            k = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+        h[5] += f;
+        h[6] += g;
+        h[7] += k;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// The SHA extensions keep the state as ABEF/CDGH pairs and run four rounds
+// per sha256rnds2 pair, with sha256msg1/msg2 producing the schedule.
+__attribute__((target("sha,sse4.1")))
+static void compress_shani(uint32_t h[8], const uint8_t *data, size_t blocks) {
+    const __m128i shuffle = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_loadu_si128((const __m128i *)&h[0]);
+    __m128i state1 = _mm_loadu_si128((const __m128i *)&h[4]);
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);
+    state1 = _mm_shuffle_epi32(state1, 0x1B);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    for (; blocks > 0; --blocks, data += 64) {
+        __m128i abef = state0;
+        __m128i cdgh = state1;
+        __m128i msgs[4];
+        for (int i = 0; i < 4; ++i) {
+            msgs[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * i)), shuffle);
+        }
+        for (int i = 0; i < 16; ++i) {
+            __m128i msg = _mm_add_epi32(msgs[i & 3], _mm_loadu_si128((const __m128i *)&K[4 * i]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            msg = _mm_shuffle_epi32(msg, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+            if (i < 12) {
+                // W[16..] for the group four ahead.
+                __m128i next = _mm_sha256msg1_epu32(msgs[i & 3], msgs[(i + 1) & 3]);
+                next = _mm_add_epi32(next, _mm_alignr_epi8(msgs[(i + 3) & 3], msgs[(i + 2) & 3], 4));
+                msgs[i & 3] = _mm_sha256msg2_epu32(next, msgs[(i + 3) & 3]);
+            }
+        }
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128((__m128i *)&h[0], state0);
+    _mm_storeu_si128((__m128i *)&h[4], state1);
+}
+
+static int has_sha_ni(void) {
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) || !(ebx & (1U << 29))) {
+        return 0;
+    }
+    return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_1) && (ecx & bit_SSSE3);
+}
+#endif
+
+typedef void (*CompressFn)(uint32_t h[8], const uint8_t *data, size_t blocks);
+
+// Picks the SHA-NI kernel once, on first use, if the CPU has it.
+static CompressFn resolve_compress(void) {
+    static CompressFn compress = NULL;
+    CompressFn fn = __atomic_load_n(&compress, __ATOMIC_RELAXED);
+    if (!fn) {
+        fn = compress_generic;
+#if defined(__x86_64__) || defined(__i386__)
+        if (has_sha_ni()) {
+            fn = compress_shani;
+        }
+#endif
+        __atomic_store_n(&compress, fn, __ATOMIC_RELAXED);
+    }
+    return fn;
+}
+
+void sha256_init(Sha256State *state) {
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(state->h, iv, sizeof(iv));
+    state->buf_len = 0;
+    state->total = 0;
+}
+
+void sha256_update(Sha256State *state, const void *data, size_t len) {
+    CompressFn compress = resolve_compress();
+    const uint8_t *p = (const uint8_t *)data;
+    state->total += len;
+    if (state->buf_len > 0) {
+        size_t take = 64 - state->buf_len < len ? 64 - state->buf_len : len;
+        memcpy(state->buf + state->buf_len, p, take);
+        state->buf_len += take;
+        p += take;
+        len -= take;
+        if (state->buf_len < 64) {
+            return;
+        }
+        compress(state->h, state->buf, 1);
+        state->buf_len = 0;
+    }
+    if (len >= 64) {
+        compress(state->h, p, len / 64);
+        p += len & ~(size_t)63;
+        len &= 63;
+    }
+    memcpy(state->buf, p, len);
+    state->buf_len = len;
+}
+
+void sha256_final(Sha256State *state, uint8_t out[SHA256_DIGEST_SIZE]) {
+    CompressFn compress = resolve_compress();
+    uint64_t bits = state->total * 8;
+    state->buf[state->buf_len++] = 0x80;
+    if (state->buf_len > 56) {
+        memset(state->buf + state->buf_len, 0, 64 - state->buf_len);
+        compress(state->h, state->buf, 1);
+        state->buf_len = 0;
+    }
+    memset(state->buf + state->buf_len, 0, 56 - state->buf_len);
+    for (int i = 0; i < 8; ++i) {
+        state->buf[56 + i] = (uint8_t)(bits >> (56 - 8 * i));
+    }
+    compress(state->h, state->buf, 1);
+    for (int i = 0; i < 8; ++i) {
+        out[4 * i] = (uint8_t)(state->h[i] >> 24);
+        out[4 * i + 1] = (uint8_t)(state->h[i] >> 16);
+        out[4 * i + 2] = (uint8_t)(state->h[i] >> 8);
+        out[4 * i + 3] = (uint8_t)state->h[i];
+    }
+}
@@ -0,0 +1,20 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE 32
+
+typedef struct {
+    uint32_t h[8];
+    uint8_t buf[64];
+    size_t buf_len;
+    uint64_t total;
+} Sha256State;
+
+void sha256_init(Sha256State *state);
+void sha256_update(Sha256State *state, const void *data, size_t len);
+void sha256_final(Sha256State *state, uint8_t out[SHA256_DIGEST_SIZE]);
+
+#endif
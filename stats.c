@@ -0,0 +1,187 @@
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+// Every thread that records anything gets its own shard, padded to whole
+// cache lines and written without atomics. Shards are chained into a list
+// when created and only read, and merged, by stats_write_json() once the
+// workers are done.
+typedef struct StatsShard {
+    uint64_t counters[STAT_COUNTER_COUNT];
+    uint64_t histograms[STAT_HISTOGRAM_COUNT][STATS_BUCKETS];
+    uint64_t max[STAT_HISTOGRAM_COUNT];
+    uint64_t total[STAT_HISTOGRAM_COUNT];
+    struct StatsShard *next;
+} __attribute__((aligned(64))) StatsShard;
+
+static const char *const counter_names[STAT_COUNTER_COUNT] = {
+    "dirs_visited", "dir_entries", "dir_reopens", "stat_calls", "stat_fallbacks", "stat_failures",
+    "files_opened", "linked_opens", "open_failures", "cache_hits", "read_ops", "bytes_read",
+    "short_reads", "read_failures", "direct_fallbacks", "mapped_files",
+    "map_truncations", "bytes_hashed", "bloom_checks", "bloom_hits",
+    "traversal_idle_ns", "io_wait_ns", "combine_ns",
+};
+
+static const char *const histogram_names[STAT_HISTOGRAM_COUNT] = {
+    "open_latency_ns", "read_latency_ns", "hash_latency_ns",
+};
+
+static int enabled = 0;
+static StatsShard *shards = NULL;
+static size_t shard_count = 0;
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread StatsShard *local = NULL;
+
+// Collection is off unless enabled before the workers start, and costs a
+// branch per call while off.
+void stats_enable(void) {
+    enabled = 1;
+}
+
+int stats_enabled(void) {
+    return enabled;
+}
+
+static StatsShard *local_shard(void) {
+    if (!local) {
+        StatsShard *shard = (StatsShard *)aligned_alloc(64, sizeof(StatsShard));
+        if (!shard) {
+            perror("Failed to allocate statistics");
+            exit(EXIT_FAILURE);
+        }
+        memset(shard, 0, sizeof(*shard));
+        pthread_mutex_lock(&shards_lock);
+        shard->next = shards;
+        shards = shard;
+        shard_count++;
+        pthread_mutex_unlock(&shards_lock);
+        local = shard;
+    }
+    return local;
+}
+
+// Monotonic time in nanoseconds, or 0 while collection is off.
+uint64_t stats_now(void) {
+    if (!enabled) {
+        return 0;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void stats_add(StatCounter counter, uint64_t n) {
+    if (enabled) {
+        local_shard()->counters[counter] += n;
+    }
+}
+
+static size_t bucket_of(uint64_t value) {
+    if (value < (1U << STATS_SUB_BUCKET_BITS)) {
+        return (size_t)value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    uint64_t sub = (value >> (msb - STATS_SUB_BUCKET_BITS)) & ((1U << STATS_SUB_BUCKET_BITS) - 1);
+    return ((size_t)(msb - STATS_SUB_BUCKET_BITS + 1) << STATS_SUB_BUCKET_BITS) + sub;
+}
+
+// The largest value that falls in bucket.
+static uint64_t bucket_limit(size_t bucket) {
+    if (bucket < (1U << STATS_SUB_BUCKET_BITS)) {
+        return bucket;
+    }
+    int shift = (int)(bucket >> STATS_SUB_BUCKET_BITS) - 1;
+    uint64_t sub = bucket & ((1U << STATS_SUB_BUCKET_BITS) - 1);
+    uint64_t low = ((1ULL << STATS_SUB_BUCKET_BITS) + sub) << shift;
+    return low + ((1ULL << shift) - 1);
+}
+
+// Records the time elapsed since start, a value from stats_now().
+void stats_record(StatHistogram histogram, uint64_t start) {
+    if (!enabled) {
+        return;
+    }
+    uint64_t elapsed = stats_now() - start;
+    StatsShard *shard = local_shard();
+    shard->histograms[histogram][bucket_of(elapsed)]++;
+    shard->total[histogram] += elapsed;
+    if (elapsed > shard->max[histogram]) {
+        shard->max[histogram] = elapsed;
+    }
+}
+
+// The bucket limit is capped by the largest value actually recorded.
+static uint64_t percentile(const uint64_t *buckets, uint64_t count, uint64_t max, double p) {
+    uint64_t rank = (uint64_t)(count * p);
+    uint64_t seen = 0;
+    for (size_t b = 0; b < STATS_BUCKETS; ++b) {
+        seen += buckets[b];
+        if (seen > rank) {
+            return bucket_limit(b) < max ? bucket_limit(b) : max;
+        }
+    }
+    return 0;
+}
+
+// Writes the merged counters and histograms, then each thread's idle
+// time, as one JSON object. Histograms list only their non-empty buckets,
+// as [largest value, count] pairs.
+void stats_write_json(FILE *out, double traversal_time, double total_time) {
+    StatsShard merged;
+    memset(&merged, 0, sizeof(merged));
+    for (const StatsShard *s = shards; s; s = s->next) {
+        for (int c = 0; c < STAT_COUNTER_COUNT; ++c) {
+            merged.counters[c] += s->counters[c];
+        }
+        for (int h = 0; h < STAT_HISTOGRAM_COUNT; ++h) {
+            for (size_t b = 0; b < STATS_BUCKETS; ++b) {
+                merged.histograms[h][b] += s->histograms[h][b];
+            }
+            merged.total[h] += s->total[h];
+            if (s->max[h] > merged.max[h]) {
+                merged.max[h] = s->max[h];
+            }
+        }
+    }
+
+    fprintf(out, "{\"traversal_s\": %.6f, \"total_s\": %.6f, \"threads\": %zu,\n \"counters\": {",
+            traversal_time, total_time, shard_count);
+    for (int c = 0; c < STAT_COUNTER_COUNT; ++c) {
+        fprintf(out, "%s\"%s\": %lu", c ? ", " : "", counter_names[c], (unsigned long)merged.counters[c]);
+    }
+    fprintf(out, "},\n \"histograms\": {");
+    for (int h = 0; h < STAT_HISTOGRAM_COUNT; ++h) {
+        const uint64_t *buckets = merged.histograms[h];
+        uint64_t count = 0;
+        for (size_t b = 0; b < STATS_BUCKETS; ++b) {
+            count += buckets[b];
+        }
+        fprintf(out, "%s\n  \"%s\": {\"count\": %lu, \"mean\": %.1f, \"p50\": %lu, \"p90\": %lu, "
+                     "\"p99\": %lu, \"p999\": %lu, \"max\": %lu, \"buckets\": [",
+                h ? "," : "", histogram_names[h], (unsigned long)count,
+                count ? (double)merged.total[h] / count : 0.0,
+                (unsigned long)percentile(buckets, count, merged.max[h], 0.5),
+                (unsigned long)percentile(buckets, count, merged.max[h], 0.9),
+                (unsigned long)percentile(buckets, count, merged.max[h], 0.99),
+                (unsigned long)percentile(buckets, count, merged.max[h], 0.999), (unsigned long)merged.max[h]);
+        int first = 1;
+        for (size_t b = 0; b < STATS_BUCKETS; ++b) {
+            if (buckets[b]) {
+                fprintf(out, "%s[%lu, %lu]", first ? "" : ", ", (unsigned long)bucket_limit(b),
+                        (unsigned long)buckets[b]);
+                first = 0;
+            }
+        }
+        fprintf(out, "]}");
+    }
+    fprintf(out, "},\n \"workers\": [");
+    int first = 1;
+    for (const StatsShard *s = shards; s; s = s->next) {
+        fprintf(out, "%s\n  {\"traversal_idle_ns\": %lu, \"io_wait_ns\": %lu}", first ? "" : ",",
+                (unsigned long)s->counters[STAT_TRAVERSAL_IDLE_NS], (unsigned long)s->counters[STAT_IO_WAIT_NS]);
+        first = 0;
+    }
+    fprintf(out, "\n]}\n");
+}
@@ -0,0 +1,53 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Log-scale buckets with eight linear steps per power of two, so a
+// recorded latency is off by at most an eighth.
+#define STATS_SUB_BUCKET_BITS 3
+#define STATS_BUCKETS (64 << STATS_SUB_BUCKET_BITS)
+
+typedef enum {
+    STAT_DIRS_VISITED,
+    STAT_DIR_ENTRIES,
+    STAT_DIR_REOPENS,
+    STAT_STAT_CALLS,
+    STAT_STAT_FALLBACKS,
+    STAT_STAT_FAILURES,
+    STAT_FILES_OPENED,
+    STAT_LINKED_OPENS,
+    STAT_OPEN_FAILURES,
+    STAT_CACHE_HITS,
+    STAT_READ_OPS,
+    STAT_BYTES_READ,
+    STAT_SHORT_READS,
+    STAT_READ_FAILURES,
+    STAT_DIRECT_FALLBACKS,
+    STAT_MAPPED_FILES,
+    STAT_MAP_TRUNCATIONS,
+    STAT_BYTES_HASHED,
+    STAT_BLOOM_CHECKS,
+    STAT_BLOOM_HITS,
+    STAT_TRAVERSAL_IDLE_NS,
+    STAT_IO_WAIT_NS,
+    STAT_COMBINE_NS,
+    STAT_COUNTER_COUNT
+} StatCounter;
+
+typedef enum {
+    STAT_OPEN_LATENCY,
+    STAT_READ_LATENCY,
+    STAT_HASH_LATENCY,
+    STAT_HISTOGRAM_COUNT
+} StatHistogram;
+
+void stats_enable(void);
+int stats_enabled(void);
+uint64_t stats_now(void);
+void stats_add(StatCounter counter, uint64_t n);
+void stats_record(StatHistogram histogram, uint64_t start);
+void stats_write_json(FILE *out, double traversal_time, double total_time);
+
+#endif
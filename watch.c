@@ -0,0 +1,1092 @@
+#define _GNU_SOURCE
+
+#include "watch.h"
+#include "constants.h"
+#include "directory_traversal.h"
+#include "file_list.h"
+#include "merkle.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+#include <sys/fanotify.h>
+#include <omp.h>
+
+enum {
+    ENTRY_CURRENT,
+    ENTRY_HASH
+};
+
+typedef enum {
+    WATCH_FANOTIFY,
+    WATCH_INOTIFY
+} WatchBackend;
+
+// fanotify names a directory by the id of its filesystem and its file
+// handle; this maps those keys back to the directories of the tree.
+typedef struct HandleNode {
+    struct HandleNode *next;
+    WatchDir *dir;
+    size_t len;
+    unsigned char key[];
+} HandleNode;
+
+typedef struct {
+    HandleNode **buckets;
+    size_t mask;
+    size_t count;
+} HandleMap;
+
+#define HANDLE_KEY_SIZE (sizeof(fsid_t) + sizeof(int) + MAX_HANDLE_SZ)
+
+#define STASH_NONE SIZE_MAX
+
+// Every mount the tree reaches into, each with a fanotify mark on its
+// filesystem.
+typedef struct {
+    int mount_id;
+    fsid_t fsid;
+} WatchMount;
+
+typedef struct {
+    WatchDir **items;
+    size_t count;
+    size_t capacity;
+} DirList;
+
+// The stash holds the entries removed since the last flush, with their
+// digests and subtrees, so that a file or directory moved within the tree
+// is not read again. It is chained by (dev, ino) through stash_heads and
+// stash_next, so each lookup only sees entries of its own inode. later lists directories that changed while they
+// were being listed and need another pass.
+typedef struct {
+    const DigestAlgorithm *alg;
+    size_t num_threads;
+    HashEngine *engines;
+    char *root_path;
+    WatchDir *root;
+    WatchBackend backend;
+    int fd;
+    uint32_t mask;
+    WatchDir **wds;
+    size_t wd_capacity;
+    HandleMap handles;
+    WatchMount *mounts;
+    size_t mount_count;
+    size_t mount_capacity;
+    WatchEntry *stash;
+    size_t stash_count;
+    size_t stash_capacity;
+    size_t *stash_next;
+    size_t stash_next_capacity;
+    size_t *stash_heads;
+    size_t stash_mask;
+    DirList later;
+    size_t watch_failures;
+    int pending;
+    uint64_t pending_since;
+    char *path;
+    size_t path_capacity;
+} Watch;
+
+static void *grow(void *array, size_t *capacity, size_t needed, size_t elem_size, const char *what) {
+    if (needed <= *capacity) {
+        return array;
+    }
+    size_t new_capacity = *capacity ? *capacity : 16;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+    array = realloc(array, new_capacity * elem_size);
+    if (!array) {
+        perror(what);
+        exit(EXIT_FAILURE);
+    }
+    *capacity = new_capacity;
+    return array;
+}
+
+static void dir_list_push(DirList *list, WatchDir *dir) {
+    list->items = (WatchDir **)grow(list->items, &list->capacity, list->count + 1, sizeof(WatchDir *),
+                                    "Failed to allocate directory list");
+    list->items[list->count++] = dir;
+}
+
+static uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t timespec_ns(const struct timespec *ts) {
+    return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static void set_pending(Watch *w) {
+    if (!w->pending) {
+        w->pending = 1;
+        w->pending_since = clock_ns(CLOCK_MONOTONIC);
+    }
+}
+
+static WatchDir *new_dir(WatchDir *parent, const char *name) {
+    WatchDir *dir = (WatchDir *)calloc(1, sizeof(WatchDir));
+    if (!dir) {
+        perror("Failed to allocate directory");
+        exit(EXIT_FAILURE);
+    }
+    dir->parent = parent;
+    dir->name = name;
+    dir->wd = -1;
+    dir->dirty = 1;
+    dir->unscanned = 1;
+    return dir;
+}
+
+static void free_tree(WatchDir *dir) {
+    for (size_t i = 0; i < dir->count; ++i) {
+        if (dir->entries[i].dir) {
+            free_tree(dir->entries[i].dir);
+        }
+        free(dir->entries[i].name);
+    }
+    free(dir->entries);
+    free(dir);
+}
+
+// A directory is dirty whenever one of its children is, so marking stops
+// at the first ancestor that already is.
+static void mark_dirty(WatchDir *dir) {
+    for (; dir && !dir->dirty; dir = dir->parent) {
+        dir->dirty = 1;
+    }
+}
+
+// Builds the path of name in dir, or of dir itself without a name, in a
+// buffer that the next call reuses.
+static const char *watch_path(Watch *w, const WatchDir *dir, const char *name) {
+    size_t len = name ? strlen(name) + 1 : 0;
+    for (const WatchDir *d = dir; d; d = d->parent) {
+        len += strlen(d->name) + (d->parent ? 1 : 0);
+    }
+    w->path = (char *)grow(w->path, &w->path_capacity, len + 1, 1, "Failed to allocate path");
+    size_t end = len;
+    w->path[end] = '\0';
+    if (name) {
+        size_t n = strlen(name);
+        end -= n;
+        memcpy(w->path + end, name, n);
+        w->path[--end] = '/';
+    }
+    for (const WatchDir *d = dir; d; d = d->parent) {
+        size_t n = strlen(d->name);
+        end -= n;
+        memcpy(w->path + end, d->name, n);
+        if (d->parent) {
+            w->path[--end] = '/';
+        }
+    }
+    return w->path;
+}
+
+// Returns the position of name in dir, or where it would be inserted.
+static size_t find_entry(const WatchDir *dir, const char *name, int *found) {
+    size_t lo = 0, hi = dir->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int c = strcmp(dir->entries[mid].name, name);
+        if (c == 0) {
+            *found = 1;
+            return mid;
+        }
+        if (c < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *found = 0;
+    return lo;
+}
+
+static WatchEntry *insert_entry(WatchDir *dir, size_t pos, const char *name) {
+    dir->entries = (WatchEntry *)grow(dir->entries, &dir->capacity, dir->count + 1, sizeof(WatchEntry),
+                                      "Failed to allocate directory entries");
+    memmove(&dir->entries[pos + 1], &dir->entries[pos], (dir->count - pos) * sizeof(WatchEntry));
+    dir->count++;
+    WatchEntry *entry = &dir->entries[pos];
+    memset(entry, 0, sizeof(*entry));
+    entry->name = strdup(name);
+    if (!entry->name) {
+        perror("Failed to allocate directory entries");
+        exit(EXIT_FAILURE);
+    }
+    return entry;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    return strcmp(((const WatchEntry *)a)->name, ((const WatchEntry *)b)->name);
+}
+
+static uint64_t key_hash(const unsigned char *key, size_t len) {
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; ++i) {
+        h = (h ^ key[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static size_t handle_key(const void *fsid, const struct file_handle *fh, unsigned char *key) {
+    memcpy(key, fsid, sizeof(fsid_t));
+    memcpy(key + sizeof(fsid_t), &fh->handle_type, sizeof(int));
+    memcpy(key + sizeof(fsid_t) + sizeof(int), fh->f_handle, fh->handle_bytes);
+    return sizeof(fsid_t) + sizeof(int) + fh->handle_bytes;
+}
+
+static HandleNode **handle_link(HandleMap *map, const unsigned char *key, size_t len) {
+    HandleNode **link = &map->buckets[key_hash(key, len) & map->mask];
+    while (*link && ((*link)->len != len || memcmp((*link)->key, key, len) != 0)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+static void handle_map_init(HandleMap *map, size_t buckets) {
+    map->buckets = (HandleNode **)calloc(buckets, sizeof(HandleNode *));
+    if (!map->buckets) {
+        perror("Failed to allocate handle map");
+        exit(EXIT_FAILURE);
+    }
+    map->mask = buckets - 1;
+    map->count = 0;
+}
+
+static void handle_add(HandleMap *map, const unsigned char *key, size_t len, WatchDir *dir) {
+    if (map->count > map->mask) {
+        HandleMap bigger;
+        handle_map_init(&bigger, (map->mask + 1) * 2);
+        for (size_t b = 0; b <= map->mask; ++b) {
+            for (HandleNode *node = map->buckets[b], *next; node; node = next) {
+                next = node->next;
+                HandleNode **link = &bigger.buckets[key_hash(node->key, node->len) & bigger.mask];
+                node->next = *link;
+                *link = node;
+            }
+        }
+        bigger.count = map->count;
+        free(map->buckets);
+        *map = bigger;
+    }
+
+    // The same directory reached twice, through a bind mount, is kept
+    // under the last path it was found at.
+    HandleNode **link = handle_link(map, key, len);
+    if (*link) {
+        (*link)->dir->handle = NULL;
+        (*link)->dir = dir;
+        dir->handle = *link;
+        return;
+    }
+    HandleNode *node = (HandleNode *)malloc(sizeof(HandleNode) + len);
+    if (!node) {
+        perror("Failed to allocate handle map");
+        exit(EXIT_FAILURE);
+    }
+    node->next = NULL;
+    node->dir = dir;
+    node->len = len;
+    memcpy(node->key, key, len);
+    *link = node;
+    dir->handle = node;
+    map->count++;
+}
+
+static void handle_remove(HandleMap *map, WatchDir *dir) {
+    HandleNode *node = (HandleNode *)dir->handle;
+    HandleNode **link = handle_link(map, node->key, node->len);
+    *link = node->next;
+    free(node);
+    dir->handle = NULL;
+    map->count--;
+}
+
+static WatchDir *handle_find(HandleMap *map, const unsigned char *key, size_t len) {
+    HandleNode *node = *handle_link(map, key, len);
+    return node ? node->dir : NULL;
+}
+
+// The filesystem id of a mount, whose filesystem is marked for events the
+// first time the tree reaches into it.
+static const fsid_t *mount_fsid(Watch *w, int mount_id, const char *path) {
+    for (size_t i = 0; i < w->mount_count; ++i) {
+        if (w->mounts[i].mount_id == mount_id) {
+            return &w->mounts[i].fsid;
+        }
+    }
+    struct statfs sfs;
+    if (statfs(path, &sfs) < 0 ||
+        fanotify_mark(w->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, w->mask, AT_FDCWD, path) < 0) {
+        return NULL;
+    }
+    w->mounts = (WatchMount *)grow(w->mounts, &w->mount_capacity, w->mount_count + 1, sizeof(WatchMount),
+                                   "Failed to allocate mounts");
+    WatchMount *mount = &w->mounts[w->mount_count++];
+    mount->mount_id = mount_id;
+    mount->fsid = sfs.f_fsid;
+    return &mount->fsid;
+}
+
+// Starts watching dir, found at path. Returns -1 if the kernel refused,
+// which for inotify usually means fs.inotify.max_user_watches is too low
+// for the tree.
+static int watch_dir(Watch *w, WatchDir *dir, const char *path) {
+    if (w->backend == WATCH_INOTIFY) {
+        int wd = inotify_add_watch(w->fd, path, w->mask);
+        if (wd >= 0) {
+            size_t old_capacity = w->wd_capacity;
+            w->wds = (WatchDir **)grow(w->wds, &w->wd_capacity, (size_t)wd + 1, sizeof(WatchDir *),
+                                       "Failed to allocate watch table");
+            memset(w->wds + old_capacity, 0, (w->wd_capacity - old_capacity) * sizeof(WatchDir *));
+            w->wds[wd] = dir;
+            dir->wd = wd;
+            return 0;
+        }
+    } else {
+        unsigned char buf[sizeof(struct file_handle) + MAX_HANDLE_SZ] __attribute__((aligned(8)));
+        struct file_handle *fh = (struct file_handle *)buf;
+        fh->handle_bytes = MAX_HANDLE_SZ;
+        int mount_id;
+        const fsid_t *fsid = NULL;
+        if (name_to_handle_at(AT_FDCWD, path, fh, &mount_id, 0) == 0 &&
+            (fsid = mount_fsid(w, mount_id, path)) != NULL) {
+            unsigned char key[HANDLE_KEY_SIZE];
+            handle_add(&w->handles, key, handle_key(fsid, fh, key), dir);
+            return 0;
+        }
+    }
+    fprintf(stderr, "Failed to watch %s: %s\n", path, strerror(errno));
+    w->watch_failures++;
+    return -1;
+}
+
+static void unwatch_dir(Watch *w, WatchDir *dir) {
+    if (dir->wd >= 0) {
+        inotify_rm_watch(w->fd, dir->wd);
+        w->wds[dir->wd] = NULL;
+        dir->wd = -1;
+    }
+    if (dir->handle) {
+        handle_remove(&w->handles, dir);
+    }
+}
+
+static void unwatch_tree(Watch *w, WatchDir *dir) {
+    unwatch_dir(w, dir);
+    for (size_t i = 0; i < dir->count; ++i) {
+        if (dir->entries[i].dir) {
+            unwatch_tree(w, dir->entries[i].dir);
+        }
+    }
+}
+
+// Drops the watches of dir, an old copy of part of the tree, and below it
+// that the listing which replaced it did not take over. Watching an inode
+// again gives back its inotify wd, and a fanotify handle key passes to the
+// new directory, so only directories gone from disk still hold theirs.
+static void unwatch_replaced(Watch *w, WatchDir *dir) {
+    if (dir->wd >= 0 && w->wds[dir->wd] == dir) {
+        inotify_rm_watch(w->fd, dir->wd);
+        w->wds[dir->wd] = NULL;
+    }
+    dir->wd = -1;
+    if (dir->handle) {
+        handle_remove(&w->handles, dir);
+    }
+    for (size_t i = 0; i < dir->count; ++i) {
+        if (dir->entries[i].dir) {
+            unwatch_replaced(w, dir->entries[i].dir);
+        }
+    }
+}
+
+static size_t stash_bucket(const Watch *w, uint64_t dev, uint64_t ino) {
+    uint64_t h = ino ^ (dev * 0x9E3779B97F4A7C15ULL);
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return (size_t)(h & w->stash_mask);
+}
+
+static size_t stash_entry_bucket(const Watch *w, const WatchEntry *entry) {
+    return entry->dir ? stash_bucket(w, entry->dir->dev, entry->dir->ino) : stash_bucket(w, entry->dev, entry->ino);
+}
+
+// Chains stash entry i into its bucket, doubling the buckets first once
+// they are outnumbered by the entries.
+static void stash_link(Watch *w, size_t i) {
+    if (!w->stash_heads || w->stash_count > w->stash_mask + 1) {
+        size_t buckets = w->stash_heads ? (w->stash_mask + 1) * 2 : 64;
+        free(w->stash_heads);
+        w->stash_heads = (size_t *)malloc(buckets * sizeof(size_t));
+        if (!w->stash_heads) {
+            perror("Failed to allocate stash");
+            exit(EXIT_FAILURE);
+        }
+        memset(w->stash_heads, 0xff, buckets * sizeof(size_t));
+        w->stash_mask = buckets - 1;
+        for (size_t j = 0; j < i; ++j) {
+            stash_link(w, j);
+        }
+    }
+    size_t b = stash_entry_bucket(w, &w->stash[i]);
+    w->stash_next[i] = w->stash_heads[b];
+    w->stash_heads[b] = i;
+}
+
+// Moves entry pos of dir to the stash.
+static void remove_entry(Watch *w, WatchDir *dir, size_t pos) {
+    WatchEntry *entry = &dir->entries[pos];
+    if (entry->dir) {
+        unwatch_tree(w, entry->dir);
+        entry->dir->parent = NULL;
+    }
+    w->stash = (WatchEntry *)grow(w->stash, &w->stash_capacity, w->stash_count + 1, sizeof(WatchEntry),
+                                  "Failed to allocate stash");
+    w->stash_next = (size_t *)grow(w->stash_next, &w->stash_next_capacity, w->stash_count + 1, sizeof(size_t),
+                                   "Failed to allocate stash");
+    w->stash[w->stash_count++] = *entry;
+    stash_link(w, w->stash_count - 1);
+    memmove(entry, entry + 1, (dir->count - pos - 1) * sizeof(WatchEntry));
+    dir->count--;
+}
+
+static WatchDir *stash_dir(Watch *w, uint64_t dev, uint64_t ino) {
+    if (w->stash_count == 0) {
+        return NULL;
+    }
+    for (size_t i = w->stash_heads[stash_bucket(w, dev, ino)]; i != STASH_NONE; i = w->stash_next[i]) {
+        const WatchDir *dir = w->stash[i].dir;
+        if (dir && dir->dev == dev && dir->ino == ino) {
+            return w->stash[i].dir;
+        }
+    }
+    return NULL;
+}
+
+// A rename changes the ctime of the file renamed, so moved files are
+// matched on device, inode, size and mtime alone.
+static const WatchEntry *stash_file(Watch *w, const WatchEntry *entry) {
+    if (w->stash_count == 0) {
+        return NULL;
+    }
+    for (size_t i = w->stash_heads[stash_bucket(w, entry->dev, entry->ino)]; i != STASH_NONE; i = w->stash_next[i]) {
+        const WatchEntry *s = &w->stash[i];
+        if (!s->dir && s->state == ENTRY_CURRENT && s->dev == entry->dev && s->ino == entry->ino &&
+            s->size == entry->size && s->mtime == entry->mtime) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+static void free_stash(Watch *w) {
+    for (size_t i = 0; i < w->stash_count; ++i) {
+        if (w->stash[i].dir) {
+            free_tree(w->stash[i].dir);
+        }
+        free(w->stash[i].name);
+    }
+    if (w->stash_count > 0) {
+        memset(w->stash_heads, 0xff, (w->stash_mask + 1) * sizeof(size_t));
+    }
+    w->stash_count = 0;
+}
+
+// Brings entry name of dir in line with what is on disk now. Every event
+// is handled this way whatever its type, since the kernel merges events
+// on the same name and the order they happened in is lost. New
+// directories are listed, and files hashed, at the next flush.
+static void update_entry(Watch *w, WatchDir *dir, const char *name) {
+    struct stat st;
+    int exists = lstat(watch_path(w, dir, name), &st) == 0 && (S_ISREG(st.st_mode) || S_ISDIR(st.st_mode));
+    int found;
+    size_t pos = find_entry(dir, name, &found);
+    if (found) {
+        WatchEntry *entry = &dir->entries[pos];
+        if (exists && S_ISDIR(st.st_mode) && entry->dir && entry->dir->dev == (uint64_t)st.st_dev &&
+            entry->dir->ino == (uint64_t)st.st_ino) {
+            return;
+        }
+        if (!exists || S_ISDIR(st.st_mode) || entry->dir) {
+            remove_entry(w, dir, pos);
+            found = 0;
+        }
+    }
+    if (exists) {
+        WatchEntry *entry = found ? &dir->entries[pos] : insert_entry(dir, pos, name);
+        if (S_ISDIR(st.st_mode)) {
+            entry->dir = new_dir(dir, entry->name);
+            entry->dir->dev = st.st_dev;
+            entry->dir->ino = st.st_ino;
+        } else {
+            entry->size = st.st_size;
+            entry->dev = st.st_dev;
+            entry->ino = st.st_ino;
+            entry->mtime = timespec_ns(&st.st_mtim);
+            entry->ctime = timespec_ns(&st.st_ctim);
+            entry->state = ENTRY_HASH;
+        }
+    }
+    mark_dirty(dir);
+    set_pending(w);
+}
+
+// Lost events leave no trace of where they happened, so the whole tree is
+// listed again; only files whose metadata changed are read.
+static void rescan_all(Watch *w) {
+    w->root->unscanned = 1;
+    w->root->dirty = 1;
+    set_pending(w);
+}
+
+// Carries digests over from old, the previous contents of dir, to every
+// file whose metadata is unchanged.
+static void reuse_digests(WatchDir *dir, const WatchDir *old) {
+    for (size_t i = 0; i < dir->count; ++i) {
+        WatchEntry *entry = &dir->entries[i];
+        const WatchEntry *prev = NULL;
+        int found;
+        if (old) {
+            size_t pos = find_entry(old, entry->name, &found);
+            prev = found ? &old->entries[pos] : NULL;
+        }
+        if (entry->dir) {
+            reuse_digests(entry->dir, prev ? prev->dir : NULL);
+        } else if (prev && !prev->dir && prev->state == ENTRY_CURRENT && prev->dev == entry->dev &&
+                   prev->ino == entry->ino && prev->size == entry->size && prev->mtime == entry->mtime &&
+                   prev->ctime == entry->ctime) {
+            memcpy(entry->digest, prev->digest, DIGEST_MAX_SIZE);
+            entry->state = ENTRY_CURRENT;
+        }
+    }
+}
+
+// Lists dir from disk and rebuilds everything below it, keeping the
+// digests of files that did not change, whether they were in dir before
+// or, for a directory moved here, in the stash. The old directories stay
+// watched while dir is listed, so a change in the meantime still sends an
+// event, which lands on the new directory that takes over the watch. New
+// directories are watched once they are listed; any that changed in
+// between is put on later for another pass.
+static void scan_dir(Watch *w, WatchDir *dir) {
+    char *path = strdup(watch_path(w, dir, NULL));
+    if (!path) {
+        perror("Failed to allocate path");
+        exit(EXIT_FAILURE);
+    }
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        dir->dev = st.st_dev;
+        dir->ino = st.st_ino;
+    }
+    uint64_t started = clock_ns(CLOCK_REALTIME) - WATCH_CLOCK_SLACK;
+
+    WatchDir old = *dir;
+    dir->entries = NULL;
+    dir->count = 0;
+    dir->capacity = 0;
+
+    FileList *fl = file_list_init(16);
+    traverse_directory(path, fl, w->num_threads);
+    size_t dirs = fl->dir_count ? fl->dir_count : 1;
+    WatchDir **nodes = (WatchDir **)malloc(dirs * sizeof(WatchDir *));
+    if (!nodes) {
+        perror("Failed to allocate directories");
+        exit(EXIT_FAILURE);
+    }
+    nodes[0] = dir;
+    for (size_t d = 1; d < fl->dir_count; ++d) {
+        nodes[d] = new_dir(NULL, NULL);
+    }
+    for (size_t d = 1; d < fl->dir_count; ++d) {
+        WatchDir *parent = nodes[fl->dirs[d].parent];
+        WatchEntry *entry = insert_entry(parent, parent->count, file_list_name(fl, fl->dirs[d].name));
+        entry->dir = nodes[d];
+        nodes[d]->parent = parent;
+        nodes[d]->name = entry->name;
+    }
+    for (size_t i = 0; i < fl->size; ++i) {
+        const FileEntry *file = &fl->entries[i];
+        WatchDir *parent = nodes[file->parent];
+        WatchEntry *entry = insert_entry(parent, parent->count, file_list_name(fl, file->name));
+        entry->size = file->size;
+        entry->dev = file->dev;
+        entry->ino = file->ino;
+        entry->mtime = file->mtime;
+        entry->ctime = file->ctime;
+        entry->state = ENTRY_HASH;
+    }
+    for (size_t d = 0; d < dirs; ++d) {
+        qsort(nodes[d]->entries, nodes[d]->count, sizeof(WatchEntry), compare_entries);
+    }
+    // Names only point into entries whose array may have moved; fix them.
+    for (size_t d = 0; d < dirs; ++d) {
+        for (size_t i = 0; i < nodes[d]->count; ++i) {
+            if (nodes[d]->entries[i].dir) {
+                nodes[d]->entries[i].dir->name = nodes[d]->entries[i].name;
+            }
+        }
+    }
+
+    reuse_digests(dir, old.count ? &old : stash_dir(w, dir->dev, dir->ino));
+
+    for (size_t d = 0; d < dirs; ++d) {
+        const char *dir_path = d ? watch_path(w, nodes[d], NULL) : path;
+        if ((nodes[d]->wd >= 0 || nodes[d]->handle || watch_dir(w, nodes[d], dir_path) == 0) &&
+            lstat(dir_path, &st) == 0) {
+            nodes[d]->dev = st.st_dev;
+            nodes[d]->ino = st.st_ino;
+            if (timespec_ns(&st.st_mtim) >= started) {
+                dir_list_push(&w->later, nodes[d]);
+            }
+        }
+        nodes[d]->unscanned = 0;
+        nodes[d]->dirty = 1;
+    }
+    for (size_t i = 0; i < old.count; ++i) {
+        if (old.entries[i].dir) {
+            unwatch_replaced(w, old.entries[i].dir);
+            free_tree(old.entries[i].dir);
+        }
+        free(old.entries[i].name);
+    }
+    free(old.entries);
+
+    free(nodes);
+    file_list_free(fl);
+    free(path);
+}
+
+static void find_unscanned(WatchDir *dir, DirList *list) {
+    for (size_t i = 0; i < dir->count; ++i) {
+        WatchDir *child = dir->entries[i].dir;
+        if (child && child->dirty) {
+            if (child->unscanned) {
+                dir_list_push(list, child);
+            } else {
+                find_unscanned(child, list);
+            }
+        }
+    }
+}
+
+// Gathers the files below dirty directories that need hashing into fl,
+// file i of fl belonging to entry (*targets)[i]. Files moved within the
+// tree take their digest from the stash instead.
+static void collect(Watch *w, WatchDir *dir, FileList *fl, WatchEntry ***targets, size_t *capacity) {
+    uint32_t parent = FILE_LIST_NO_PARENT;
+    for (size_t i = 0; i < dir->count; ++i) {
+        WatchEntry *entry = &dir->entries[i];
+        if (entry->dir) {
+            if (entry->dir->dirty) {
+                collect(w, entry->dir, fl, targets, capacity);
+            }
+            continue;
+        }
+        if (entry->state != ENTRY_HASH) {
+            continue;
+        }
+        const WatchEntry *moved = stash_file(w, entry);
+        if (moved) {
+            memcpy(entry->digest, moved->digest, DIGEST_MAX_SIZE);
+            entry->state = ENTRY_CURRENT;
+            continue;
+        }
+        if (parent == FILE_LIST_NO_PARENT) {
+            parent = (uint32_t)fl->dir_count;
+            file_list_add_dir(fl, parent, FILE_LIST_NO_PARENT, watch_path(w, dir, NULL));
+        }
+        file_list_add(fl, parent, entry->name, entry->size, entry->ino, entry->dev, entry->mtime, entry->ctime);
+        *targets = (WatchEntry **)grow(*targets, capacity, fl->size, sizeof(WatchEntry *),
+                                       "Failed to allocate file list");
+        (*targets)[fl->size - 1] = entry;
+    }
+}
+
+static void hash_collected(Watch *w, const FileList *fl, WatchEntry **targets) {
+    size_t size = w->alg->size;
+    uint8_t *digests = (uint8_t *)malloc((fl->size ? fl->size : 1) * size);
+    if (!digests) {
+        perror("Failed to allocate file hashes");
+        exit(EXIT_FAILURE);
+    }
+    size_t num_batches = (fl->size + HASH_BATCH_SIZE - 1) / HASH_BATCH_SIZE;
+    #pragma omp parallel for num_threads(w->num_threads) schedule(dynamic)
+    for (size_t batch = 0; batch < num_batches; ++batch) {
+        size_t begin = batch * HASH_BATCH_SIZE;
+        size_t count = fl->size - begin < HASH_BATCH_SIZE ? fl->size - begin : HASH_BATCH_SIZE;
+        hash_engine_hash_files(&w->engines[omp_get_thread_num()], fl, NULL, begin, count, digests + begin * size);
+    }
+    for (size_t i = 0; i < w->num_threads; ++i) {
+        hash_engine_release(&w->engines[i]);
+    }
+    for (size_t i = 0; i < fl->size; ++i) {
+        memcpy(targets[i]->digest, digests + i * size, size);
+        targets[i]->state = ENTRY_CURRENT;
+    }
+    free(digests);
+}
+
+// Hashes every dirty directory from its children, as merkle.c does.
+static void recompute(Watch *w, WatchDir *dir) {
+    for (size_t i = 0; i < dir->count; ++i) {
+        if (dir->entries[i].dir && dir->entries[i].dir->dirty) {
+            recompute(w, dir->entries[i].dir);
+        }
+    }
+    const DigestAlgorithm *alg = w->alg;
+    DigestState state;
+    alg->init(&state);
+    for (size_t i = 0; i < dir->count; ++i) {
+        const WatchEntry *entry = &dir->entries[i];
+        merkle_hash_child(alg, &state, entry->dir != NULL, entry->name,
+                          entry->dir ? entry->dir->digest : entry->digest);
+    }
+    alg->final(&state, dir->digest);
+    dir->dirty = 0;
+}
+
+// Applies everything queued since the last flush: lists new and
+// overflowed directories, hashes changed files, and recomputes the
+// digests from them up to the root.
+static void flush(Watch *w) {
+    w->pending = 0;
+    DirList scans = { NULL, 0, 0 };
+    if (w->root->unscanned) {
+        dir_list_push(&scans, w->root);
+    } else if (w->root->dirty) {
+        find_unscanned(w->root, &scans);
+    }
+    for (size_t i = 0; i < scans.count; ++i) {
+        scan_dir(w, scans.items[i]);
+    }
+    free(scans.items);
+
+    FileList *fl = file_list_init(16);
+    WatchEntry **targets = NULL;
+    size_t capacity = 0;
+    if (w->root->dirty) {
+        collect(w, w->root, fl, &targets, &capacity);
+    }
+    hash_collected(w, fl, targets);
+    file_list_free(fl);
+    free(targets);
+
+    if (w->root->dirty) {
+        recompute(w, w->root);
+    }
+    free_stash(w);
+
+    for (size_t i = 0; i < w->later.count; ++i) {
+        w->later.items[i]->unscanned = 1;
+        mark_dirty(w->later.items[i]);
+        set_pending(w);
+    }
+    w->later.count = 0;
+}
+
+static void read_inotify(Watch *w) {
+    char buf[WATCH_EVENT_BUFFER] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t len = read(w->fd, buf, sizeof(buf));
+        if (len <= 0) {
+            if (len < 0 && errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        for (char *p = buf; p < buf + len;) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                rescan_all(w);
+                continue;
+            }
+            WatchDir *dir = ev->wd >= 0 && (size_t)ev->wd < w->wd_capacity ? w->wds[ev->wd] : NULL;
+            if (!dir) {
+                continue;
+            }
+            if (ev->mask & IN_IGNORED) {
+                w->wds[ev->wd] = NULL;
+                dir->wd = -1;
+            } else if (ev->len > 0) {
+                update_entry(w, dir, ev->name);
+            }
+        }
+    }
+}
+
+// Events name the parent directory by handle and the child by name.
+// Directories outside the tree are on the same filesystem marks and are
+// simply not found.
+static void read_fanotify(Watch *w) {
+    char buf[WATCH_EVENT_BUFFER] __attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+    for (;;) {
+        ssize_t len = read(w->fd, buf, sizeof(buf));
+        if (len <= 0) {
+            if (len < 0 && errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        struct fanotify_event_metadata *ev = (struct fanotify_event_metadata *)buf;
+        for (; FAN_EVENT_OK(ev, len); ev = FAN_EVENT_NEXT(ev, len)) {
+            if (ev->vers != FANOTIFY_METADATA_VERSION) {
+                continue;
+            }
+            if (ev->mask & FAN_Q_OVERFLOW) {
+                rescan_all(w);
+                continue;
+            }
+            const struct fanotify_event_info_fid *info =
+                (const struct fanotify_event_info_fid *)((const char *)ev + ev->metadata_len);
+            if (ev->event_len < ev->metadata_len + sizeof(*info) ||
+                info->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME) {
+                continue;
+            }
+            const struct file_handle *fh = (const struct file_handle *)info->handle;
+            const char *name = (const char *)fh->f_handle + fh->handle_bytes;
+            if (fh->handle_bytes > MAX_HANDLE_SZ || strcmp(name, ".") == 0) {
+                continue;
+            }
+            unsigned char key[HANDLE_KEY_SIZE];
+            WatchDir *dir = handle_find(&w->handles, key, handle_key(&info->fsid, fh, key));
+            if (dir) {
+                update_entry(w, dir, name);
+            }
+        }
+    }
+}
+
+// fanotify is preferred: one mark per filesystem covers every directory,
+// where inotify needs a watch for each. It takes CAP_SYS_ADMIN and a
+// kernel with FAN_REPORT_DFID_NAME, and inotify is used without them.
+static int open_backend(Watch *w, const char *path) {
+    w->backend = WATCH_FANOTIFY;
+    w->mask = FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_MODIFY | FAN_CLOSE_WRITE | FAN_ONDIR;
+    w->fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_CLOEXEC | FAN_NONBLOCK, O_RDONLY | O_LARGEFILE);
+    if (w->fd >= 0 && fanotify_mark(w->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, w->mask, AT_FDCWD, path) == 0) {
+        handle_map_init(&w->handles, 1024);
+        return 0;
+    }
+    if (w->fd >= 0) {
+        close(w->fd);
+    }
+
+    w->backend = WATCH_INOTIFY;
+    w->mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE | IN_ONLYDIR |
+              IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+    w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (w->fd < 0) {
+        perror("Failed to initialize inotify");
+        return -1;
+    }
+    return 0;
+}
+
+// A socket left behind by a daemon that is gone is replaced; one that
+// still answers is not.
+static int open_socket(const char *socket_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    struct stat st;
+    if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int live = probe >= 0 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        if (probe >= 0) {
+            close(probe);
+        }
+        if (live) {
+            fprintf(stderr, "%s is in use by another daemon\n", socket_path);
+            return -1;
+        }
+        unlink(socket_path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        fprintf(stderr, "Failed to listen on %s: %s\n", socket_path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+// Reads one request line from a client and answers it. "root" is answered
+// with the current root digest in hex, after applying whatever is still
+// queued.
+static void answer(Watch *w, int listen_fd) {
+    int client = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (client < 0) {
+        return;
+    }
+    struct timeval timeout = { WATCH_CLIENT_TIMEOUT_MS / 1000, (WATCH_CLIENT_TIMEOUT_MS % 1000) * 1000 };
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    char request[64];
+    size_t len = 0;
+    while (len < sizeof(request) - 1 && !memchr(request, '\n', len)) {
+        ssize_t n = read(client, request + len, sizeof(request) - 1 - len);
+        if (n <= 0) {
+            break;
+        }
+        len += (size_t)n;
+    }
+    request[len] = '\0';
+    request[strcspn(request, "\r\n")] = '\0';
+
+    char reply[2 * DIGEST_MAX_SIZE + 32];
+    if (strcmp(request, "root") == 0) {
+        if (w->pending) {
+            flush(w);
+        }
+        char hex[2 * DIGEST_MAX_SIZE + 1];
+        digest_format(w->root->digest, w->alg->size, hex);
+        snprintf(reply, sizeof(reply), "%s\n", hex);
+    } else {
+        snprintf(reply, sizeof(reply), "error unknown request\n");
+    }
+    send(client, reply, strlen(reply), MSG_NOSIGNAL);
+    close(client);
+}
+
+static void close_watch(Watch *w) {
+    if (w->root) {
+        free_tree(w->root);
+    }
+    free_stash(w);
+    free(w->stash);
+    free(w->stash_next);
+    free(w->stash_heads);
+    if (w->handles.buckets) {
+        for (size_t b = 0; b <= w->handles.mask; ++b) {
+            for (HandleNode *node = w->handles.buckets[b], *next; node; node = next) {
+                next = node->next;
+                free(node);
+            }
+        }
+        free(w->handles.buckets);
+    }
+    free(w->wds);
+    free(w->mounts);
+    free(w->later.items);
+    free(w->path);
+    free(w->root_path);
+    close(w->fd);
+}
+
+// Hashes the tree at path once, as --merkle does, then keeps its digest up
+// to date from change notifications instead of hashing it again: only
+// changed files are read, and only the directories above them rehashed.
+// Changes are applied once events have been quiet for WATCH_SETTLE_MS, or
+// at the latest WATCH_MAX_DELAY_MS after the first, and whenever a client
+// on socket_path asks for the root. Worker n hashes with engines[n]. Only
+// returns on failure, with -1.
+int watch_serve(const char *path, const char *socket_path, size_t num_threads, HashEngine *engines, int report) {
+    Watch w;
+    memset(&w, 0, sizeof(w));
+    w.alg = engines->settings->digest;
+    w.num_threads = num_threads;
+    w.engines = engines;
+    if (open_backend(&w, path) < 0) {
+        return -1;
+    }
+    int listen_fd = open_socket(socket_path);
+    if (listen_fd < 0) {
+        close_watch(&w);
+        return -1;
+    }
+
+    w.root_path = strdup(path);
+    if (!w.root_path) {
+        perror("Failed to allocate path");
+        exit(EXIT_FAILURE);
+    }
+    w.root = new_dir(NULL, w.root_path);
+    flush(&w);
+    if (w.watch_failures) {
+        fprintf(stderr, "Could not watch every directory of %s\n", path);
+        close(listen_fd);
+        unlink(socket_path);
+        close_watch(&w);
+        return -1;
+    }
+    if (report) {
+        char hex[2 * DIGEST_MAX_SIZE + 1];
+        digest_format(w.root->digest, w.alg->size, hex);
+        printf("Watching %s with %s.\n", path, w.backend == WATCH_FANOTIFY ? "fanotify" : "inotify");
+        printf("\nFinal directory hash: %s\n", hex);
+        printf("Answering on %s\n", socket_path);
+        fflush(stdout);
+    }
+
+    struct pollfd fds[2] = { { w.fd, POLLIN, 0 }, { listen_fd, POLLIN, 0 } };
+    for (;;) {
+        int timeout = -1;
+        if (w.pending) {
+            uint64_t waited = (clock_ns(CLOCK_MONOTONIC) - w.pending_since) / 1000000;
+            if (waited >= WATCH_MAX_DELAY_MS) {
+                flush(&w);
+                continue;
+            }
+            timeout = WATCH_MAX_DELAY_MS - waited < WATCH_SETTLE_MS ? (int)(WATCH_MAX_DELAY_MS - waited)
+                                                                    : WATCH_SETTLE_MS;
+        }
+        int n = poll(fds, 2, timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Failed to wait for events");
+            break;
+        }
+        if (n == 0) {
+            flush(&w);
+            continue;
+        }
+        if (fds[0].revents & POLLIN) {
+            if (w.backend == WATCH_FANOTIFY) {
+                read_fanotify(&w);
+            } else {
+                read_inotify(&w);
+            }
+        }
+        if (fds[1].revents & POLLIN) {
+            answer(&w, listen_fd);
+        }
+    }
+
+    close(listen_fd);
+    unlink(socket_path);
+    close_watch(&w);
+    return -1;
+}
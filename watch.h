@@ -0,0 +1,46 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "digest.h"
+#include "hashing.h"
+
+typedef struct WatchDir WatchDir;
+
+// One child of a watched directory: a regular file, or a subdirectory when
+// dir is set. state says whether digest is current.
+typedef struct {
+    char *name;
+    WatchDir *dir;
+    uint64_t size;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t mtime;
+    uint64_t ctime;
+    int state;
+    uint8_t digest[DIGEST_MAX_SIZE];
+} WatchEntry;
+
+// A directory of the live tree. Entries are kept sorted by name, so the
+// digest is computed exactly as merkle.c does. dirty is set on every
+// directory above a change until the next flush recomputes it; unscanned
+// marks a directory whose contents must be listed from disk again.
+struct WatchDir {
+    WatchDir *parent;
+    const char *name;
+    WatchEntry *entries;
+    size_t count;
+    size_t capacity;
+    uint64_t dev;
+    uint64_t ino;
+    int wd;
+    void *handle;
+    int dirty;
+    int unscanned;
+    uint8_t digest[DIGEST_MAX_SIZE];
+};
+
+int watch_serve(const char *path, const char *socket_path, size_t num_threads, HashEngine *engines, int report);
+
+#endif